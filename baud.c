@@ -0,0 +1,88 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Custom line speeds
+//
+// A rate that is not one of the standard Bnnn speeds is set with the
+// termios2 ioctls, which take the rate itself. struct termios2 comes
+// from <asm/termbits.h>, which clashes with the <termios.h> the rest of
+// the serial code uses and differs between architectures, so it is kept
+// to this file. Elsewhere only the standard speeds are available.
+//
+
+
+
+#include "common.h"
+
+#ifdef LINUX
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+#endif // LINUX
+
+
+
+//
+// set the line on fd to any rate, returns the rate the driver set or -1
+//
+int32_t baudany (int32_t fd,
+		 int32_t rate)
+{
+#if defined(LINUX) && defined(TCGETS2) && defined(BOTHER)
+    struct termios2 line;
+
+    if (ioctl(fd, TCGETS2, &line)) return -1;
+    line.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    line.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    line.c_ispeed = line.c_ospeed = rate;
+    if (ioctl(fd, TCSETS2, &line)) return -1;
+
+    // the driver says what its divisor really gives
+    if (ioctl(fd, TCGETS2, &line)) return -1;
+    return line.c_ospeed;
+#else // !LINUX || !TCGETS2 || !BOTHER
+    return -1;
+#endif // !LINUX || !TCGETS2 || !BOTHER
+}
+
+
+
+// the end
@@ -69,20 +69,86 @@ typedef struct timespec timespec_t;
 
 // Constants
 
-#define NTU58		8	// number of devices to emulate (0..N-1)
+#define NTU58		256	// most devices to emulate (0..N-1), the protocol limit
 
-#define TAPESIZE	512	// number of blocks per tape
+#define TAPESIZE	512	// default number of blocks per new tape
+#define TAPEMIN		64	// fewest blocks in a new tape
+#define TAPEMAX		65536	// most blocks in a tape, the protocol limit
+#define RT11MAX		65535	// most blocks in an RT-11 volume
 #define BLOCKSIZE	512	// number of bytes per block
 
+#define SCRUBIDLE	2	// seconds a unit must be idle to be scrubbed
+#define SCRUBBATCH	32	// blocks scrubbed per unit per interval
+#define SCRUBWAIT	100	// ms scrubber interval
+
+#define AHEADSLOTS	32	// read-ahead buffers per unit
+#define AHEADDEPTH	16	// most blocks staged ahead of the host
+
+#define HEATWARM	2048	// most blocks preloaded from an access profile
+
+#define HOLDWAIT	2000	// ms to wait for a host command to finish before a swap
+
+#define CTLLINE		256	// longest control command line
+#define CTLARGS		8	// most words in a control command
+#define CTLCLIENTS	8	// most control socket clients served at once
+#define CTLOUTMAX	65536	// most reply bytes held for a client not reading them
+
+#define NBDSLOTS	16	// most NBD requests in flight per unit
+#define NBDAHEAD	8	// blocks asked for on an NBD read miss
+
 #define FILEREAD	1	// file can be read
 #define FILEWRITE	2	// file can be written
 #define FILECREATE	3	// file should be created
 #define FILERT11INIT	4	// file should be init'ed as RT11 structure
 #define FILEXXDPINIT	5	// file should be init'ed as XXDP structure
 
+#define FILETYPE_RAW	0	// image is a raw byte for byte file
+#define FILETYPE_SPARSE	1	// image is a sparse compressed container
+#define FILETYPE_STORE	2	// image is an index into a block store
+#define FILETYPE_VDIR	3	// image is a host directory shown as an RT-11 volume
+#define FILETYPE_NBD	4	// image is an export of an NBD server
+
 #define DEV_NORMAL	0	// normal data byte
 #define DEV_BREAK	1	// BREAK on line
 #define DEV_ERROR	2	// ERROR on byte
+#define DEV_STOP	3	// woken by devwake(), no byte
+
+
+
+// Types
+
+// unit summary returned by fileinfo()
+
+typedef struct {
+    char	name[CTLLINE];	// image file name
+    char	*state;		// "pending", "open" or "failed"
+    uint8_t	write;		// nonzero if writes are allowed
+    int32_t	nblocks;	// blocks in the image, 0 until opened
+    uint32_t	rbytes;		// bytes read by the host
+    uint32_t	wbytes;		// bytes written by the host
+    int32_t	ahead;		// nonzero if read-ahead is on
+    uint32_t	hits;		// read-ahead hits
+    uint32_t	misses;		// read-ahead misses
+    uint32_t	wasted;		// read-ahead blocks never read
+} unit_info;
+
+// one file of an RT-11 or XXDP directory
+
+typedef struct {
+    char	name[11];	// NAME.EXT
+    int32_t	start;		// first block
+    int32_t	length;		// blocks
+    uint16_t	date;		// creation date, in the format of the volume
+} vol_file;
+
+// durations kept by rtmetricadd() for the stats
+
+typedef struct {
+    uint32_t	n;		// number taken
+    uint64_t	total;		// us they took in all
+    uint32_t	worst;		// us the longest took
+    uint32_t	last;		// us the last took
+} rt_metric;
 
 
 
@@ -93,6 +159,9 @@ void fatal (char *, ...);
 void error (char *, ...);
 void info (char *, ...);
 
+// baud.c
+int32_t baudany (int32_t, int32_t);
+
 // serial.c
 void devtxbreak (void);
 void devtxstop (void);
@@ -101,26 +170,161 @@ void devtxinit (void);
 void devtxflush (void);
 void devtxput (uint8_t);
 int32_t devtxwrite (uint8_t *, int32_t);
+int32_t devtxpace (uint32_t *, uint32_t *);
+uint32_t devcharns (void);
 void devrxinit (void);
 int32_t devrxavail (void);
+int32_t devrxbreak (timespec_t *);
+int32_t devrxwait (int32_t);
+void devwake (void);
 uint8_t devrxget (uint8_t *);
 void devinit (char *, int32_t, int32_t);
 void devrestore (void);
 void coninit (void);
 void conrestore (void);
 int32_t conget (void);
+void consignals (void);
+int32_t consigfd (void);
+int32_t consigget (void);
 
 // file.c
 void fileinit (void);
-int32_t fileopen (char *, int32_t);
+int32_t fileopen (char *, int32_t, char *);
+void filestart (void);
+int32_t filehold (int32_t);
+void filerelease (int32_t);
+int32_t fileinsert (int32_t, char *, int32_t);
+int32_t fileeject (int32_t);
+int32_t fileprotect (int32_t, int32_t);
+int32_t fileinfo (int32_t, unit_info *);
 int32_t fileunit (int32_t);
 int32_t fileseek (int32_t, int32_t, int32_t, int32_t);
 int32_t fileread (int32_t, uint8_t *, int32_t);
 int32_t filewrite (int32_t, uint8_t *, int32_t);
+int32_t fileflush (int32_t);
+int32_t filescrub (void);
+int32_t fileexport (int32_t, char *);
+int32_t fileapply (int32_t, char *);
+int32_t filediff (int32_t, char *);
+int32_t filepatch (int32_t, char *);
+void fileahead (int32_t, int32_t);
+void fileaheadstats (int32_t);
+void fileprefault (void);
+void filewait (void);
 void fileclose (void);
 
+// sparse.c
+void sparseinit (void);
+int32_t sparseopen (int32_t, int32_t);
+int32_t sparsecreate (int32_t, int32_t, int32_t, int32_t);
+int32_t sparseread (int32_t, int32_t, uint8_t *);
+int32_t sparsewrite (int32_t, int32_t, uint8_t *);
+void sparseclose (int32_t);
+
+// store.c
+void storeinit (void);
+int32_t storeopen (int32_t, int32_t);
+int32_t storecreate (int32_t, int32_t, char *, int32_t);
+int32_t storeread (int32_t, int32_t, uint8_t *);
+int32_t storewrite (int32_t, int32_t, uint8_t *);
+int32_t storegc (char *);
+void storeclose (int32_t);
+
+// merkle.c
+void merkleinit (void);
+int32_t merkleopen (int32_t, char *, int32_t, int32_t);
+void merkleleaf (int32_t, int32_t, uint8_t *);
+int32_t merklesave (int32_t);
+int32_t merkleupdate (int32_t, int32_t, uint8_t *);
+int32_t merklediff (int32_t, char *, uint8_t *);
+void merkleclose (int32_t);
+
+// heat.c
+void heatinit (void);
+int32_t heatopen (int32_t, char *, int32_t);
+int32_t heatblock (int32_t, int32_t);
+void heatfill (int32_t, int32_t, uint8_t *);
+void heattouch (int32_t, int32_t);
+int32_t heatget (int32_t, int32_t, uint8_t *);
+void heatdrop (int32_t, int32_t);
+void heatclose (int32_t);
+
+// shm.c
+void shminit (void);
+int32_t shmopen (int32_t, int32_t, int32_t);
+int32_t shmshared (int32_t);
+int32_t shmcacheget (int32_t, int32_t, uint8_t *, uint32_t *);
+void shmcacheput (int32_t, int32_t, uint8_t *, uint32_t);
+void shmwrite (int32_t, int32_t, uint8_t *);
+void shmclose (int32_t);
+
+// rt11.c
+int32_t rt11_segments (int32_t);
+int32_t rt11_sysblocks (int32_t);
+int32_t rt11_capacity (int32_t);
+void rad50name (char *, uint16_t *);
+void unrad50name (uint16_t *, char *);
+int32_t rt11name (char *, char *);
+void rt11host (char *, char *);
+uint16_t rt11date (time_t);
+int32_t rt11format (uint8_t *, int32_t, int32_t, vol_file *, int32_t);
+int32_t rt11dir (int32_t (*)(void *, int32_t, uint8_t *), void *, vol_file *, int32_t);
+int32_t rt11list (uint8_t *, int32_t, vol_file *, int32_t);
+int32_t rt11add (uint8_t *, int32_t, char *, uint8_t *, int32_t, uint16_t);
+
+// xxdp.c
+int32_t xxdp_sysblocks (int32_t);
+uint16_t xxdpdate (time_t);
+int32_t xxdpformat (uint8_t *, int32_t);
+int32_t xxdpdir (uint8_t *, int32_t, vol_file *, int32_t);
+int32_t xxdpread (uint8_t *, int32_t, vol_file *, uint8_t *);
+int32_t xxdpadd (uint8_t *, int32_t, char *, uint8_t *, int32_t, uint16_t);
+
+// vdir.c
+void vdirinit (void);
+int32_t vdiropen (int32_t, char *, int32_t, int32_t);
+int32_t vdirread (int32_t, int32_t, uint8_t *);
+int32_t vdirwrite (int32_t, int32_t, uint8_t *);
+void vdirclose (int32_t);
+
+// nbd.c
+void nbdinit (void);
+int32_t nbdname (char *);
+int32_t nbdopen (int32_t, char *, int32_t *);
+int32_t nbdreadonly (int32_t);
+int32_t nbdread (int32_t, int32_t, uint8_t *);
+int32_t nbdwrite (int32_t, int32_t, uint8_t *);
+int32_t nbdflush (int32_t);
+void nbdclose (int32_t);
+
+// rt.c
+void rtinit (void);
+void rtrun (void);
+void rthelper (void);
+void rtcommand (void);
+void rtanswer (void);
+void rtstats (uint32_t *, uint32_t *, uint32_t *);
+uint32_t rtmetricadd (rt_metric *, timespec_t *);
+void rtmetricget (rt_metric *, uint32_t *, uint32_t *, uint32_t *, uint32_t *);
+
+// ctl.c
+int32_t ctlcatalog (char *);
+int32_t ctlexec (char *, int32_t);
+int32_t ctlstart (char *);
+struct pollfd;
+int32_t ctlpoll (struct pollfd *);
+void ctlevent (struct pollfd *, int32_t);
+void ctlstop (void);
+
+// hash.c
+uint32_t crc32c (const uint8_t *, int32_t);
+void sha256 (const uint8_t *, int32_t, uint8_t *);
+
 // tu58drive.c
 void tu58drive (void);
+void tu58key (uint8_t);
+void tu58resync (uint32_t *, uint32_t *, uint32_t *, uint32_t *);
+void tu58abort (uint32_t *, uint32_t *, uint32_t *, uint32_t *);
 
 
 // Globals
@@ -132,6 +336,23 @@ extern uint8_t timing;
 extern uint8_t mrspen;
 extern uint8_t vax;
 extern uint8_t background;
+extern uint8_t dirtymap;
+extern uint8_t sparseimg;
+extern uint8_t compress;
+extern uint8_t crcindex;
+extern uint8_t hashtree;
+extern uint8_t prefetch;
+extern uint8_t profile;
+extern int32_t tapesize;
+extern uint8_t sharecache;
+extern uint8_t writeback;
+extern uint8_t pace;
+extern int32_t txgap;
+extern uint8_t latency;
+extern uint8_t rtprio;
+extern int32_t runcpu;
+extern int32_t helpcpu;
+extern int32_t mrspwindow;
 
 
 // the end
@@ -0,0 +1,748 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Runtime control
+//
+// Images can be put in and taken out of units while the emulator runs,
+// from the console (a ':' starts a command line) or from a client of a
+// Unix domain control socket. Commands are one line each; the reply is
+// any number of lines ending with "OK" or "ERROR message". Besides changing
+// images, commands list the units and their counters, write protect a
+// unit, change the timing delays and restart the emulator. Images may be
+// named by path or, when a catalog directory was given, by the name of
+// a file in it, with or without its extension. The socket is served by
+// the console loop, which takes several clients at once and never blocks
+// on one: replies are held and written as the client reads them, and a
+// client that lets too much pile up is dropped, as is the least recently
+// active one when a new client finds every place taken.
+//
+
+
+
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+
+// one image in the catalog
+
+typedef struct {
+    char	*name;		// file name within the catalog directory
+    char	*path;		// full path
+    int32_t	nblocks;	// size in blocks
+} ctl_entry;
+
+static ctl_entry *catalog = NULL; // catalog images, sorted by name
+static int32_t ncatalog = 0; // number of catalog images
+
+static char *sockpath = NULL; // control socket path, NULL if none
+static int32_t sockfd = -1; // listening control socket
+
+// one connected client
+
+typedef struct {
+    int32_t	fd;		// socket, -1 if the place is free
+    char	line[CTLLINE];	// partial command line
+    int32_t	len;		// characters in it
+    char	*out;		// reply not yet taken by the client
+    int32_t	outlen;		// bytes of it
+    uint32_t	used;		// when last active, as a count of events
+} ctl_client;
+
+static ctl_client client[CTLCLIENTS]; // clients being served
+static uint32_t ctlticks = 0; // events served so far
+
+
+
+//
+// find the client on a descriptor, NULL if it is not one
+//
+static ctl_client *ctlclient (int32_t fd)
+{
+    int32_t i;
+
+    if (sockfd < 0) return NULL;
+    for (i = 0; i < CTLCLIENTS; i++)
+	if (fd >= 0 && client[i].fd == fd) return &client[i];
+
+    return NULL;
+}
+
+
+
+//
+// let a client go
+//
+static void ctldrop (ctl_client *c)
+{
+    close(c->fd);
+    c->fd = -1;
+    if (c->out) free(c->out);
+    c->out = NULL;
+    c->outlen = 0;
+    c->len = 0;
+    return;
+}
+
+
+
+//
+// write a reply line to fd; a client's reply is held until it reads it
+//
+static void reply (int32_t fd,
+		   char *fmt, ...)
+{
+    ctl_client *c = ctlclient(fd);
+    va_list args;
+    char *more;
+    int32_t n;
+
+    if (!c) {
+	va_start(args, fmt);
+	vdprintf(fd, fmt, args);
+	va_end(args);
+	return;
+    }
+
+    // one that has stopped reading has been dropped already
+    if (c->outlen < 0) return;
+
+    va_start(args, fmt);
+    n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (c->outlen+n+1 > CTLOUTMAX || (more = realloc(c->out, c->outlen+n+1)) == NULL) {
+	c->outlen = -1;
+	return;
+    }
+    c->out = more;
+
+    va_start(args, fmt);
+    vsnprintf(c->out+c->outlen, n+1, fmt, args);
+    va_end(args);
+    c->outlen += n;
+
+    return;
+}
+
+
+
+//
+// write as much of a client's reply as it will take, dropping it if gone
+//
+static void ctlflush (ctl_client *c)
+{
+    int32_t n;
+
+    if (c->outlen < 0) {
+	error("ctlflush client not reading its replies, dropped");
+	ctldrop(c);
+	return;
+    }
+    if (c->outlen == 0) return;
+
+    if ((n = write(c->fd, c->out, c->outlen)) < 0) {
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ctldrop(c);
+	return;
+    }
+    c->outlen -= n;
+    memmove(c->out, c->out+n, c->outlen);
+
+    return;
+}
+
+
+
+//
+// compare catalog entries by name
+//
+static int entrycmp (const void *a,
+		     const void *b)
+{
+    return strcmp(((ctl_entry *)a)->name, ((ctl_entry *)b)->name);
+}
+
+
+
+//
+// index the images in a catalog directory
+//
+int32_t ctlcatalog (char *dir)
+{
+    struct dirent *de;
+    struct stat st;
+    ctl_entry *more;
+    char *path;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == NULL) {
+	error("ctlcatalog cannot open directory '%s'", dir);
+	return -1;
+    }
+
+    while ((de = readdir(dp)) != NULL) {
+	if (de->d_name[0] == '.') continue;
+	if ((path = malloc(strlen(dir)+strlen(de->d_name)+2)) == NULL) break;
+	sprintf(path, "%s/%s", dir, de->d_name);
+	// only regular files of whole blocks look like images
+	if (stat(path, &st) || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size % BLOCKSIZE) {
+	    free(path);
+	    continue;
+	}
+	if ((more = realloc(catalog, (ncatalog+1)*sizeof(*catalog))) == NULL) { free(path); break; }
+	catalog = more;
+	catalog[ncatalog].name = strdup(de->d_name);
+	catalog[ncatalog].path = path;
+	catalog[ncatalog].nblocks = st.st_size / BLOCKSIZE;
+	ncatalog++;
+    }
+    closedir(dp);
+
+    qsort(catalog, ncatalog, sizeof(*catalog), entrycmp);
+
+    info("catalog '%s' has %d images", dir, ncatalog);
+    return 0;
+}
+
+
+
+//
+// find the path of an image by catalog name, else take it as a path
+//
+// returns NULL if the name without an extension fits more than one image
+//
+static char *ctlfind (char *name)
+{
+    int32_t len = strlen(name);
+    char *path = NULL;
+    int32_t n = 0;
+    int32_t i;
+
+    for (i = 0; i < ncatalog; i++)
+	if (!strcmp(catalog[i].name, name)) return catalog[i].path;
+
+    // the name without its extension will do if it is unique
+    for (i = 0; i < ncatalog; i++) {
+	if (strncmp(catalog[i].name, name, len) || catalog[i].name[len] != '.'
+	    || strchr(catalog[i].name+len+1, '.')) continue;
+	path = catalog[i].path;
+	n++;
+    }
+
+    if (n > 1) return NULL;
+    return n ? path : name;
+}
+
+
+
+//
+// catalog - list the catalog images
+//
+static int32_t cmdcatalog (int32_t fd,
+			   int32_t argc,
+			   char *argv[])
+{
+    int32_t i;
+
+    for (i = 0; i < ncatalog; i++)
+	reply(fd, "%-24s %6d blocks\n", catalog[i].name, catalog[i].nblocks);
+
+    return 0;
+}
+
+
+
+//
+// insert UNIT IMAGE [ro|rw] - put an image in a unit
+//
+static int32_t cmdinsert (int32_t fd,
+			  int32_t argc,
+			  char *argv[])
+{
+    int32_t unit = atoi(argv[1]);
+    char *path = ctlfind(argv[2]);
+    int32_t write;
+
+    if (!path) {
+	reply(fd, "ERROR '%s' fits more than one catalog image\n", argv[2]);
+	return -1;
+    }
+    write = access(path, W_OK) == 0;
+
+    if (argc > 3) {
+	if (!strcmp(argv[3], "ro")) write = 0;
+	else if (!strcmp(argv[3], "rw")) write = 1;
+	else { reply(fd, "ERROR mode must be ro or rw\n"); return -1; }
+    }
+
+    if (fileinsert(unit, path, write)) {
+	reply(fd, "ERROR cannot insert '%s' in unit %d\n", path, unit);
+	return -1;
+    }
+
+    return 0;
+}
+
+
+
+//
+// eject UNIT - take the image out of a unit
+//
+static int32_t cmdeject (int32_t fd,
+			 int32_t argc,
+			 char *argv[])
+{
+    int32_t unit = atoi(argv[1]);
+
+    if (fileeject(unit)) {
+	reply(fd, "ERROR cannot eject unit %d\n", unit);
+	return -1;
+    }
+
+    return 0;
+}
+
+
+
+//
+// units - list the units with images
+//
+static int32_t cmdunits (int32_t fd,
+			 int32_t argc,
+			 char *argv[])
+{
+    unit_info ui;
+    int32_t unit;
+
+    for (unit = 0; unit < NTU58; unit++)
+	if (fileinfo(unit, &ui) == 0)
+	    reply(fd, "%3d %-7s %s %6d blocks %s\n",
+		  unit, ui.state, ui.write ? "rw" : "ro", ui.nblocks, ui.name);
+
+    return 0;
+}
+
+
+
+//
+// protect UNIT on|off - forbid or allow host writes to a unit
+//
+static int32_t cmdprotect (int32_t fd,
+			   int32_t argc,
+			   char *argv[])
+{
+    int32_t unit = atoi(argv[1]);
+    int32_t protect;
+
+    if (argc < 3) {
+	// no setting toggles it
+	unit_info ui;
+	if (fileinfo(unit, &ui)) { reply(fd, "ERROR unit %d is empty\n", unit); return -1; }
+	protect = ui.write;
+    } else if (!strcmp(argv[2], "on")) {
+	protect = 1;
+    } else if (!strcmp(argv[2], "off")) {
+	protect = 0;
+    } else {
+	reply(fd, "ERROR setting must be on or off\n");
+	return -1;
+    }
+
+    if (fileprotect(unit, protect)) {
+	reply(fd, "ERROR cannot %s writes to unit %d\n", protect ? "forbid" : "allow", unit);
+	return -1;
+    }
+
+    info("unit %d write protect %s", unit, protect ? "on" : "off");
+    return 0;
+}
+
+
+
+//
+// timing [0|1|2] - show or set the timing profile
+//
+static int32_t cmdtiming (int32_t fd,
+			  int32_t argc,
+			  char *argv[])
+{
+    int32_t n;
+
+    if (argc > 1) {
+	n = atoi(argv[1]);
+	if (n < 0 || n > 2 || !isdigit(argv[1][0])) {
+	    reply(fd, "ERROR timing must be 0, 1 or 2\n");
+	    return -1;
+	}
+	timing = n;
+	info("timing set to %d", timing);
+    }
+
+    reply(fd, "timing %d\n", timing);
+    return 0;
+}
+
+
+
+//
+// stats - show the transfer and read-ahead counters of each unit, the pacer rate
+// the command response times, the host resync times and the BREAK abort times
+//
+static int32_t cmdstats (int32_t fd,
+			 int32_t argc,
+			 char *argv[])
+{
+    unit_info ui;
+    uint32_t target;
+    uint32_t achieved;
+    uint32_t count;
+    uint32_t mean;
+    uint32_t worst;
+    uint32_t last;
+    int32_t unit;
+
+    for (unit = 0; unit < NTU58; unit++) {
+	if (fileinfo(unit, &ui)) continue;
+	reply(fd, "%3d read %u write %u", unit, ui.rbytes, ui.wbytes);
+	if (ui.ahead) reply(fd, " ahead hits %u misses %u wasted %u", ui.hits, ui.misses, ui.wasted);
+	reply(fd, "\n");
+    }
+
+    if (devtxpace(&target, &achieved) == 0)
+	reply(fd, "line paced %u bytes/s achieved %u\n", target, achieved);
+
+    rtstats(&count, &mean, &worst);
+    reply(fd, "response %u commands mean %uus worst %uus\n", count, mean, worst);
+
+    tu58resync(&count, &mean, &worst, &last);
+    reply(fd, "resync %u times mean %uus worst %uus last %uus\n", count, mean, worst, last);
+
+    tu58abort(&count, &mean, &worst, &last);
+    reply(fd, "abort %u commands mean %uus worst %uus last %uus\n", count, mean, worst, last);
+
+    return 0;
+}
+
+
+
+//
+// restart - restart the emulator, as the R key does
+//
+static int32_t cmdrestart (int32_t fd,
+			   int32_t argc,
+			   char *argv[])
+{
+    tu58key('R');
+    return 0;
+}
+
+
+
+static int32_t cmdhelp (int32_t, int32_t, char *[]);
+
+// command table
+
+static struct {
+    char	*name;		// command word
+    int32_t	args;		// least number of arguments
+    char	*usage;		// arguments
+    char	*text;		// description
+    int32_t	(*func)(int32_t, int32_t, char *[]);
+} ctlcmd [] = {
+    { "catalog", 0, "",			"list catalog images",		cmdcatalog },
+    { "insert",  2, "UNIT IMAGE [ro|rw]",	"put an image in a unit",	cmdinsert  },
+    { "eject",   1, "UNIT",			"take the image out of a unit",	cmdeject   },
+    { "units",   0, "",			"list units with images",	cmdunits   },
+    { "protect", 1, "UNIT [on|off]",		"forbid or allow writes",	cmdprotect },
+    { "timing",  0, "[0|1|2]",			"show or set timing delays",	cmdtiming  },
+    { "stats",   0, "",			"show unit and line counters",	cmdstats   },
+    { "restart", 0, "",			"restart the emulator",		cmdrestart },
+    { "help",    0, "",			"list commands",		cmdhelp    },
+    { NULL,      0, NULL,			NULL,				NULL       }
+};
+
+
+
+//
+// help - list the commands
+//
+static int32_t cmdhelp (int32_t fd,
+			int32_t argc,
+			char *argv[])
+{
+    int32_t i;
+
+    for (i = 0; ctlcmd[i].name; i++)
+	reply(fd, "%-8s %-20s %s\n", ctlcmd[i].name, ctlcmd[i].usage, ctlcmd[i].text);
+
+    return 0;
+}
+
+
+
+//
+// run a command line, writing the reply to fd
+//
+int32_t ctlexec (char *line,
+		 int32_t fd)
+{
+    char *argv[CTLARGS];
+    int32_t argc = 0;
+    char *save;
+    char *p;
+    int32_t i;
+
+    for (p = strtok_r(line, " \t\r\n", &save); p && argc < CTLARGS; p = strtok_r(NULL, " \t\r\n", &save))
+	argv[argc++] = p;
+    if (argc == 0) return 0;
+
+    for (i = 0; ctlcmd[i].name; i++) {
+	if (strcmp(argv[0], ctlcmd[i].name)) continue;
+	if (argc-1 < ctlcmd[i].args) {
+	    reply(fd, "ERROR usage: %s %s\n", ctlcmd[i].name, ctlcmd[i].usage);
+	    return -1;
+	}
+	if (ctlcmd[i].func(fd, argc, argv)) return -1;
+	reply(fd, "OK\n");
+	return 0;
+    }
+
+    reply(fd, "ERROR unknown command '%s'\n", argv[0]);
+    return -1;
+}
+
+
+
+//
+// fill in the descriptors to wait on for control socket work, return
+// how many, at most CTLCLIENTS+1
+//
+// a client with a reply still to take is not read until it has
+//
+int32_t ctlpoll (struct pollfd *fds)
+{
+    int32_t n = 0;
+    int32_t i;
+
+    if (sockfd < 0) return 0;
+
+    fds[n++] = (struct pollfd){ .fd = sockfd, .events = POLLIN };
+    for (i = 0; i < CTLCLIENTS; i++)
+	if (client[i].fd >= 0)
+	    fds[n++] = (struct pollfd){ .fd = client[i].fd, .events = client[i].outlen ? POLLOUT : POLLIN };
+
+    return n;
+}
+
+
+
+//
+// take a new client, making room if every place is taken
+//
+static void ctlaccept (void)
+{
+    ctl_client *c = &client[0];
+    int32_t fd;
+    int32_t i;
+
+    if ((fd = accept(sockfd, NULL, NULL)) < 0) return;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    // a free place, else the one idle longest
+    for (i = 0; i < CTLCLIENTS; i++) {
+	if (client[i].fd < 0) { c = &client[i]; break; }
+	if (client[i].used < c->used) c = &client[i];
+    }
+    if (c->fd >= 0) {
+	error("ctlaccept all %d clients busy, dropped the one idle longest", CTLCLIENTS);
+	ctldrop(c);
+    }
+
+    c->fd = fd;
+    c->len = 0;
+    c->used = ctlticks;
+    return;
+}
+
+
+
+//
+// read and run the command lines a client has sent
+//
+static void ctlread (ctl_client *c)
+{
+    int32_t n;
+    char *end;
+
+    // the client is gone
+    if ((n = read(c->fd, c->line+c->len, sizeof(c->line)-1-c->len)) <= 0) {
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+	ctldrop(c);
+	return;
+    }
+
+    // run each complete line as it arrives
+    c->len += n;
+    c->line[c->len] = '\0';
+    while ((end = strchr(c->line, '\n')) != NULL) {
+	*end++ = '\0';
+	ctlexec(c->line, c->fd);
+	c->len -= end-c->line;
+	memmove(c->line, end, c->len+1);
+    }
+
+    // an overlong line is thrown away
+    if (c->len == sizeof(c->line)-1) {
+	reply(c->fd, "ERROR line too long\n");
+	c->len = 0;
+    }
+
+    return;
+}
+
+
+
+//
+// do the work ctlpoll() waited for, given the n descriptors it filled in
+//
+void ctlevent (struct pollfd *fds,
+	       int32_t n)
+{
+    ctl_client *c;
+    int32_t i;
+
+    ctlticks++;
+
+    for (i = 0; i < n; i++) {
+	if (!fds[i].revents) continue;
+	if (fds[i].fd == sockfd) {
+	    ctlaccept();
+	    continue;
+	}
+	// a client dropped to make room may already be gone
+	if ((c = ctlclient(fds[i].fd)) == NULL) continue;
+	c->used = ctlticks;
+	if (c->outlen == 0) ctlread(c);
+	if (c->fd >= 0) ctlflush(c);
+    }
+
+    return;
+}
+
+
+
+//
+// start serving the control socket
+//
+int32_t ctlstart (char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int32_t i;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	error("ctlstart socket path '%s' too long", path);
+	return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    for (i = 0; i < CTLCLIENTS; i++) {
+	client[i].fd = -1;
+	client[i].out = NULL;
+	client[i].outlen = 0;
+    }
+
+    // a socket left behind by an earlier run is replaced, nothing else is
+    if (lstat(path, &st) == 0) {
+	if (!S_ISSOCK(st.st_mode)) {
+	    error("ctlstart '%s' exists and is not a socket", path);
+	    return -3;
+	}
+	unlink(path);
+    }
+
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+	|| bind(sockfd, (struct sockaddr *)&addr, sizeof(addr))
+	|| listen(sockfd, CTLCLIENTS)) {
+	error("ctlstart cannot listen on '%s'", path);
+	if (sockfd >= 0) close(sockfd);
+	sockfd = -1;
+	return -2;
+    }
+
+    sockpath = path;
+    info("control socket '%s'", path);
+    return 0;
+}
+
+
+
+//
+// remove the control socket
+//
+void ctlstop (void)
+{
+    int32_t i;
+
+    if (sockfd >= 0) {
+	for (i = 0; i < CTLCLIENTS; i++)
+	    if (client[i].fd >= 0) ctldrop(&client[i]);
+	close(sockfd);
+    }
+    sockfd = -1;
+    if (sockpath) unlink(sockpath);
+    sockpath = NULL;
+    return;
+}
+
+
+
+// the end
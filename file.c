@@ -45,13 +45,53 @@
 
 
 
+#define _GNU_SOURCE // for SCHED_IDLE
+
 #include "common.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+
+
+// delta file header, followed by count records of block number and data
+
+#define DELTA_MAGIC	"TU58DLT1"
+
+typedef struct {
+    char	magic[8];	// DELTA_MAGIC
+    int32_t	blocksize;	// bytes per block
+    int32_t	nblocks;	// blocks in the source image
+    int32_t	count;		// number of block records
+} delta_header;
+
+// unit states
+
+#define UNIT_NONE	0	// no file given
+#define UNIT_PENDING	1	// file given, opened on first use
+#define UNIT_OPEN	2	// file open and ready
+#define UNIT_FAILED	3	// file could not be opened
 
+// options that apply to the units following them on the command line
+
+#define OPT_DIRTY	0x01	// track changed blocks
+#define OPT_SPARSE	0x02	// create as a sparse container
+#define OPT_COMPRESS	0x04	// compress a new container
+#define OPT_CRC		0x08	// keep a CRC index
+#define OPT_TREE	0x10	// keep a hash tree
+#define OPT_AHEAD	0x20	// prefetch sequential reads
+#define OPT_HEAT	0x40	// profile reads, preload the warm set
+#define OPT_SHARED	0x80	// share a block cache with other emulators
+#define OPT_WBACK	0x100	// copy files written to a directory volume back
 
 // file data structure
 
 struct {
+    uint8_t	state;		// UNIT_xxx
+    uint16_t	opts;		// OPT_xxx in effect for this unit
+    uint8_t	opening;	// set while opener thread runs
+    pthread_t	opener;		// thread creating the image
     int32_t	fd;		// file descriptor
     char	*name;		// file name
     uint8_t	rflag : 1;	// read allowed
@@ -59,10 +99,63 @@ struct {
     uint8_t	cflag : 1;	// create allowed
     uint8_t	iflag : 1;	// init RT-11 structure
     uint8_t	xflag : 1;	// init XXDP structure
+    uint8_t	type;		// image format, FILETYPE_xxx
+    char	*store;		// block store for a new image, or NULL
+    int32_t	size;		// size of image in bytes
+    int32_t	tapesize;	// number of blocks in a new image
+    int32_t	nblocks;	// number of blocks in image
+    uint32_t	pos;		// current byte position in image
+    int32_t	bnum;		// block number held in bbuf, -1 if none
+    uint8_t	bdirty;		// bbuf holds data not yet written
+    uint8_t	bbuf[BLOCKSIZE]; // last block read or written
+    pthread_mutex_t lock;	// serializes emulator and scrubber access
+    pthread_mutex_t busy;	// held by the emulator for a whole command
+    time_t	atime;		// time of last host access
+    uint32_t	rbytes;		// bytes read by the host
+    uint32_t	wbytes;		// bytes written by the host
+    int32_t	cfd;		// CRC index file descriptor
+    uint32_t	*crc;		// CRC32C of each block, or NULL
+    int32_t	scrub;		// next block for the scrubber to check
+    int32_t	dfd;		// dirty bitmap file descriptor
+    uint8_t	*dirty;		// dirty bitmap, one bit per block
 } file [NTU58];
 
+// read-ahead buffer pool, per unit
+
+#define SLOT_FREE	0	// unused
+#define SLOT_QUEUED	1	// waiting for the prefetcher
+#define SLOT_READY	2	// holds a block the host has not read yet
+#define SLOT_LOADING	3	// being read by the prefetcher without the unit lock
+
+typedef struct {
+    uint8_t	state;		// SLOT_xxx
+    int32_t	block;		// block held or queued
+    uint8_t	data[BLOCKSIZE]; // block data
+} ahead_slot;
+
+static struct {
+    int32_t	last;		// first block of the last read command
+    int32_t	next;		// block following the last read command
+    int32_t	stride;		// blocks between the last two read commands
+    uint32_t	hits;		// blocks read found already staged
+    uint32_t	misses;		// blocks read that had to be loaded
+    uint32_t	wasted;		// blocks staged but never read
+    ahead_slot	*slot;		// AHEADSLOTS buffers, or NULL if off
+    uint8_t	loading;	// set while a block is read without the unit lock
+    pthread_cond_t done;	// signals loading cleared
+} ahead [NTU58];
+
+static pthread_mutex_t aheadlock = PTHREAD_MUTEX_INITIALIZER; // guards aheadwork, aheadunit
+static pthread_cond_t aheadwake = PTHREAD_COND_INITIALIZER; // signals aheadwork
+static int32_t aheadwork; // set nonzero when slots are queued
+static int32_t aheadunit[NTU58]; // units with read-ahead on
+static int32_t naheadunit = 0; // how many
+
 int32_t fpt; // number of active file descriptors
 
+static uint8_t *diffmap; // blocks found different by filediff()
+static int32_t diffunit; // unit diffmap belongs to
+
 
 
 //
@@ -73,6 +166,9 @@ void fileinit (void)
     int32_t unit;
 
     for (unit = 0; unit < NTU58; unit++) {
+	file[unit].state = UNIT_NONE;
+	file[unit].opts = 0;
+	file[unit].opening = 0;
 	file[unit].fd = -1;
 	file[unit].name = NULL;
 	file[unit].rflag = 0;
@@ -80,7 +176,41 @@ void fileinit (void)
 	file[unit].cflag = 0;
 	file[unit].iflag = 0;
 	file[unit].xflag = 0;
+	file[unit].type = FILETYPE_RAW;
+	file[unit].store = NULL;
+	file[unit].size = 0;
+	file[unit].tapesize = TAPESIZE;
+	file[unit].nblocks = 0;
+	file[unit].pos = 0;
+	file[unit].bnum = -1;
+	file[unit].bdirty = 0;
+	pthread_mutex_init(&file[unit].lock, NULL);
+	pthread_mutex_init(&file[unit].busy, NULL);
+	file[unit].atime = 0;
+	file[unit].rbytes = 0;
+	file[unit].wbytes = 0;
+	file[unit].cfd = -1;
+	file[unit].crc = NULL;
+	file[unit].scrub = 0;
+	file[unit].dfd = -1;
+	file[unit].dirty = NULL;
+	ahead[unit].last = -1;
+	ahead[unit].next = -1;
+	ahead[unit].stride = 0;
+	ahead[unit].hits = 0;
+	ahead[unit].misses = 0;
+	ahead[unit].wasted = 0;
+	ahead[unit].slot = NULL;
+	ahead[unit].loading = 0;
+	pthread_cond_init(&ahead[unit].done, NULL);
     }
+    sparseinit();
+    vdirinit();
+    nbdinit();
+    storeinit();
+    merkleinit();
+    heatinit();
+    shminit();
     fpt = 0;
     return;
 }
@@ -88,143 +218,151 @@ void fileinit (void)
 
 
 //
-// close file structures for all units
+// build the name of a sidecar file for a unit (caller frees)
 //
-void fileclose (void)
+static char *sidecar (int32_t unit,
+		      char *ext)
 {
-    int32_t unit;
+    char *name;
 
-    for (unit = 0; unit < NTU58; unit++) {
-	if (file[unit].fd != -1) {
-	    close(file[unit].fd);
-	    file[unit].fd = -1;
+    if ((name = malloc(strlen(file[unit].name)+strlen(ext)+1)) == NULL) return NULL;
+    strcpy(name, file[unit].name);
+    strcat(name, ext);
+
+    return name;
+}
+
+
+
+//
+// size in bytes of the dirty bitmap for a unit
+//
+static inline int32_t dirtysize (int32_t unit)
+{
+    return (file[unit].nblocks+7)/8;
+}
+
+
+
+//
+// open the dirty block bitmap of a unit, create it if requested
+//
+// a newly created bitmap has every block marked dirty, as there
+// is no previous export for the next delta to be relative to
+//
+static int32_t dirtyopen (int32_t unit,
+			  int32_t create)
+{
+    int32_t size = dirtysize(unit);
+    char *name;
+    int32_t fd;
+
+    // already open
+    if (file[unit].dirty) return 0;
+
+    if ((name = sidecar(unit, ".dirty")) == NULL) return -1;
+
+    // open existing bitmap, else create one if allowed
+    if ((fd = open(name, O_BINARY|O_RDWR)) < 0 && create)
+	fd = open(name, O_BINARY|O_RDWR|O_CREAT, 0666);
+    free(name);
+    if (fd < 0) return -2;
+
+    if ((file[unit].dirty = malloc(size)) == NULL) { close(fd); return -3; }
+
+    // a bitmap of the wrong size is useless, start over with all dirty
+    if (read(fd, file[unit].dirty, size) != size || lseek(fd, 0, SEEK_END) != size) {
+	memset(file[unit].dirty, 0xFF, size);
+	if (ftruncate(fd, 0) || pwrite(fd, file[unit].dirty, size, 0) != size) {
+	    free(file[unit].dirty);
+	    file[unit].dirty = NULL;
+	    close(fd);
+	    return -4;
 	}
     }
-    return;
+
+    file[unit].dfd = fd;
+    return 0;
 }
 
 
 
 //
-// init RT-11 file directory structures (based on RT-11 v5.4)
+// mark blocks dirty for a range of bytes just written
 //
-static int32_t rt11_init (int32_t fd)
+static void dirtymark (int32_t unit,
+		       int32_t offset,
+		       int32_t count)
 {
-    int32_t i;
+    int32_t block;
+    int32_t last;
+    uint8_t mask;
+
+    if (!file[unit].dirty || count <= 0) return;
+
+    last = (offset+count-1)/BLOCKSIZE;
+    if (last >= file[unit].nblocks) last = file[unit].nblocks-1;
+
+    for (block = offset/BLOCKSIZE; block <= last; block++) {
+	mask = 1 << (block%8);
+	// only touch the sidecar the first time a block goes dirty
+	if (!(file[unit].dirty[block/8] & mask)) {
+	    file[unit].dirty[block/8] |= mask;
+	    if (pwrite(file[unit].dfd, &file[unit].dirty[block/8], 1, block/8) != 1)
+		error("unit %d cannot update dirty bitmap", unit);
+	}
+    }
+
+    return;
+}
+
+
 
-    static int16_t boot[] = { // offset 0000000
- 	0000240, 0000005, 0000404, 0000000, 0000000, 0041420, 0116020, 0000400,
-	0004067, 0000044, 0000015, 0000000, 0005000, 0041077, 0047517, 0026524,
-	0026525, 0067516, 0061040, 0067557, 0020164, 0067157, 0073040, 0066157,
-	0066565, 0006545, 0005012, 0000200, 0105737, 0177564, 0100375, 0112037,
-	0177566, 0100372, 0000777
-    };
-
-    static int16_t bitmap[] = { // offset 0001000
-	0000000, 0170000, 0007777
-    };
-
-    static int16_t direct1[] = { // offset 0001700
-	0177777, 0000000, 0000000, 0000000, 0000000, 0000000, 0000000, 0000000,
-	0000000, 0000001, 0000006, 0107123, 0052122, 0030461, 0020101, 0020040,
-	0020040, 0020040, 0020040, 0020040, 0020040, 0020040, 0020040, 0020040,
-	0042504, 0051103, 0030524, 0040461, 0020040, 0020040
-    };
-
-    static int16_t direct2[] = { // offset 0006000
-	0000001, 0000000, 0000001, 0000000, 0000010, 0001000, 0000325, 0063471,
-	0023364, 0000770, 0000000, 0002264, 0004000
-    };
-
-    static struct {
-	int16_t *data;
-	int16_t length;
-	int32_t  offset;
-    } table[] = {
-	{ boot,    sizeof(boot),    00000 },
-	{ bitmap,  sizeof(bitmap),  01000 },
-	{ direct1, sizeof(direct1), 01700 },
-	{ direct2, sizeof(direct2), 06000 },
-	{ NULL, 0, 0 }
-    };
-
-    // now write data from the table
-    for (i = 0; table[i].length; i++) {
-	lseek(fd, table[i].offset, SEEK_SET);
-	if (write(fd, table[i].data, table[i].length) != table[i].length) return -1;
+//
+// read one whole block from the image, without any checking
+//
+static int32_t blkload (int32_t unit,
+			int32_t block,
+			uint8_t *buffer)
+{
+    int32_t count;
+
+    switch (file[unit].type) {
+    case FILETYPE_RAW:
+	// a short image reads as zero past its end
+	if ((count = pread(file[unit].fd, buffer, BLOCKSIZE, (off_t)block*BLOCKSIZE)) < 0) return -1;
+	if (count < BLOCKSIZE) memset(buffer+count, 0, BLOCKSIZE-count);
+	return 0;
+    case FILETYPE_SPARSE:
+	return sparseread(unit, block, buffer);
+    case FILETYPE_STORE:
+	return storeread(unit, block, buffer);
+    case FILETYPE_VDIR:
+	return vdirread(unit, block, buffer);
+    case FILETYPE_NBD:
+	return nbdread(unit, block, buffer);
     }
 
-    return 0;
+    return -1;
 }
 
 
 
 //
-// init XXDP file directory structures (based on XXDPv2.5)
+// read one whole block from the image and check it against the CRC index
+//
+// returns -5 if the data does not match the CRC index
 //
-static int32_t xxdp_init (int32_t fd)
+static int32_t blkcheck (int32_t unit,
+			 int32_t block,
+			 uint8_t *buffer)
 {
-    int32_t i;
+    if (blkload(unit, block, buffer)) return -1;
 
-    static int16_t mfd1[] = { // MFD1
-	0000002, // ptr to MFD2
-	0000001, // interleave factor
-	0000007, // BITMAP start block number
-	0000007  // ptr to 1st BITMAP block
-    };
-
-    static int16_t mfd2[] = { // MFD2
-	0000000, // no more MFDs
-	0000401, // uic [1,1]
-	0000003, // ptr to 1st UFD block
-	0000011  // 9. words per UFD entry
-    };
-
-    static int16_t ufd1[] = { // UFD#1 (empty directory)
-	0000004  // ptr to UFD#2
-    };
-
-    static int16_t ufd2[] = { // UFD#2 (empty directory)
-	0000005  // ptr to UFD#3
-    };
-
-    static int16_t ufd3[] = { // UFD#3 (empty directory)
-	0000006  // ptr to UFD#4
-    };
-
-    static int16_t ufd4[] = { // UFD#4 (empty directory)
-	0000000  // no more UFDs
-    };
-
-    static int16_t map1[] = { // BITMAP#1
-	0000000, // no more BITMAPs
-	0000001, // map number
-	0000074, // 60. words per BITMAP
-	0000007, // ptr to BITMAP#1
-	0177777, // blocks 15..00 allocated
-	0177777, // blocks 31..16 allocated
-	0000377  // blocks 39..32 allocated
-    };
-
-    static struct {
-	int16_t *data;
-	int16_t length;
-	int32_t  offset;
-    } table[] = {
-	{ mfd1, sizeof(mfd1), 01000 },
-	{ mfd2, sizeof(mfd2), 02000 },
-	{ ufd1, sizeof(ufd1), 03000 },
-	{ ufd2, sizeof(ufd2), 04000 },
-	{ ufd3, sizeof(ufd3), 05000 },
-	{ ufd4, sizeof(ufd4), 06000 },
-	{ map1, sizeof(map1), 07000 },
-	{ NULL, 0, 0 }
-    };
-
-    // now write data from the table
-    for (i = 0; table[i].length; i++) {
-	lseek(fd, table[i].offset, SEEK_SET);
-	if (write(fd, table[i].data, table[i].length) != table[i].length) return -1;
+    if (file[unit].crc && block < file[unit].nblocks
+	&& crc32c(buffer, BLOCKSIZE) != file[unit].crc[block]) {
+	error("unit %d block 0x%04X fails CRC check", unit, block);
+	return -5;
     }
 
     return 0;
@@ -233,130 +371,452 @@ static int32_t xxdp_init (int32_t fd)
 
 
 //
-// init a blank tape image (all zero)
+// read one whole block, from the shared cache if another emulator has it
 //
-static int32_t zero_init (int32_t fd)
+// returns -5 if the data does not match the CRC index
+//
+static int32_t blkread (int32_t unit,
+			int32_t block,
+			uint8_t *buffer)
 {
-    int32_t i;
-    int8_t buf[BLOCKSIZE];
+    uint32_t generation;
+    int32_t status;
 
-    // zero a block
-    memset(buf, 0, sizeof(buf));
+    if (shmcacheget(unit, block, buffer, &generation) == 0) return 0;
 
-    // zero a whole tape
-    lseek(fd, 0, SEEK_SET);
-    for (i = 0; i < TAPESIZE; i++)
-	if (write(fd, buf, sizeof(buf)) != sizeof(buf)) return -1;
+    if ((status = blkcheck(unit, block, buffer))) return status;
 
+    shmcacheput(unit, block, buffer, generation);
     return 0;
 }
 
 
 
 //
-// open a file for a unit
+// open the CRC index of a unit, create it from the image if asked
 //
-int32_t fileopen (char *name,
-		  int32_t mode)
+static int32_t crcopen (int32_t unit,
+			int32_t create)
 {
+    int32_t size = file[unit].nblocks * sizeof(uint32_t);
+    uint8_t buffer[BLOCKSIZE];
+    uint32_t *crc;
+    char *name;
+    int32_t build = 0;
+    int32_t block;
     int32_t fd;
 
-    // check if we can open any more units
-    if (fpt >= NTU58) { error("no more units available"); return -1; }
+    if ((name = sidecar(unit, ".crc")) == NULL) return -1;
 
-    // save some data
-    file[fpt].name = name;
-    file[fpt].rflag = 1;
-    if (mode == FILEWRITE) file[fpt].wflag = 1;
-    if (mode == FILECREATE) file[fpt].wflag = file[fpt].cflag = 1;
-    if (mode == FILERT11INIT) file[fpt].wflag = file[fpt].cflag = file[fpt].iflag = 1;
-    if (mode == FILEXXDPINIT) file[fpt].wflag = file[fpt].cflag = file[fpt].xflag = 1;
+    if ((fd = open(name, O_BINARY|(file[unit].wflag ? O_RDWR : O_RDONLY))) < 0 && create) {
+	fd = open(name, O_BINARY|O_RDWR|O_CREAT, 0666);
+	build = 1;
+    }
+    free(name);
+    if (fd < 0) return create ? -2 : 0;
 
-    // open file if it exists
-    if (file[fpt].wflag)
-	fd = open(file[fpt].name, O_BINARY|O_RDWR, 0666);
-    else
-	fd = open(file[fpt].name, O_BINARY|O_RDONLY);
+    if ((crc = malloc(size)) == NULL) { close(fd); return -3; }
 
-    // create file if it does not exist
-    if (fd < 0 && file[fpt].cflag) fd = creat(file[fpt].name, 0666);
-    if (fd < 0) { error("fileopen cannot open or create '%s'", file[fpt].name); return -2; }
+    // a freshly initialized image makes any old index stale
+    if (file[unit].cflag) build = 1;
 
-    // store opened file information
-    file[fpt].fd = fd;
+    // an index of the wrong size does not belong to this image
+    if (!build && (read(fd, crc, size) != size || lseek(fd, 0, SEEK_END) != size)) {
+	error("CRC index for unit %d does not match the image, rebuilding", unit);
+	build = 1;
+    }
 
-    // zap tape if requested
-    if (file[fpt].cflag) {
-	if (!zero_init(fd)) {
-	    info("initialize tape on '%s'", file[fpt].name);
-	} else {
-	    error("fileopen cannot init tape on '%s'", file[fpt].name);
-	    return -3;
+    if (build) {
+	for (block = 0; block < file[unit].nblocks; block++) {
+	    if (blkload(unit, block, buffer)) { free(crc); close(fd); return -4; }
+	    crc[block] = crc32c(buffer, BLOCKSIZE);
 	}
+	if (ftruncate(fd, 0) || pwrite(fd, crc, size, 0) != size) { free(crc); close(fd); return -5; }
     }
 
-    // initialize RT-11 directory structure ?
-    if (file[fpt].iflag) {
-	if (!rt11_init(fd)) {
-	    info("initialize RT-11 directory on '%s'", file[fpt].name);
-	} else {
-	    error("fileopen cannot init RT-11 filesystem on '%s'", file[fpt].name);
-	    return -4;
-	}
+    file[unit].cfd = fd;
+    file[unit].crc = crc;
+    return 0;
+}
+
+
+
+//
+// forget a block staged for read-ahead
+//
+static void aheaddrop (int32_t unit,
+		       int32_t block)
+{
+    int32_t i;
+
+    if (!ahead[unit].slot) return;
+
+    for (i = 0; i < AHEADSLOTS; i++) {
+	if (ahead[unit].slot[i].state == SLOT_FREE || ahead[unit].slot[i].block != block) continue;
+	if (ahead[unit].slot[i].state == SLOT_READY) ahead[unit].wasted++;
+	ahead[unit].slot[i].state = SLOT_FREE;
     }
 
-    // initialize XXDP directory structure ?
-    if (file[fpt].xflag) {
-	if (!xxdp_init(fd)) {
-	    info("initialize XXDP directory on '%s'", file[fpt].name);
-	} else {
-	    error("fileopen cannot init XXDP filesystem on '%s'", file[fpt].name);
-	    return -5;
-	}
+    return;
+}
+
+
+
+//
+// write one whole block to the image
+//
+static int32_t blkwrite (int32_t unit,
+			 int32_t block,
+			 uint8_t *buffer)
+{
+    int32_t status = -1;
+
+    switch (file[unit].type) {
+    case FILETYPE_RAW:
+	status = pwrite(file[unit].fd, buffer, BLOCKSIZE, (off_t)block*BLOCKSIZE) == BLOCKSIZE ? 0 : -1;
+	break;
+    case FILETYPE_SPARSE:
+	status = sparsewrite(unit, block, buffer);
+	break;
+    case FILETYPE_STORE:
+	status = storewrite(unit, block, buffer);
+	break;
+    case FILETYPE_VDIR:
+	status = vdirwrite(unit, block, buffer);
+	break;
+    case FILETYPE_NBD:
+	status = nbdwrite(unit, block, buffer);
+	break;
     }
 
-    // output some info...
-    info("unit %d %c%c%c%c file '%s'",
-	 fpt,
-	 file[fpt].rflag ? 'r' : ' ',
-	 file[fpt].wflag ? 'w' : ' ',
-	 file[fpt].cflag ? 'c' : ' ',
-	 file[fpt].iflag ? 'i' : file[fpt].xflag ? 'x' : ' ',
-	 file[fpt].name);
+    // keep the block buffer and read-ahead pool coherent
+    if (buffer != file[unit].bbuf && file[unit].bnum == block) file[unit].bnum = -1;
+    aheaddrop(unit, block);
+    heatdrop(unit, block);
+
+    if (status == 0) dirtymark(unit, block*BLOCKSIZE, BLOCKSIZE);
+
+    // other emulators sharing the image see the new data at once
+    if (status == 0) shmwrite(unit, block, buffer);
+
+    // keep the CRC index in step
+    if (status == 0 && file[unit].crc && block < file[unit].nblocks) {
+	file[unit].crc[block] = crc32c(buffer, BLOCKSIZE);
+	if (pwrite(file[unit].cfd, &file[unit].crc[block], sizeof(uint32_t),
+		   block*sizeof(uint32_t)) != sizeof(uint32_t))
+	    error("unit %d cannot update CRC index", unit);
+    }
+
+    // and the hash tree
+    if (status == 0 && merkleupdate(unit, block, buffer))
+	error("unit %d cannot update hash tree", unit);
+
+    return status;
+}
+
+
+
+//
+// open the hash tree of a unit, create it from the image if asked
+//
+static int32_t treeopen (int32_t unit,
+			 int32_t create)
+{
+    uint8_t buffer[BLOCKSIZE];
+    int32_t mode = create ? 1 : 0;
+    int32_t status;
+    int32_t block;
+    char *name;
+
+    if ((name = sidecar(unit, ".mtree")) == NULL) return -1;
+
+    // a freshly initialized image makes any old tree stale
+    if (file[unit].cflag && (mode || access(name, F_OK) == 0)) mode = 2;
+
+    status = merkleopen(unit, name, file[unit].nblocks, mode);
+    free(name);
+    if (status == 0) return 0;
+    if (status < -1 || !mode) return mode ? -2 : 0;
+
+    // build it
+    for (block = 0; block < file[unit].nblocks; block++) {
+	if (blkload(unit, block, buffer)) { merkleclose(unit); return -3; }
+	merkleleaf(unit, block, buffer);
+    }
+    if (merklesave(unit)) { merkleclose(unit); return -4; }
 
-    fpt++;
     return 0;
 }
 
 
 
 //
-// check file unit OK
+// write back the unit block buffer if it holds unwritten data
 //
-int32_t fileunit (int32_t unit)
+static int32_t blkflush (int32_t unit)
 {
-    if (unit < 0 || unit >= NTU58 || file[unit].fd == -1) {
-	error("bad unit %d", unit);
+    if (!file[unit].bdirty) return 0;
+
+    file[unit].bdirty = 0;
+    if (blkwrite(unit, file[unit].bnum, file[unit].bbuf)) {
+	file[unit].bnum = -1;
 	return -1;
     }
+
+    return 0;
+}
+
+
+
+//
+// get a block into the unit block buffer
+//
+// a clean block of a unit sharing its cache is got again from the cache,
+// as another emulator may have written it since
+//
+static int32_t blkget (int32_t unit,
+		       int32_t block)
+{
+    int32_t status;
+
+    if (file[unit].bnum == block && (file[unit].bdirty || !shmshared(unit))) return 0;
+
+    if (blkflush(unit)) return -1;
+
+    file[unit].bnum = -1;
+    if ((status = blkread(unit, block, file[unit].bbuf))) return status;
+    file[unit].bnum = block;
+
+    return 0;
+}
+
+
+
+//
+// get a block into the unit block buffer from the warm set
+//
+// leaves the buffer alone on a miss, for blkget() to load as usual
+//
+static int32_t warmget (int32_t unit,
+			int32_t block)
+{
+    uint8_t buffer[BLOCKSIZE];
+
+    if (file[unit].bnum == block || heatget(unit, block, buffer)) return 0;
+
+    if (blkflush(unit)) return -1;
+    memcpy(file[unit].bbuf, buffer, BLOCKSIZE);
+    file[unit].bnum = block;
+
+    return 0;
+}
+
+
+
+//
+// warm set loader, reads the blocks of a unit's profile in first read order
+//
+static void *warmer (void *arg)
+{
+    uint8_t buffer[BLOCKSIZE];
+    int32_t unit = (intptr_t)arg;
+    int32_t block;
+    int32_t n;
+
+    rthelper();
+
+    for (n = 0; ; n++) {
+	pthread_mutex_lock(&file[unit].lock);
+	// stop if the unit has been closed meanwhile
+	if ((block = heatblock(unit, n)) == -2) {
+	    pthread_mutex_unlock(&file[unit].lock);
+	    break;
+	}
+	if (block >= 0 && blkread(unit, block, buffer) == 0) heatfill(unit, n, buffer);
+	pthread_mutex_unlock(&file[unit].lock);
+    }
+
+    if (verbose) info("unit %d preloaded %d warm blocks", unit, n);
+
+    return NULL;
+}
+
+
+
+//
+// open the access profile of a unit, start loading its warm set
+//
+static int32_t warmopen (int32_t unit)
+{
+    pthread_t th_warm;
+    int32_t status;
+    char *name;
+
+    if ((name = sidecar(unit, ".heat")) == NULL) return -1;
+    status = heatopen(unit, name, file[unit].nblocks);
+    free(name);
+    if (status <= 0) return status;
+
+    if (pthread_create(&th_warm, NULL, warmer, (void *)(intptr_t)unit)) {
+	error("unable to create warm set thread");
+	return -2;
+    }
+    pthread_detach(th_warm);
+
     return 0;
 }
 
 
 
 //
-// seek file (tape) position
+// get a block into the unit block buffer from the read-ahead pool
 //
-int32_t fileseek (int32_t unit,
-		  int32_t size,
-		  int32_t block,
-		  int32_t offset)
+// leaves the buffer alone on a miss, for blkget() to load as usual
+//
+static int32_t aheadget (int32_t unit,
+			 int32_t block)
 {
-    if (fileunit(unit)) return -1;
+    ahead_slot *slot;
+    int32_t i;
+
+    if (!ahead[unit].slot || file[unit].bnum == block) return 0;
+
+    for (i = 0; i < AHEADSLOTS; i++) {
+	slot = &ahead[unit].slot[i];
+	if (slot->state == SLOT_FREE || slot->block != block) continue;
+	if (slot->state == SLOT_READY) {
+	    if (blkflush(unit)) return -1;
+	    memcpy(file[unit].bbuf, slot->data, BLOCKSIZE);
+	    file[unit].bnum = block;
+	    slot->state = SLOT_FREE;
+	    ahead[unit].hits++;
+	    return 0;
+	}
+	// still queued, too late to be of use
+	slot->state = SLOT_FREE;
+    }
+
+    ahead[unit].misses++;
+    return 0;
+}
+
+
+
+//
+// load the lowest queued block of a unit, the caller holds the unit lock
+//
+// raw images and NBD exports are read with the lock let go, so a host
+// command on the unit never waits for a fetch; the slot is claimed
+// first, and filled only if no host write or new pattern took it back
+// meanwhile. Containers, store indexes and directories change their own
+// state as they are written, so they are read with the lock held.
+// Returns nonzero if a block was queued
+//
+static int32_t aheadload (int32_t unit)
+{
+    uint8_t buffer[BLOCKSIZE];
+    ahead_slot *slot;
+    int32_t status;
+    int32_t block;
+    int32_t i;
+
+    if (!ahead[unit].slot) return 0;
+
+    for (slot = NULL, i = 0; i < AHEADSLOTS; i++)
+	if (ahead[unit].slot[i].state == SLOT_QUEUED
+	    && (!slot || ahead[unit].slot[i].block < slot->block))
+	    slot = &ahead[unit].slot[i];
+    if (!slot) return 0;
+
+    // a block that fails its check is left for the host to report
+    if (file[unit].type != FILETYPE_RAW && file[unit].type != FILETYPE_NBD) {
+	slot->state = blkread(unit, slot->block, slot->data) ? SLOT_FREE : SLOT_READY;
+	return 1;
+    }
+
+    block = slot->block;
+    slot->state = SLOT_LOADING;
+    ahead[unit].loading = 1;
+    pthread_mutex_unlock(&file[unit].lock);
+
+    status = blkread(unit, block, buffer);
+
+    pthread_mutex_lock(&file[unit].lock);
+    ahead[unit].loading = 0;
+    pthread_cond_broadcast(&ahead[unit].done);
+
+    if (slot->state == SLOT_LOADING && slot->block == block) {
+	if (status == 0) memcpy(slot->data, buffer, BLOCKSIZE);
+	slot->state = status ? SLOT_FREE : SLOT_READY;
+    }
+
+    return 1;
+}
+
+
+
+//
+// read-ahead thread, loads the blocks queued by fileahead()
+//
+static void *prefetcher (void *none)
+{
+    int32_t unit[NTU58];
+    int32_t nunit;
+    int32_t busy;
+    int32_t i;
+
+    rthelper();
+
+    for (;;) {
+	// sleep until there is something to do
+	pthread_mutex_lock(&aheadlock);
+	while (!aheadwork) pthread_cond_wait(&aheadwake, &aheadlock);
+	aheadwork = 0;
+	nunit = naheadunit;
+	memcpy(unit, aheadunit, nunit*sizeof(int32_t));
+	pthread_mutex_unlock(&aheadlock);
+
+	// load queued blocks in order, a block at a time so the host never waits long
+	do {
+	    busy = 0;
+	    for (i = 0; i < nunit; i++) {
+		pthread_mutex_lock(&file[unit[i]].lock);
+		busy |= aheadload(unit[i]);
+		pthread_mutex_unlock(&file[unit[i]].lock);
+	    }
+	} while (busy);
+    }
+
+    return NULL;
+}
+
+
+
+//
+// set up read-ahead for a unit, the first one also starts the prefetcher
+//
+static int32_t aheadinit (int32_t unit)
+{
+    static pthread_t th_ahead;
+    static int32_t running = 0;
 
-    if (block*size+offset >= lseek(file[unit].fd, 0, SEEK_END)) return -2;
+    if ((ahead[unit].slot = calloc(AHEADSLOTS, sizeof(ahead_slot))) == NULL) return -1;
 
-    if (lseek(file[unit].fd, block*size+offset, SEEK_SET) < 0) return -3;
+    if (!running) {
+	if (pthread_create(&th_ahead, NULL, prefetcher, NULL)) {
+	    error("unable to create read-ahead thread");
+	    free(ahead[unit].slot);
+	    ahead[unit].slot = NULL;
+	    return -2;
+	}
+	pthread_detach(th_ahead);
+	running = 1;
+    }
+
+    // the prefetcher only looks at units on the list
+    pthread_mutex_lock(&aheadlock);
+    aheadunit[naheadunit++] = unit;
+    pthread_mutex_unlock(&aheadlock);
 
     return 0;
 }
@@ -364,33 +824,1278 @@ int32_t fileseek (int32_t unit,
 
 
 //
-// read bytes from the tape image file
+// turn off read-ahead for a unit, the caller holds the unit lock
 //
-int32_t fileread (int32_t unit,
-		  uint8_t *buffer,
-		  int32_t count)
+static void aheadclose (int32_t unit)
 {
-    if (fileunit(unit)) return -1;
+    int32_t i;
 
-    if (!file[unit].rflag) return -2;
+    if (!ahead[unit].slot) return;
+
+    pthread_mutex_lock(&aheadlock);
+    for (i = 0; i < naheadunit; i++) {
+	if (aheadunit[i] != unit) continue;
+	aheadunit[i] = aheadunit[--naheadunit];
+	break;
+    }
+    pthread_mutex_unlock(&aheadlock);
 
-    return read(file[unit].fd, buffer, count);
+    if (verbose) fileaheadstats(unit);
+    free(ahead[unit].slot);
+    ahead[unit].slot = NULL;
+
+    return;
 }
 
 
 
 //
-// write bytes to the tape image file
+// write bytes at the unit position through the block buffer
 //
-int32_t filewrite (int32_t unit,
-		   uint8_t *buffer,
-		   int32_t count)
+// the caller holds the unit lock; returns the count written
+//
+static int32_t bufwrite (int32_t unit,
+			 uint8_t *buffer,
+			 int32_t count)
 {
-    if (fileunit(unit)) return -1;
+    int32_t done = 0;
+    int32_t offset;
+    int32_t block;
+    int32_t n;
+
+    // merge into the block buffer a block at a time
+    while (done < count) {
+	offset = file[unit].pos % BLOCKSIZE;
+	block = file[unit].pos / BLOCKSIZE;
+	n = count-done < BLOCKSIZE-offset ? count-done : BLOCKSIZE-offset;
+	if (n == BLOCKSIZE) {
+	    if (blkflush(unit)) break;
+	    file[unit].bnum = block;
+	} else if (blkget(unit, block)) {
+	    break;
+	}
+	memcpy(file[unit].bbuf+offset, buffer+done, n);
+	file[unit].bdirty = 1;
+	// a block is written once it is complete, else by fileflush()
+	if (offset+n == BLOCKSIZE && blkflush(unit)) break;
+	file[unit].pos += n;
+	done += n;
+    }
 
-    if (!file[unit].wflag) return -2;
+    return done;
+}
+
+
+
+//
+// init RT-11 file directory structures (based on RT-11 v5.4)
+//
+static int32_t rt11_init (int32_t unit)
+{
+    uint8_t *buffer;
+    int32_t nblocks;
+    int32_t segments;
+    int32_t length;
+    int32_t status;
+
+    // a volume can not reach the last block of a full size tape
+    nblocks = file[unit].nblocks;
+    if (nblocks > RT11MAX) nblocks = RT11MAX;
+
+    // directory segments as RT-11 INIT would allocate for the size,
+    // the first holds one empty area covering the rest of the volume
+    segments = rt11_segments(nblocks);
+    length = rt11_sysblocks(segments)*BLOCKSIZE;
+    if ((buffer = calloc(1, length)) == NULL) return -1;
+
+    status = rt11format(buffer, nblocks, segments, NULL, 0);
+
+    // now write the boot block, home block and directory
+    file[unit].pos = 0;
+    if (!status && bufwrite(unit, buffer, length) != length) status = -1;
+
+    free(buffer);
+    return status;
+}
 
-    return write(file[unit].fd, buffer, count);
+
+
+//
+// init XXDP file directory structures (based on XXDPv2.5)
+//
+static int32_t xxdp_init (int32_t unit)
+{
+    uint8_t *buffer;
+    int32_t length;
+    int32_t status;
+
+    length = xxdp_sysblocks(file[unit].nblocks)*BLOCKSIZE;
+    if ((buffer = calloc(1, length)) == NULL) return -1;
+
+    status = xxdpformat(buffer, file[unit].nblocks);
+
+    // now write the MFD, UFD and BITMAP blocks
+    file[unit].pos = 0;
+    if (!status && bufwrite(unit, buffer, length) != length) status = -1;
+
+    free(buffer);
+    return status;
+}
+
+
+
+//
+// init a blank tape image (all zero)
+//
+static int32_t zero_init (int32_t unit)
+{
+    int32_t i;
+    uint8_t buf[BLOCKSIZE];
+
+    int32_t n = file[unit].tapesize;
+
+    // a container just starts over with an empty index
+    if (file[unit].type == FILETYPE_SPARSE) {
+	if (sparsecreate(unit, file[unit].fd, n, file[unit].opts & OPT_COMPRESS)) return -1;
+	file[unit].size = n*BLOCKSIZE;
+	file[unit].nblocks = n;
+	return 0;
+    }
+
+    // as does an index into a block store
+    if (file[unit].type == FILETYPE_STORE) {
+	if (storecreate(unit, file[unit].fd, file[unit].store, n)) return -1;
+	file[unit].size = n*BLOCKSIZE;
+	file[unit].nblocks = n;
+	return 0;
+    }
+
+    // a raw image no longer than a tape is simply cut back and extended,
+    // which leaves a hole that reads as zeros without writing any data
+    if (file[unit].size <= n*BLOCKSIZE) {
+	if (ftruncate(file[unit].fd, 0) || ftruncate(file[unit].fd, (off_t)n*BLOCKSIZE)) return -1;
+	i = n;
+    } else {
+#ifdef FALLOC_FL_ZERO_RANGE
+	// a longer one keeps its tail, zero the tape part in place
+	i = fallocate(file[unit].fd, FALLOC_FL_ZERO_RANGE, 0, (off_t)n*BLOCKSIZE) ? 0 : n;
+#else
+	i = 0;
+#endif // FALLOC_FL_ZERO_RANGE
+    }
+
+    // else zero the tape a block at a time
+    memset(buf, 0, sizeof(buf));
+    for (; i < n; i++)
+	if (blkwrite(unit, i, buf)) return -1;
+
+    // the image may have been extended
+    file[unit].size = lseek(file[unit].fd, 0, SEEK_END);
+    file[unit].nblocks = (file[unit].size+BLOCKSIZE-1)/BLOCKSIZE;
+
+    return 0;
+}
+
+
+
+//
+// open the file of a unit set up by fileopen(), init it if asked
+//
+static int32_t unitopen (int32_t unit)
+{
+    struct stat st;
+    int32_t isdir;
+    int32_t isnbd;
+    int32_t fd;
+    int32_t nblocks = 0;
+
+    // a directory is only read, its writes are kept apart
+    isnbd = nbdname(file[unit].name);
+    isdir = !isnbd && stat(file[unit].name, &st) == 0 && S_ISDIR(st.st_mode);
+    if ((isdir || isnbd) && file[unit].cflag) {
+	error("fileopen cannot create an image on %s '%s'", isdir ? "directory" : "NBD export", file[unit].name);
+	return -2;
+    }
+
+    // open file if it exists, an export of an NBD server is kept by nbd.c
+    if (isnbd)
+	fd = nbdopen(unit, file[unit].name, &nblocks);
+    else if (file[unit].wflag && !isdir)
+	fd = open(file[unit].name, O_BINARY|O_RDWR, 0666);
+    else
+	fd = open(file[unit].name, O_BINARY|O_RDONLY);
+
+    // create file if it does not exist
+    if (fd < 0 && file[unit].cflag) fd = open(file[unit].name, O_BINARY|O_RDWR|O_CREAT, 0666);
+    if (fd < 0) { error("fileopen cannot open or create '%s'", file[unit].name); return -2; }
+
+    // store opened file information
+    file[unit].fd = fd;
+    file[unit].pos = 0;
+    file[unit].bnum = -1;
+
+    // recognize the image format
+    if (isnbd) {
+	// export of an NBD server
+	if (file[unit].wflag && nbdreadonly(unit)) {
+	    info("NBD export '%s' is read only", file[unit].name);
+	    file[unit].wflag = 0;
+	}
+	file[unit].type = FILETYPE_NBD;
+	file[unit].nblocks = nblocks;
+	file[unit].size = nblocks*BLOCKSIZE;
+    } else if (isdir) {
+	// host directory shown as an RT-11 volume
+	if ((nblocks = vdiropen(unit, file[unit].name, file[unit].tapesize, file[unit].opts & OPT_WBACK)) < 0) {
+	    error("fileopen cannot read directory '%s'", file[unit].name);
+	    close(fd);
+	    file[unit].fd = -1;
+	    return -6;
+	}
+	file[unit].type = FILETYPE_VDIR;
+	file[unit].nblocks = nblocks;
+	file[unit].size = nblocks*BLOCKSIZE;
+    } else if ((nblocks = sparseopen(unit, fd)) >= 0) {
+	// sparse container
+	file[unit].type = FILETYPE_SPARSE;
+	file[unit].nblocks = nblocks;
+	file[unit].size = nblocks*BLOCKSIZE;
+    } else if (nblocks < -1 || (nblocks = storeopen(unit, fd)) < -1) {
+	error("fileopen cannot read container '%s'", file[unit].name);
+	close(fd);
+	file[unit].fd = -1;
+	return -6;
+    } else if (nblocks >= 0) {
+	// index into a block store
+	file[unit].type = FILETYPE_STORE;
+	file[unit].nblocks = nblocks;
+	file[unit].size = nblocks*BLOCKSIZE;
+    } else {
+	// raw image, or a new image to be made a container or store index
+	file[unit].type = FILETYPE_RAW;
+	if (file[unit].cflag && (file[unit].opts & OPT_SPARSE)) file[unit].type = FILETYPE_SPARSE;
+	if (file[unit].cflag && file[unit].store) file[unit].type = FILETYPE_STORE;
+	file[unit].size = lseek(fd, 0, SEEK_END);
+	file[unit].nblocks = (file[unit].size+BLOCKSIZE-1)/BLOCKSIZE;
+    }
+
+    // zap tape if requested
+    if (file[unit].cflag) {
+	if (!zero_init(unit)) {
+	    info("initialize tape on '%s'", file[unit].name);
+	} else {
+	    error("fileopen cannot init tape on '%s'", file[unit].name);
+	    return -3;
+	}
+    }
+
+    // initialize RT-11 directory structure ?
+    if (file[unit].iflag) {
+	if (!rt11_init(unit)) {
+	    info("initialize RT-11 directory on '%s'", file[unit].name);
+	} else {
+	    error("fileopen cannot init RT-11 filesystem on '%s'", file[unit].name);
+	    return -4;
+	}
+    }
+
+    // initialize XXDP directory structure ?
+    if (file[unit].xflag) {
+	if (!xxdp_init(unit)) {
+	    info("initialize XXDP directory on '%s'", file[unit].name);
+	} else {
+	    error("fileopen cannot init XXDP filesystem on '%s'", file[unit].name);
+	    return -5;
+	}
+    }
+
+    // any partial block left over from initialization
+    if (blkflush(unit)) {
+	error("fileopen cannot write '%s'", file[unit].name);
+	return -7;
+    }
+
+    // join the cache other emulators keep of the same image
+    if ((file[unit].opts & OPT_SHARED) && (file[unit].type == FILETYPE_RAW || file[unit].type == FILETYPE_SPARSE
+					     || file[unit].type == FILETYPE_STORE) && shmopen(unit, file[unit].fd, file[unit].nblocks))
+	error("fileopen cannot attach shared cache for '%s'", file[unit].name);
+
+    // keep tracking changed blocks if a bitmap exists, start one if asked
+    if (file[unit].wflag && dirtyopen(unit, file[unit].opts & OPT_DIRTY) == -4)
+	error("fileopen cannot init dirty bitmap on '%s'", file[unit].name);
+
+    // a freshly initialized tape has changed everywhere
+    if (file[unit].cflag) dirtymark(unit, 0, file[unit].nblocks*BLOCKSIZE);
+
+    // use a CRC index if one exists, create one if asked
+    if (crcopen(unit, file[unit].opts & OPT_CRC))
+	error("fileopen cannot init CRC index on '%s'", file[unit].name);
+
+    // likewise a hash tree
+    if (treeopen(unit, file[unit].opts & OPT_TREE))
+	error("fileopen cannot init hash tree on '%s'", file[unit].name);
+
+    // private copies of blocks would not see the writes of other emulators
+    if (shmshared(unit) && (file[unit].opts & (OPT_AHEAD|OPT_HEAT)))
+	info("unit %d shares its cache, no read-ahead or access profile", unit);
+
+    // buffers for read-ahead
+    if ((file[unit].opts & OPT_AHEAD) && !shmshared(unit) && aheadinit(unit))
+	error("fileopen cannot init read-ahead on '%s'", file[unit].name);
+
+    // learn which blocks the host reads, and preload those it read last time
+    if ((file[unit].opts & OPT_HEAT) && !shmshared(unit) && warmopen(unit))
+	error("fileopen cannot init access profile on '%s'", file[unit].name);
+
+    // output some info...
+    info("unit %d %c%c%c%c%c file '%s'",
+	 unit,
+	 file[unit].rflag ? 'r' : ' ',
+	 file[unit].wflag ? 'w' : ' ',
+	 file[unit].cflag ? 'c' : ' ',
+	 file[unit].iflag ? 'i' : file[unit].xflag ? 'x' : ' ',
+	 file[unit].type == FILETYPE_SPARSE ? 's' : file[unit].type == FILETYPE_STORE ? 'd' :
+	 file[unit].type == FILETYPE_VDIR ? 'v' : file[unit].type == FILETYPE_NBD ? 'n' : ' ',
+	 file[unit].name);
+
+    return 0;
+}
+
+
+
+//
+// background open of a unit that must be created
+//
+static void *opener (void *arg)
+{
+    int32_t unit = (intptr_t)arg;
+
+    rthelper();
+
+    pthread_mutex_lock(&file[unit].lock);
+    if (file[unit].state == UNIT_PENDING)
+	file[unit].state = unitopen(unit) ? UNIT_FAILED : UNIT_OPEN;
+    pthread_mutex_unlock(&file[unit].lock);
+
+    return NULL;
+}
+
+
+
+//
+// options currently in effect, as OPT_xxx
+//
+static uint16_t curopts (void)
+{
+    return (dirtymap   ? OPT_DIRTY    : 0) |
+	   (sparseimg  ? OPT_SPARSE   : 0) |
+	   (compress   ? OPT_COMPRESS : 0) |
+	   (crcindex   ? OPT_CRC      : 0) |
+	   (hashtree   ? OPT_TREE     : 0) |
+	   (prefetch   ? OPT_AHEAD    : 0) |
+	   (profile    ? OPT_HEAT     : 0) |
+	   (sharecache ? OPT_SHARED   : 0) |
+	   (writeback  ? OPT_WBACK    : 0);
+}
+
+
+
+//
+// set up a file for a unit, new images go in block store if not NULL
+//
+// the file is opened on first use, except that new images are created
+// by filestart() all at once
+//
+int32_t fileopen (char *name,
+		  int32_t mode,
+		  char *store)
+{
+    // check if we can open any more units
+    if (fpt >= NTU58) { error("no more units available"); return -1; }
+
+    // save some data
+    if ((file[fpt].name = strdup(name)) == NULL) return -1;
+    file[fpt].store = store;
+    file[fpt].rflag = 1;
+    if (mode == FILEWRITE) file[fpt].wflag = 1;
+    if (mode == FILECREATE) file[fpt].wflag = file[fpt].cflag = 1;
+    if (mode == FILERT11INIT) file[fpt].wflag = file[fpt].cflag = file[fpt].iflag = 1;
+    if (mode == FILEXXDPINIT) file[fpt].wflag = file[fpt].cflag = file[fpt].xflag = 1;
+
+    // the options in effect now apply whenever the file is opened
+    file[fpt].tapesize = tapesize;
+    file[fpt].opts = curopts();
+
+    // still say at once if an existing image cannot be used
+    if (!file[fpt].cflag && !nbdname(name) && access(name, file[fpt].wflag ? R_OK|W_OK : R_OK)) {
+	error("fileopen cannot open or create '%s'", name);
+	file[fpt].rflag = file[fpt].wflag = 0;
+	free(file[fpt].name);
+	file[fpt].name = NULL;
+	return -2;
+    }
+
+    file[fpt].state = UNIT_PENDING;
+    fpt++;
+    return 0;
+}
+
+
+
+//
+// create and init all new images in parallel
+//
+void filestart (void)
+{
+    int32_t unit;
+
+    for (unit = 0; unit < fpt; unit++) {
+	if (file[unit].state != UNIT_PENDING || !file[unit].cflag) continue;
+	if (pthread_create(&file[unit].opener, NULL, opener, (void *)(intptr_t)unit)) {
+	    // do it here then
+	    opener((void *)(intptr_t)unit);
+	    continue;
+	}
+	file[unit].opening = 1;
+    }
+
+    return;
+}
+
+
+
+//
+// close the file of a unit and everything kept with it, leaving the
+// unit empty; the caller holds the unit lock
+//
+static void unitclose (int32_t unit)
+{
+    // a block being read ahead without the lock is let finish first
+    while (ahead[unit].loading) pthread_cond_wait(&ahead[unit].done, &file[unit].lock);
+
+    if (file[unit].fd != -1) {
+	blkflush(unit);
+	if (file[unit].type == FILETYPE_SPARSE) sparseclose(unit);
+	if (file[unit].type == FILETYPE_STORE) storeclose(unit);
+	if (file[unit].type == FILETYPE_VDIR) vdirclose(unit);
+	if (file[unit].type == FILETYPE_NBD)
+	    nbdclose(unit);
+	else
+	    close(file[unit].fd);
+	file[unit].fd = -1;
+    }
+    if (file[unit].dfd != -1) {
+	close(file[unit].dfd);
+	file[unit].dfd = -1;
+    }
+    if (file[unit].dirty) {
+	free(file[unit].dirty);
+	file[unit].dirty = NULL;
+    }
+    if (file[unit].cfd != -1) {
+	close(file[unit].cfd);
+	file[unit].cfd = -1;
+    }
+    if (file[unit].crc) {
+	free(file[unit].crc);
+	file[unit].crc = NULL;
+    }
+    merkleclose(unit);
+    shmclose(unit);
+    heatclose(unit);
+    aheadclose(unit);
+    if (file[unit].name) {
+	free(file[unit].name);
+	file[unit].name = NULL;
+    }
+
+    file[unit].state = UNIT_NONE;
+    file[unit].rflag = file[unit].wflag = 0;
+    file[unit].cflag = file[unit].iflag = file[unit].xflag = 0;
+    file[unit].type = FILETYPE_RAW;
+    file[unit].size = 0;
+    file[unit].nblocks = 0;
+    file[unit].pos = 0;
+    file[unit].bnum = -1;
+    file[unit].bdirty = 0;
+    file[unit].scrub = 0;
+    file[unit].rbytes = 0;
+    file[unit].wbytes = 0;
+    return;
+}
+
+
+
+//
+// open every unit now and have the kernel read raw images in behind us
+//
+// done before a real-time drive starts, so no host command waits for a
+// file to be opened; the read-in runs in the background and does not
+// hold up startup. Containers, store indexes, directories and NBD
+// exports go through their own code on every read, so only --heat
+// warming helps those
+//
+void fileprefault (void)
+{
+    int32_t unit;
+
+    for (unit = 0; unit < NTU58; unit++) {
+	if (file[unit].state == UNIT_NONE || fileunit(unit)) continue;
+	if (file[unit].type != FILETYPE_RAW) continue;
+#ifdef POSIX_FADV_WILLNEED
+	pthread_mutex_lock(&file[unit].lock);
+	posix_fadvise(file[unit].fd, 0, 0, POSIX_FADV_WILLNEED);
+	pthread_mutex_unlock(&file[unit].lock);
+	if (verbose) info("unit %d %d blocks being read in", unit, file[unit].nblocks);
+#endif // POSIX_FADV_WILLNEED
+    }
+
+    return;
+}
+
+
+
+//
+// wait for the new images still being created, so that exiting never
+// leaves one half made; an opener calling this does not wait for itself
+//
+void filewait (void)
+{
+    int32_t unit;
+
+    for (unit = 0; unit < NTU58; unit++) {
+	if (!file[unit].opening || pthread_equal(file[unit].opener, pthread_self())) continue;
+	pthread_join(file[unit].opener, NULL);
+	file[unit].opening = 0;
+    }
+    return;
+}
+
+
+
+//
+// close file structures for all units
+//
+void fileclose (void)
+{
+    int32_t unit;
+
+    // let new images finish first
+    filewait();
+
+    for (unit = 0; unit < NTU58; unit++) {
+	pthread_mutex_lock(&file[unit].lock);
+	unitclose(unit);
+	pthread_mutex_unlock(&file[unit].lock);
+    }
+    return;
+}
+
+
+
+//
+// hold a unit for the length of a host command
+//
+int32_t filehold (int32_t unit)
+{
+    if (unit < 0 || unit >= NTU58) return -1;
+
+    pthread_mutex_lock(&file[unit].busy);
+    return 0;
+}
+
+
+
+//
+// release a unit held by filehold()
+//
+void filerelease (int32_t unit)
+{
+    if (unit < 0 || unit >= NTU58) return;
+
+    pthread_mutex_unlock(&file[unit].busy);
+    return;
+}
+
+
+
+//
+// wait for the host command in progress on a unit to finish, and hold it
+//
+static int32_t unitwait (int32_t unit)
+{
+    int32_t n;
+
+    for (n = 0; pthread_mutex_trylock(&file[unit].busy); n++) {
+	if (n >= HOLDWAIT) return -1;
+	usleep(1000);
+    }
+
+    return 0;
+}
+
+
+
+//
+// put an image in a unit between host commands, replacing any there
+//
+// the image is read ahead of the swap, so the unit is only out of
+// service for as long as it takes to switch files; an image that fails
+// to open puts back the one that was there
+//
+int32_t fileinsert (int32_t unit,
+		    char *name,
+		    int32_t write)
+{
+    timespec_t start;
+    timespec_t end;
+    char *copy;
+    char *old = NULL;
+    uint8_t oldstate = UNIT_NONE;
+    uint8_t oldflags[4];
+    int32_t fd;
+    int32_t status;
+
+    if (unit < 0 || unit >= NTU58) { error("fileinsert bad unit %d", unit); return -1; }
+
+    if (nbdname(name)) {
+	// nothing local to read ahead
+    } else if ((fd = open(name, O_BINARY|O_RDONLY)) < 0) {
+	error("fileinsert cannot open '%s'", name);
+	return -2;
+    } else {
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif // POSIX_FADV_WILLNEED
+	close(fd);
+    }
+
+    if ((copy = strdup(name)) == NULL) return -3;
+
+    if (unitwait(unit)) {
+	error("fileinsert unit %d is busy", unit);
+	free(copy);
+	return -4;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&file[unit].lock);
+
+    // a new unit takes the options in effect now, else keeps its own
+    if (file[unit].state == UNIT_NONE && !file[unit].name) file[unit].opts = curopts();
+    if ((file[unit].state == UNIT_OPEN || file[unit].state == UNIT_PENDING) && file[unit].name) {
+	old = strdup(file[unit].name);
+	oldstate = file[unit].state;
+	oldflags[0] = file[unit].wflag;
+	oldflags[1] = file[unit].cflag;
+	oldflags[2] = file[unit].iflag;
+	oldflags[3] = file[unit].xflag;
+    }
+    unitclose(unit);
+
+    file[unit].name = copy;
+    file[unit].rflag = 1;
+    file[unit].wflag = write ? 1 : 0;
+    status = unitopen(unit);
+    file[unit].state = status ? UNIT_FAILED : UNIT_OPEN;
+    if (unit >= fpt) fpt = unit+1;
+
+    // the new image is no good, go back to the old one, which if it was
+    // still to be opened keeps what it was to be created with
+    if (status && old) {
+	unitclose(unit);
+	file[unit].name = old;
+	file[unit].rflag = 1;
+	file[unit].wflag = oldflags[0];
+	old = NULL;
+	if (oldstate == UNIT_PENDING) {
+	    file[unit].cflag = oldflags[1];
+	    file[unit].iflag = oldflags[2];
+	    file[unit].xflag = oldflags[3];
+	    file[unit].state = UNIT_PENDING;
+	    info("unit %d keeps '%s'", unit, file[unit].name);
+	} else if (unitopen(unit)) {
+	    error("fileinsert cannot reopen '%s', unit %d is empty", file[unit].name, unit);
+	} else {
+	    file[unit].state = UNIT_OPEN;
+	    info("unit %d keeps '%s'", unit, file[unit].name);
+	}
+    }
+    if (old) free(old);
+
+    pthread_mutex_unlock(&file[unit].lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    filerelease(unit);
+
+    if (status) return -5;
+
+    info("unit %d inserted '%s' in %.3fms", unit, name,
+	 (end.tv_sec-start.tv_sec)*1000.0 + (end.tv_nsec-start.tv_nsec)/1000000.0);
+    return 0;
+}
+
+
+
+//
+// take the image out of a unit between host commands
+//
+int32_t fileeject (int32_t unit)
+{
+    if (unit < 0 || unit >= NTU58) { error("fileeject bad unit %d", unit); return -1; }
+
+    if (unitwait(unit)) {
+	error("fileeject unit %d is busy", unit);
+	return -2;
+    }
+
+    pthread_mutex_lock(&file[unit].lock);
+    unitclose(unit);
+    pthread_mutex_unlock(&file[unit].lock);
+    filerelease(unit);
+
+    info("unit %d ejected", unit);
+    return 0;
+}
+
+
+
+//
+// allow or forbid host writes to a unit
+//
+// writes can only be allowed on an image opened for writing
+//
+int32_t fileprotect (int32_t unit,
+		     int32_t protect)
+{
+    int32_t status = 0;
+
+    if (fileunit(unit)) return -1;
+
+    pthread_mutex_lock(&file[unit].lock);
+    if (protect)
+	file[unit].wflag = 0;
+    else if (file[unit].type == FILETYPE_NBD ? !nbdreadonly(unit) :
+	     file[unit].type == FILETYPE_VDIR || (fcntl(file[unit].fd, F_GETFL) & O_ACCMODE) == O_RDWR)
+	file[unit].wflag = 1;
+    else
+	status = -2;
+    pthread_mutex_unlock(&file[unit].lock);
+
+    return status;
+}
+
+
+
+//
+// summarize a unit, returns -1 if it has no image
+//
+int32_t fileinfo (int32_t unit,
+		  unit_info *ui)
+{
+    if (unit < 0 || unit >= NTU58 || !file[unit].name) return -1;
+
+    pthread_mutex_lock(&file[unit].lock);
+    snprintf(ui->name, sizeof(ui->name), "%s", file[unit].name);
+    ui->state = file[unit].state == UNIT_OPEN ? "open" :
+		file[unit].state == UNIT_PENDING ? "pending" : "failed";
+    ui->write = file[unit].wflag;
+    ui->nblocks = file[unit].nblocks;
+    ui->rbytes = file[unit].rbytes;
+    ui->wbytes = file[unit].wbytes;
+    ui->ahead = ahead[unit].slot != NULL;
+    ui->hits = ahead[unit].hits;
+    ui->misses = ahead[unit].misses;
+    ui->wasted = ahead[unit].wasted;
+    pthread_mutex_unlock(&file[unit].lock);
+
+    return 0;
+}
+
+
+
+//
+// check file unit OK
+//
+int32_t fileunit (int32_t unit)
+{
+    if (unit < 0 || unit >= NTU58 || file[unit].state == UNIT_NONE) {
+	error("bad unit %d", unit);
+	return -1;
+    }
+
+    // first use of the unit opens its file
+    if (file[unit].state == UNIT_PENDING) {
+	pthread_mutex_lock(&file[unit].lock);
+	if (file[unit].state == UNIT_PENDING)
+	    file[unit].state = unitopen(unit) ? UNIT_FAILED : UNIT_OPEN;
+	pthread_mutex_unlock(&file[unit].lock);
+    }
+
+    if (file[unit].state != UNIT_OPEN) {
+	error("bad unit %d", unit);
+	return -1;
+    }
+    return 0;
+}
+
+
+
+//
+// seek file (tape) position
+//
+int32_t fileseek (int32_t unit,
+		  int32_t size,
+		  int32_t block,
+		  int32_t offset)
+{
+    if (fileunit(unit)) return -1;
+
+    if (block*size+offset >= file[unit].size) return -2;
+
+    pthread_mutex_lock(&file[unit].lock);
+    file[unit].pos = block*size+offset;
+    file[unit].atime = time(NULL);
+    pthread_mutex_unlock(&file[unit].lock);
+
+    return 0;
+}
+
+
+
+//
+// read bytes from the tape image file
+//
+int32_t fileread (int32_t unit,
+		  uint8_t *buffer,
+		  int32_t count)
+{
+    int32_t done = 0;
+    int32_t status = 0;
+    int32_t offset;
+    int32_t n;
+
+    if (fileunit(unit)) return -1;
+
+    if (!file[unit].rflag) return -2;
+
+    pthread_mutex_lock(&file[unit].lock);
+
+    // copy out of the block buffer a block at a time
+    while (done < count) {
+	offset = file[unit].pos % BLOCKSIZE;
+	n = count-done < BLOCKSIZE-offset ? count-done : BLOCKSIZE-offset;
+	heattouch(unit, file[unit].pos/BLOCKSIZE);
+	if ((status = warmget(unit, file[unit].pos/BLOCKSIZE))) break;
+	if ((status = aheadget(unit, file[unit].pos/BLOCKSIZE))) break;
+	if ((status = blkget(unit, file[unit].pos/BLOCKSIZE))) break;
+	memcpy(buffer+done, file[unit].bbuf+offset, n);
+	file[unit].pos += n;
+	done += n;
+    }
+    file[unit].rbytes += done;
+
+    pthread_mutex_unlock(&file[unit].lock);
+
+    // -4 says the data failed its CRC check
+    return done > 0 ? done : status == -5 ? -4 : -3;
+}
+
+
+
+//
+// write bytes to the tape image file
+//
+int32_t filewrite (int32_t unit,
+		   uint8_t *buffer,
+		   int32_t count)
+{
+    int32_t done;
+
+    if (fileunit(unit)) return -1;
+
+    if (!file[unit].wflag) return -2;
+
+    pthread_mutex_lock(&file[unit].lock);
+    done = bufwrite(unit, buffer, count);
+    if (done > 0) file[unit].wbytes += done;
+    pthread_mutex_unlock(&file[unit].lock);
+
+    return done > 0 ? done : -3;
+}
+
+
+
+//
+// write any partial block held for a unit to the image
+//
+int32_t fileflush (int32_t unit)
+{
+    int32_t status;
+
+    if (fileunit(unit)) return -1;
+
+    pthread_mutex_lock(&file[unit].lock);
+    status = blkflush(unit);
+    // writes to a server are only known to be done once it answers
+    if (file[unit].type == FILETYPE_NBD && nbdflush(unit)) status = -1;
+    pthread_mutex_unlock(&file[unit].lock);
+
+    return status;
+}
+
+
+
+//
+// note the blocks a read command is about to read, stage what is likely next
+//
+// the command stream is sequential when each read starts where the last one
+// ended, and strided when reads start a constant distance apart
+//
+void fileahead (int32_t unit,
+		int32_t count)
+{
+    ahead_slot *slot;
+    int32_t first;
+    int32_t stride;
+    int32_t step;
+    int32_t queued;
+    int32_t block;
+    int32_t n;
+    int32_t i;
+
+    if (fileunit(unit) || !ahead[unit].slot) return;
+
+    pthread_mutex_lock(&file[unit].lock);
+
+    first = file[unit].pos / BLOCKSIZE;
+    n = (file[unit].pos % BLOCKSIZE + count + BLOCKSIZE-1) / BLOCKSIZE;
+    stride = first - ahead[unit].last;
+
+    if (first == ahead[unit].next) {
+	step = n;
+    } else if (stride != 0 && stride == ahead[unit].stride) {
+	step = stride;
+    } else {
+	// no pattern, drop anything staged for the old one
+	for (i = 0; i < AHEADSLOTS; i++) {
+	    if (ahead[unit].slot[i].state == SLOT_READY) ahead[unit].wasted++;
+	    ahead[unit].slot[i].state = SLOT_FREE;
+	}
+	step = 0;
+    }
+
+    ahead[unit].stride = stride;
+    ahead[unit].last = first;
+    ahead[unit].next = first + n;
+
+    // queue the blocks of the reads expected next, up to AHEADDEPTH of them
+    for (queued = 0, first += step; step && queued < AHEADDEPTH; first += step) {
+	for (block = first; block < first+n && queued < AHEADDEPTH; block++, queued++) {
+	    if (block < 0 || block >= file[unit].nblocks) goto done;
+	    for (slot = NULL, i = 0; i < AHEADSLOTS; i++) {
+		if (ahead[unit].slot[i].state != SLOT_FREE && ahead[unit].slot[i].block == block) break;
+		// reuse free slots, else those the host has already passed by
+		if (!slot && (ahead[unit].slot[i].state == SLOT_FREE
+			      || (step > 0 && ahead[unit].slot[i].block < ahead[unit].last)
+			      || (step < 0 && ahead[unit].slot[i].block >= ahead[unit].next)))
+		    slot = &ahead[unit].slot[i];
+	    }
+	    if (i < AHEADSLOTS) continue;
+	    if (!slot) goto done;
+	    if (slot->state == SLOT_READY) ahead[unit].wasted++;
+	    slot->state = SLOT_QUEUED;
+	    slot->block = block;
+	}
+    }
+
+ done:
+    pthread_mutex_unlock(&file[unit].lock);
+
+    if (step) {
+	pthread_mutex_lock(&aheadlock);
+	aheadwork = 1;
+	pthread_cond_signal(&aheadwake);
+	pthread_mutex_unlock(&aheadlock);
+    }
+
+    return;
+}
+
+
+
+//
+// report read-ahead counters for a unit
+//
+void fileaheadstats (int32_t unit)
+{
+    if (unit < 0 || unit >= NTU58 || !ahead[unit].slot) return;
+
+    info("unit %d read-ahead hits %u misses %u wasted %u",
+	 unit, ahead[unit].hits, ahead[unit].misses, ahead[unit].wasted);
+
+    return;
+}
+
+
+
+//
+// background scrubber, checks idle units against their CRC index
+//
+static void *scrubber (void *none)
+{
+    uint8_t buffer[BLOCKSIZE];
+    int32_t unit;
+    int32_t n;
+
+    rthelper();
+
+#ifdef SCHED_IDLE
+    // only run when nothing else wants the cpu
+    struct sched_param param;
+    param.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif // SCHED_IDLE
+
+    for (;;) {
+	for (unit = 0; unit < NTU58; unit++) {
+	    if (file[unit].fd == -1 || !file[unit].crc) continue;
+	    // leave units alone while the host is using them
+	    if (time(NULL) - file[unit].atime < SCRUBIDLE) continue;
+	    for (n = 0; n < SCRUBBATCH; n++) {
+		pthread_mutex_lock(&file[unit].lock);
+		if (file[unit].scrub >= file[unit].nblocks) file[unit].scrub = 0;
+		if (blkcheck(unit, file[unit].scrub, buffer) == -5)
+		    error("scrubber found unit %d block 0x%04X corrupt", unit, file[unit].scrub);
+		file[unit].scrub++;
+		pthread_mutex_unlock(&file[unit].lock);
+	    }
+	}
+	// throttle to SCRUBBATCH blocks per unit per interval
+	usleep(SCRUBWAIT*1000);
+    }
+
+    return NULL;
+}
+
+
+
+//
+// start the background scrubber
+//
+int32_t filescrub (void)
+{
+    pthread_t th_scrub;
+
+    if (pthread_create(&th_scrub, NULL, scrubber, NULL)) {
+	error("unable to create scrubber thread");
+	return -1;
+    }
+    pthread_detach(th_scrub);
+
+    return 0;
+}
+
+
+
+//
+// write the blocks of a unit selected by a bitmap as a delta file
+//
+static int32_t deltawrite (int32_t unit,
+			   char *name,
+			   uint8_t *map)
+{
+    delta_header hdr;
+    uint8_t buffer[BLOCKSIZE];
+    int32_t block;
+    int32_t fd;
+
+    if ((fd = open(name, O_BINARY|O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0) {
+	error("cannot create delta '%s'", name);
+	return -1;
+    }
+
+    memcpy(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic));
+    hdr.blocksize = BLOCKSIZE;
+    hdr.nblocks = file[unit].nblocks;
+    hdr.count = 0;
+    for (block = 0; block < file[unit].nblocks; block++)
+	if (map[block/8] & (1 << (block%8))) hdr.count++;
+
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) goto fail;
+
+    // a record is the block number followed by the block data
+    for (block = 0; block < file[unit].nblocks; block++) {
+	if (!(map[block/8] & (1 << (block%8)))) continue;
+	if (blkread(unit, block, buffer)) goto fail;
+	if (write(fd, &block, sizeof(block)) != sizeof(block)) goto fail;
+	if (write(fd, buffer, sizeof(buffer)) != sizeof(buffer)) goto fail;
+    }
+
+    if (fsync(fd)) goto fail;
+    close(fd);
+
+    info("unit %d wrote %d of %d blocks to '%s'", unit, hdr.count, file[unit].nblocks, name);
+    return 0;
+
+ fail:
+    error("write error on delta '%s'", name);
+    close(fd);
+    return -2;
+}
+
+
+
+//
+// export blocks changed since the last export as a delta file
+//
+int32_t fileexport (int32_t unit,
+		    char *name)
+{
+    int32_t size;
+
+    if (fileunit(unit) || blkflush(unit)) return -1;
+
+    // without a bitmap there is no baseline, so every block is exported
+    if (dirtyopen(unit, 1)) { error("fileexport cannot open dirty bitmap for unit %d", unit); return -2; }
+    size = dirtysize(unit);
+
+    if (deltawrite(unit, name, file[unit].dirty)) return -3;
+
+    // only forget what changed once the delta is safely on disk
+    memset(file[unit].dirty, 0, size);
+    if (pwrite(file[unit].dfd, file[unit].dirty, size, 0) != size)
+	error("fileexport cannot clear dirty bitmap for unit %d", unit);
+
+    return 0;
+}
+
+
+
+//
+// compare a unit against the hash tree of another image
+//
+int32_t filediff (int32_t unit,
+		  char *name)
+{
+    int32_t count;
+    int32_t block;
+    int32_t last;
+
+    if (fileunit(unit) || blkflush(unit)) return -1;
+
+    if (treeopen(unit, 1)) { error("filediff cannot build hash tree for unit %d", unit); return -2; }
+
+    if (diffmap) free(diffmap);
+    if ((diffmap = calloc(dirtysize(unit), 1)) == NULL) return -3;
+    diffunit = unit;
+
+    if ((count = merklediff(unit, name, diffmap)) < 0) return -4;
+
+    info("unit %d differs from '%s' in %d of %d blocks", unit, name, count, file[unit].nblocks);
+
+    // list the differences as ranges of blocks
+    for (block = 0; block < file[unit].nblocks; block = last) {
+	for (last = block; last < file[unit].nblocks && (diffmap[last/8] & (1 << (last%8))); last++);
+	if (last > block) info("  blocks 0x%04X..0x%04X", block, last-1);
+	else last++;
+    }
+
+    return 0;
+}
+
+
+
+//
+// write the blocks found by the last filediff() as a delta file
+//
+int32_t filepatch (int32_t unit,
+		   char *name)
+{
+    if (fileunit(unit) || blkflush(unit)) return -1;
+
+    if (!diffmap || diffunit != unit) { error("filepatch has no comparison for unit %d", unit); return -2; }
+
+    return deltawrite(unit, name, diffmap) ? -3 : 0;
+}
+
+
+
+//
+// apply a delta file to a unit image
+//
+// the whole file is checked before the first block is written, so a delta
+// for another image, or a damaged one, leaves the image as it was
+//
+int32_t fileapply (int32_t unit,
+		   char *name)
+{
+    delta_header hdr;
+    uint8_t buffer[BLOCKSIZE];
+    struct stat st;
+    int32_t block;
+    int32_t n;
+    int32_t fd;
+
+    if (fileunit(unit) || blkflush(unit)) return -1;
+
+    if (!file[unit].wflag) { error("fileapply unit %d is not writable", unit); return -2; }
+
+    if ((fd = open(name, O_BINARY|O_RDONLY)) < 0) {
+	error("fileapply cannot open '%s'", name);
+	return -3;
+    }
+
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+	|| memcmp(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic))
+	|| hdr.blocksize != BLOCKSIZE) {
+	error("fileapply '%s' is not a delta file", name);
+	close(fd);
+	return -4;
+    }
+
+    if (hdr.nblocks != file[unit].nblocks) {
+	error("fileapply '%s' is for a %d block image, unit %d has %d blocks",
+	      name, hdr.nblocks, unit, file[unit].nblocks);
+	close(fd);
+	return -8;
+    }
+
+    // a record for each block counted, and nothing more
+    if (fstat(fd, &st) || hdr.count < 0 || hdr.count > hdr.nblocks
+	|| st.st_size != sizeof(hdr) + (off_t)hdr.count*(sizeof(block)+BLOCKSIZE)) {
+	error("fileapply '%s' is truncated or too long for %d records", name, hdr.count);
+	close(fd);
+	return -5;
+    }
+
+    for (n = 0; n < hdr.count; n++) {
+	if (pread(fd, &block, sizeof(block), sizeof(hdr) + (off_t)n*(sizeof(block)+BLOCKSIZE)) != sizeof(block)
+	    || block < 0 || block >= file[unit].nblocks) {
+	    error("fileapply '%s' record %d has bad block 0x%04X", name, n, block);
+	    close(fd);
+	    return -6;
+	}
+    }
+
+    // all good, write them
+    for (n = 0; n < hdr.count; n++) {
+	if (read(fd, &block, sizeof(block)) != sizeof(block)
+	    || read(fd, buffer, sizeof(buffer)) != sizeof(buffer)) {
+	    error("fileapply '%s' cannot read record %d", name, n);
+	    close(fd);
+	    return -5;
+	}
+	if (blkwrite(unit, block, buffer)) {
+	    error("fileapply unit %d write error block 0x%04X", unit, block);
+	    close(fd);
+	    return -7;
+	}
+    }
+
+    close(fd);
+
+    info("unit %d applied %d blocks from '%s'", unit, hdr.count, name);
+    return 0;
 }
 
 
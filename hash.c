@@ -0,0 +1,242 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Checksum and hash routines
+//
+
+
+
+#include "common.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_SSE42	// hardware CRC32C instruction, if the cpu has it
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC32C_ARM	// hardware CRC32C instruction, always present
+#include <arm_acle.h>
+#endif
+
+
+
+// CRC32C (Castagnoli) table for the software version
+
+static uint32_t crctab[256];
+
+
+
+//
+// software CRC32C, a byte at a time
+//
+static uint32_t crc32c_sw (uint32_t crc,
+			   const uint8_t *data,
+			   int32_t count)
+{
+    int32_t i, j;
+
+    // build the table on first use
+    if (crctab[1] == 0) {
+	for (i = 0; i < 256; i++) {
+	    uint32_t c = i;
+	    for (j = 0; j < 8; j++) c = (c >> 1) ^ ((c & 1) ? 0x82F63B78 : 0);
+	    crctab[i] = c;
+	}
+    }
+
+    while (--count >= 0) crc = crctab[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+
+
+#ifdef CRC32C_SSE42
+//
+// hardware CRC32C using the SSE4.2 crc32 instruction
+//
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw (uint32_t crc,
+			   const uint8_t *data,
+			   int32_t count)
+{
+    uint64_t c = crc;
+    uint64_t w;
+
+    for (; count >= 8; count -= 8, data += 8) {
+	memcpy(&w, data, sizeof(w));
+	c = __builtin_ia32_crc32di(c, w);
+    }
+    while (--count >= 0) c = __builtin_ia32_crc32qi(c, *data++);
+
+    return c;
+}
+#endif // CRC32C_SSE42
+
+
+
+#ifdef CRC32C_ARM
+//
+// hardware CRC32C using the ARMv8 crc32c instructions
+//
+static uint32_t crc32c_hw (uint32_t crc,
+			   const uint8_t *data,
+			   int32_t count)
+{
+    uint64_t w;
+
+    for (; count >= 8; count -= 8, data += 8) {
+	memcpy(&w, data, sizeof(w));
+	crc = __crc32cd(crc, w);
+    }
+    while (--count >= 0) crc = __crc32cb(crc, *data++);
+
+    return crc;
+}
+#endif // CRC32C_ARM
+
+
+
+//
+// compute the CRC32C of a buffer, in hardware where available
+//
+uint32_t crc32c (const uint8_t *data,
+		 int32_t count)
+{
+#if defined(CRC32C_SSE42)
+    static int8_t hw = -1;
+    if (hw < 0) hw = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    if (hw) return ~crc32c_hw(~0U, data, count);
+#elif defined(CRC32C_ARM)
+    return ~crc32c_hw(~0U, data, count);
+#endif
+    return ~crc32c_sw(~0U, data, count);
+}
+
+
+
+// SHA-256 round constants
+
+static const uint32_t k256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x,n)	(((x) >> (n)) | ((x) << (32-(n))))
+
+
+
+//
+// process one 64 byte chunk of SHA-256 input
+//
+static void sha256chunk (uint32_t *h,
+			 const uint8_t *p)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, k;
+    int32_t i;
+
+    for (i = 0; i < 16; i++)
+	w[i] = (p[4*i] << 24) | (p[4*i+1] << 16) | (p[4*i+2] << 8) | p[4*i+3];
+    for (i = 16; i < 64; i++)
+	w[i] = w[i-16] + (ROR(w[i-15],7) ^ ROR(w[i-15],18) ^ (w[i-15] >> 3))
+	     + w[i-7] + (ROR(w[i-2],17) ^ ROR(w[i-2],19) ^ (w[i-2] >> 10));
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; k = h[7];
+
+    for (i = 0; i < 64; i++) {
+	uint32_t t1 = k + (ROR(e,6) ^ ROR(e,11) ^ ROR(e,25)) + ((e & f) ^ (~e & g)) + k256[i] + w[i];
+	uint32_t t2 = (ROR(a,2) ^ ROR(a,13) ^ ROR(a,22)) + ((a & b) ^ (a & c) ^ (b & c));
+	k = g; g = f; f = e; e = d + t1;
+	d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+
+    return;
+}
+
+
+
+//
+// compute the SHA-256 digest of a buffer
+//
+void sha256 (const uint8_t *data,
+	     int32_t count,
+	     uint8_t *digest)
+{
+    uint32_t h[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    uint8_t tail[128];
+    uint64_t bits = (uint64_t)count * 8;
+    int32_t left;
+    int32_t i;
+
+    // whole chunks straight from the buffer
+    for (i = 0; i+64 <= count; i += 64) sha256chunk(h, data+i);
+
+    // final one or two chunks, padded and with the bit length
+    left = count - i;
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data+i, left);
+    tail[left] = 0x80;
+    left = (left < 56) ? 64 : 128;
+    for (i = 0; i < 8; i++) tail[left-1-i] = bits >> (8*i);
+    sha256chunk(h, tail);
+    if (left == 128) sha256chunk(h, tail+64);
+
+    for (i = 0; i < 32; i++) digest[i] = h[i/4] >> (24 - 8*(i%4));
+
+    return;
+}
+
+
+
+// the end
@@ -0,0 +1,307 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Block access profiles
+//
+// A profile counts the host reads of every block of an image and records
+// the order in which blocks were first read, in a FILENAME.heat file. A
+// boot touches the same blocks in the same order every time, so the blocks
+// first read during the last run form a warm set that can be loaded into
+// memory, in that order, before the host asks for them.
+//
+
+
+
+#include "common.h"
+
+
+
+// profile file header, followed by a heat_entry per block
+
+#define HEAT_MAGIC	"TU58HOT1"
+
+typedef struct {
+    char	magic[8];	// HEAT_MAGIC
+    int32_t	nblocks;	// blocks in the image
+    int32_t	touched;	// blocks read during the last run
+} heat_header;
+
+typedef struct {
+    uint32_t	count;		// reads over all runs
+    int32_t	order;		// first read position in the last run, -1 if none
+} heat_entry;
+
+// per unit profile state
+
+static struct {
+    int32_t	fd;		// profile file descriptor, -1 if none
+    int32_t	nblocks;	// blocks in the image
+    int32_t	touched;	// blocks read so far this run
+    int32_t	last;		// block of the last read, to count it once
+    heat_entry	*map;		// entry per block
+    int32_t	nwarm;		// blocks in the warm set
+    int32_t	*warm;		// warm set blocks in first read order, -1 if none
+    int32_t	*index;		// warm set position of each block, -1 if none
+    uint8_t	*valid;		// set when a warm set block holds current data
+    uint8_t	*data;		// warm set block data
+} hot [NTU58];
+
+
+
+//
+// init profile state for all units
+//
+void heatinit (void)
+{
+    int32_t unit;
+
+    for (unit = 0; unit < NTU58; unit++) {
+	hot[unit].fd = -1;
+	hot[unit].nblocks = 0;
+	hot[unit].touched = 0;
+	hot[unit].last = -1;
+	hot[unit].map = NULL;
+	hot[unit].nwarm = 0;
+	hot[unit].warm = NULL;
+	hot[unit].index = NULL;
+	hot[unit].valid = NULL;
+	hot[unit].data = NULL;
+    }
+    return;
+}
+
+
+
+//
+// write the profile of a unit back to its file
+//
+static int32_t heatsave (int32_t unit)
+{
+    heat_header hdr;
+    int32_t size = hot[unit].nblocks*sizeof(heat_entry);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, HEAT_MAGIC, sizeof(hdr.magic));
+    hdr.nblocks = hot[unit].nblocks;
+    hdr.touched = hot[unit].touched;
+
+    if (ftruncate(hot[unit].fd, 0)
+	|| pwrite(hot[unit].fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	|| pwrite(hot[unit].fd, hot[unit].map, size, sizeof(hdr)) != size)
+	return -1;
+
+    return 0;
+}
+
+
+
+//
+// save and release profile state for a unit
+//
+void heatclose (int32_t unit)
+{
+    if (hot[unit].fd != -1) {
+	// a run that read nothing keeps the last warm set
+	if (hot[unit].touched && heatsave(unit))
+	    error("unit %d cannot save access profile", unit);
+	close(hot[unit].fd);
+    }
+    if (hot[unit].map) free(hot[unit].map);
+    if (hot[unit].warm) free(hot[unit].warm);
+    if (hot[unit].index) free(hot[unit].index);
+    if (hot[unit].valid) free(hot[unit].valid);
+    if (hot[unit].data) free(hot[unit].data);
+
+    hot[unit].fd = -1;
+    hot[unit].map = NULL;
+    hot[unit].nwarm = 0;
+    hot[unit].warm = NULL;
+    hot[unit].index = NULL;
+    hot[unit].valid = NULL;
+    hot[unit].data = NULL;
+    return;
+}
+
+
+
+//
+// open the profile of a unit, creating it if needed
+//
+// returns the size of the warm set to be loaded with heatblock() and
+// heatfill(), or a negative value on error
+//
+int32_t heatopen (int32_t unit,
+		  char *name,
+		  int32_t nblocks)
+{
+    heat_header hdr;
+    int32_t size = nblocks*sizeof(heat_entry);
+    int32_t order;
+    int32_t block;
+    int32_t fd;
+
+    heatclose(unit);
+
+    if ((fd = open(name, O_BINARY|O_RDWR|O_CREAT, 0666)) < 0) return -1;
+
+    hot[unit].fd = fd;
+    hot[unit].nblocks = nblocks;
+    hot[unit].touched = 0;
+    hot[unit].last = -1;
+    if ((hot[unit].map = calloc(nblocks, sizeof(heat_entry))) == NULL) { heatclose(unit); return -2; }
+
+    // a missing or foreign profile starts out cold
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	|| memcmp(hdr.magic, HEAT_MAGIC, sizeof(hdr.magic))
+	|| hdr.nblocks != nblocks
+	|| hdr.touched < 0 || hdr.touched > nblocks
+	|| pread(fd, hot[unit].map, size, sizeof(hdr)) != size) {
+	memset(hot[unit].map, 0, size);
+	hdr.touched = 0;
+    }
+
+    hot[unit].nwarm = hdr.touched < HEATWARM ? hdr.touched : HEATWARM;
+    if ((hot[unit].warm = malloc(hot[unit].nwarm*sizeof(int32_t)+1)) == NULL
+	|| (hot[unit].index = malloc(nblocks*sizeof(int32_t))) == NULL
+	|| (hot[unit].valid = calloc(hot[unit].nwarm+1, 1)) == NULL
+	|| (hot[unit].data = malloc(hot[unit].nwarm*BLOCKSIZE+1)) == NULL) {
+	heatclose(unit);
+	return -3;
+    }
+
+    // the warm set is the last run's first reads, then this run starts afresh
+    for (order = 0; order < hot[unit].nwarm; order++) hot[unit].warm[order] = -1;
+    for (block = 0; block < nblocks; block++) {
+	hot[unit].index[block] = -1;
+	order = hot[unit].map[block].order;
+	if (order >= 0 && order < hot[unit].nwarm && hot[unit].warm[order] == -1) {
+	    hot[unit].warm[order] = block;
+	    hot[unit].index[block] = order;
+	}
+	hot[unit].map[block].order = -1;
+    }
+
+    return hot[unit].nwarm;
+}
+
+
+
+//
+// block at a warm set position, -1 if none, -2 past the end
+//
+int32_t heatblock (int32_t unit,
+		   int32_t n)
+{
+    if (n < 0 || n >= hot[unit].nwarm) return -2;
+    return hot[unit].warm[n];
+}
+
+
+
+//
+// store the data of a warm set block
+//
+void heatfill (int32_t unit,
+	       int32_t n,
+	       uint8_t *buffer)
+{
+    if (n < 0 || n >= hot[unit].nwarm) return;
+
+    memcpy(hot[unit].data+n*BLOCKSIZE, buffer, BLOCKSIZE);
+    hot[unit].valid[n] = 1;
+    return;
+}
+
+
+
+//
+// record a host read of a block
+//
+void heattouch (int32_t unit,
+		int32_t block)
+{
+    if (!hot[unit].map || block == hot[unit].last || block < 0 || block >= hot[unit].nblocks) return;
+
+    hot[unit].last = block;
+    hot[unit].map[block].count++;
+    if (hot[unit].map[block].order < 0) hot[unit].map[block].order = hot[unit].touched++;
+
+    return;
+}
+
+
+
+//
+// copy a block from the warm set, returns -1 if it is not there
+//
+int32_t heatget (int32_t unit,
+		 int32_t block,
+		 uint8_t *buffer)
+{
+    int32_t n;
+
+    if (!hot[unit].index || block < 0 || block >= hot[unit].nblocks) return -1;
+    if ((n = hot[unit].index[block]) < 0 || !hot[unit].valid[n]) return -1;
+
+    memcpy(buffer, hot[unit].data+n*BLOCKSIZE, BLOCKSIZE);
+    return 0;
+}
+
+
+
+//
+// forget the warm copy of a block that has been written
+//
+void heatdrop (int32_t unit,
+	       int32_t block)
+{
+    int32_t n;
+
+    if (!hot[unit].index || block < 0 || block >= hot[unit].nblocks) return;
+    if ((n = hot[unit].index[block]) >= 0) hot[unit].valid[n] = 0;
+
+    return;
+}
+
+
+
+// the end
@@ -99,6 +99,9 @@ static char version[] = "tu58 tape emulator v2.0b";
 static char port[32] = "1"; // default port number (COM1, /dev/ttyS0)
 static long speed = 9600; // default line speed
 static long stop = 1; // default stop bits, 1 or 2
+static char *store = NULL; // block store directory for new images
+static char *control = NULL; // control socket path
+static long catalog = 0; // set nonzero once an image catalog is indexed
 
 uint8_t verbose = 0; // set nonzero to output more info
 uint8_t timing = 0; // set nonzero to add timing delays
@@ -107,6 +110,23 @@ uint8_t nosync = 0; // set nonzero to skip sending INIT at restart
 uint8_t debug = 0; // set nonzero for debug output
 uint8_t vax = 0; // set to remove delays for aggressive VAX console timeouts
 uint8_t background = 0; // set to run in background mode (no console I/O except errors)
+uint8_t dirtymap = 0; // set nonzero to track changed blocks for incremental export
+uint8_t sparseimg = 0; // set nonzero to create new images as sparse containers
+uint8_t compress = 0; // set nonzero to compress blocks of new sparse containers
+uint8_t crcindex = 0; // set nonzero to keep a CRC index of every block
+uint8_t hashtree = 0; // set nonzero to keep a hash tree of every image
+uint8_t prefetch = 0; // set nonzero to prefetch blocks of sequential reads
+uint8_t profile = 0; // set nonzero to profile reads and preload the warm set
+int32_t tapesize = TAPESIZE; // number of blocks in new tapes
+uint8_t sharecache = 0; // set nonzero to share block caches with other emulators
+uint8_t writeback = 0; // set nonzero to copy files written to directory drives back
+uint8_t pace = 0; // percent of line rate to meter output at, 0 if not metered
+int32_t txgap = 0; // microseconds to leave between paced packets
+uint8_t latency = 0; // ms USB adapter latency timer for a low latency line, 0 to leave it alone
+uint8_t rtprio = 0; // SCHED_FIFO priority of the drive thread, 0 for normal scheduling
+int32_t runcpu = -1; // cpu the drive thread is pinned to, -1 for any
+int32_t helpcpu = -1; // cpu the other threads are pinned to, -1 for any
+int32_t mrspwindow = 1; // MRSP bytes sent ahead of the host's CONTs
 
 
 
@@ -155,6 +175,7 @@ void fatal (char *fmt, ...)
     vfprintf(stderr, fmt, args);
     fprintf(stderr, "\n");
     va_end(args);
+    filewait();
     exit(EXIT_FAILURE);
 }
 
@@ -169,6 +190,9 @@ int main (int argc,
     long i;
     long n = 0;
     long errors = 0;
+    long tool = 0;
+    long scrub = 0;
+    long arg; // a number option, range checked before it is kept
 
     // switch options
     int opt_index = 0;
@@ -192,6 +216,31 @@ int main (int argc,
 	{ "create",	required_argument, NULL, 'c' },
 	{ "initrt11",	required_argument, NULL, 'i' },
 	{ "initxxdp",	required_argument, NULL, 'z' },
+	{ "dirty",	no_argument,       NULL, -3  },
+	{ "export",	required_argument, NULL, -4  },
+	{ "apply",	required_argument, NULL, -5  },
+	{ "sparse",	no_argument,       NULL, -6  },
+	{ "compress",	no_argument,       NULL, -7  },
+	{ "store",	required_argument, NULL, -8  },
+	{ "gc",		required_argument, NULL, -9  },
+	{ "crc",	no_argument,       NULL, -10 },
+	{ "scrub",	no_argument,       NULL, -11 },
+	{ "tree",	no_argument,       NULL, -12 },
+	{ "diff",	required_argument, NULL, -13 },
+	{ "patch",	required_argument, NULL, -14 },
+	{ "ahead",	no_argument,       NULL, -15 },
+	{ "heat",	no_argument,       NULL, -16 },
+	{ "blocks",	required_argument, NULL, -17 },
+	{ "shared",	no_argument,       NULL, -18 },
+	{ "catalog",	required_argument, NULL, -19 },
+	{ "control",	required_argument, NULL, -20 },
+	{ "writeback",	no_argument,       NULL, -21 },
+	{ "pace",	required_argument, NULL, -22 },
+	{ "gap",	required_argument, NULL, -23 },
+	{ "latency",	required_argument, NULL, -24 },
+	{ "rt",		required_argument, NULL, -25 },
+	{ "cpu",	required_argument, NULL, -26 },
+	{ "window",	required_argument, NULL, -27 },
 	{  NULL,        no_argument,       NULL,  0  }
     };
 
@@ -202,14 +251,39 @@ int main (int argc,
     while ((i = getopt_long(argc, argv, opt_short, opt_long, &opt_index)) != -1) {
 	switch (i) {
 	case -2 :  timing = atoi(optarg); if (timing > 2) errors++; break;
+	case -3 :  dirtymap = 1;  break;
+	case -4 :  if (fileexport(n-1, optarg)) fatal("unable to export delta '%s'", optarg);  tool++;  break;
+	case -5 :  if (fileapply(n-1, optarg)) fatal("unable to apply delta '%s'", optarg);  tool++;  break;
+	case -6 :  sparseimg = 1;  break;
+	case -7 :  sparseimg = compress = 1;  break;
+	case -8 :  store = optarg;  break;
+	case -9 :  if (storegc(optarg)) fatal("unable to collect store '%s'", optarg);  tool++;  break;
+	case -10:  crcindex = 1;  break;
+	case -11:  crcindex = 1;  scrub = 1;  break;
+	case -12:  hashtree = 1;  break;
+	case -13:  if (filediff(n-1, optarg)) fatal("unable to compare with '%s'", optarg);  tool++;  break;
+	case -14:  if (filepatch(n-1, optarg)) fatal("unable to write patch '%s'", optarg);  tool++;  break;
+	case -15:  prefetch = 1;  break;
+	case -16:  profile = 1;  break;
+	case -17:  tapesize = atoi(optarg); if (tapesize < TAPEMIN || tapesize > TAPEMAX) errors++; break;
+	case -18:  sharecache = 1;  break;
+	case -19:  if (ctlcatalog(optarg)) fatal("unable to index catalog '%s'", optarg);  catalog++;  break;
+	case -20:  control = optarg;  break;
+	case -21:  writeback = 1;  break;
+	case -22:  arg = atol(optarg); if (arg < 1 || arg > 100) errors++; else pace = arg;  break;
+	case -23:  txgap = atoi(optarg); if (txgap < 0) errors++; if (!pace) pace = 100;  break;
+	case -24:  arg = atol(optarg); if (arg < 1 || arg > 255) errors++; else latency = arg;  break;
+	case -25:  arg = atol(optarg); if (arg < 1 || arg > 99) errors++; else rtprio = arg;  break;
+	case -26:  if (sscanf(optarg, "%d,%d", &runcpu, &helpcpu) < 1 || runcpu < 0) errors++; break;
+	case -27:  mrspwindow = atoi(optarg); if (mrspwindow < 1 || mrspwindow > 255) errors++; break;
 	case 'p':  strcpy(port, optarg);  break;
 	case 's':  speed = atoi(optarg);  break;
 	case 'S':  stop = atoi(optarg);  break;
-	case 'r':  fileopen(optarg, FILEREAD);  n++;  break;
-	case 'w':  fileopen(optarg, FILEWRITE);  n++;  break;
-	case 'c':  fileopen(optarg, FILECREATE);  n++;  break;
-	case 'i':  fileopen(optarg, FILERT11INIT);  n++;  break;
-	case 'z':  fileopen(optarg, FILEXXDPINIT);  n++;  break;
+	case 'r':  fileopen(optarg, FILEREAD, store);  n++;  break;
+	case 'w':  fileopen(optarg, FILEWRITE, store);  n++;  break;
+	case 'c':  fileopen(optarg, FILECREATE, store);  n++;  break;
+	case 'i':  fileopen(optarg, FILERT11INIT, store);  n++;  break;
+	case 'z':  fileopen(optarg, FILEXXDPINIT, store);  n++;  break;
 	case 'm':  mrspen = 1;  break;
 	case 'n':  nosync = 1;  break;
 	case 'T':  timing = 2;  break;
@@ -226,8 +300,23 @@ int main (int argc,
     // some debug info
     if (debug) { info(version); info(copyright); }
 
-    // must have opened at least one unit
-    if (n == 0) {
+    // lock in memory and pin threads before any are made
+    rtinit();
+
+    // quit signals are waited on by the console loop, set up before any thread
+    if (!tool) consignals();
+
+    // create new images in the background, others open on first use
+    filestart();
+
+    // delta export/apply is a tool mode, all done once the options are processed
+    if (tool && !errors) {
+	fileclose();
+	return EXIT_SUCCESS;
+    }
+
+    // must have opened at least one unit, unless images can be inserted later
+    if (n == 0 && !catalog && !control) {
 	error("no units were specified");
 	errors++;
     }
@@ -241,6 +330,7 @@ int main (int argc,
 	      "           -v | --verbose            enable verbose output to terminal\n" \
 	      "           -d | --debug              enable debug output to terminal\n" \
 	      "           -m | --mrsp               enable standard MRSP mode (byte-level handshake)\n" \
+	      "                --window N           send up to N (1..255) MRSP bytes ahead of the host's CONTs; default 1\n" \
 	      "           -n | --nosync             disable sending INIT at initial startup\n" \
 	      "           -x | --vax                remove delays for aggressive timeouts of VAX console\n" \
 	      "           -b | --background         run in background mode, no console I/O except errors\n" \
@@ -249,24 +339,60 @@ int main (int argc,
 	      "           -s | --speed BAUD         set line speed to BAUD; default 9600\n" \
 	      "           -S | --stop BITS          set stop bits 1..2; default 1\n" \
 	      "           -p | --port PORT          set port to PORT [1..N or /dev/comN; default 1]\n" \
+	      "                --pace PERCENT       meter output at PERCENT (1..100) of the line rate\n" \
+	      "                --gap USEC           leave USEC microseconds between packets, implies --pace 100\n" \
+	      "                --latency MS         set low latency mode and USB adapter latency timer to MS (1..255)\n" \
+	      "                --rt PRIO            run the drive with SCHED_FIFO priority PRIO (1..99), locked in memory\n" \
+	      "                --cpu RUN[,OTHER]    pin the drive to cpu RUN, and the other threads to cpu OTHER\n" \
 	      "           -r | --read|rd FILENAME   readonly drive\n" \
 	      "           -w | --write FILENAME     read/write drive\n" \
 	      "           -c | --create FILENAME    create new r/w drive, zero tape\n" \
 	      "           -i | --initrt11 FILENAME  create new r/w drive, initialize RT11 directory\n" \
-	      "           -z | --initxxdp FILENAME  create new r/w drive, initialize XXDP directory\n",
-	      version, argv[0], NTU58-1);
+	      "           -z | --initxxdp FILENAME  create new r/w drive, initialize XXDP directory\n" \
+	      "                --blocks N           make following new drives N blocks long (%d..%d, default %d)\n" \
+	      "                --dirty              track changed blocks of following r/w drives\n" \
+	      "                --export DELTAFILE   write blocks of previous drive changed since last export\n" \
+	      "                --apply DELTAFILE    apply a delta file to previous drive\n" \
+	      "                --sparse             create following new drives as sparse containers\n" \
+	      "                --compress           as --sparse, also compress stored blocks\n" \
+	      "                --store DIR          create following new drives as indexes into block store DIR\n" \
+	      "                --gc DIR             remove unreferenced blocks from block store DIR\n" \
+	      "                --crc                keep a CRC index of following drives in FILENAME.crc\n" \
+	      "                --scrub              as --crc, also check idle drives in the background\n" \
+	      "                --tree               keep a hash tree of following drives in FILENAME.mtree\n" \
+	      "                --diff TREEFILE      list blocks where previous drive differs from TREEFILE\n" \
+	      "                --patch DELTAFILE    write blocks found by --diff as a delta file\n" \
+	      "                --ahead              prefetch blocks of sequential reads on following drives\n" \
+	      "                --heat               profile reads of following drives in FILENAME.heat, preload them\n" \
+	      "                --shared             share a block cache of following drives with other emulators\n" \
+	      "                --writeback          copy files written to following directory drives back to them\n" \
+	      "                --catalog DIR        index the images in DIR for insert by name\n" \
+	      "                --control PATH       accept control commands on Unix socket PATH\n",
+	      version, argv[0], NTU58-1, TAPEMIN, TAPEMAX, TAPESIZE);
 
     // give some info
     info("serial port %s at %d baud %d stop", port, speed, stop);
     if (mrspen) info("MRSP mode enabled (NOT fully tested - use with caution)");
 
+    // check images in the background
+    if (scrub) filescrub();
+
+    // a real-time drive must not wait for the disk
+    if (rtprio) fileprefault();
+
     // setup serial and console ports
     devinit(port, speed, stop);
     coninit();
+
+    // listen for control commands
+    if (control && ctlstart(control)) fatal("unable to open control socket '%s'", control);
     
     // play TU58
     tu58drive();
 
+    // stop listening for control commands
+    ctlstop();
+
     // restore serial and console ports
     conrestore();
     devrestore();
@@ -0,0 +1,347 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Block hash trees
+//
+// A tree holds the SHA-256 of every block of an image as its leaves, and
+// each node above holds the hash of its two children, so two images with
+// trees can be compared by walking down only the branches that differ.
+// Nodes are kept in heap order (root at 1, children of n at 2n and 2n+1)
+// in memory and in the FILENAME.mtree file; leaves past the end of the
+// image are all zero.
+//
+
+
+
+#include "common.h"
+
+
+
+// tree file header, followed by the nodes 1 .. 2*leaves-1
+
+#define MERKLE_MAGIC	"TU58MRK1"
+
+#define HASHSIZE	32	// bytes per node
+
+typedef struct {
+    char	magic[8];	// MERKLE_MAGIC
+    int32_t	nblocks;	// blocks in the image
+    int32_t	leaves;		// leaf count, a power of two >= nblocks
+} merkle_header;
+
+typedef uint8_t node[HASHSIZE];
+
+// per unit tree state
+
+static struct {
+    int32_t	fd;		// tree file descriptor, -1 if none
+    int32_t	nblocks;	// blocks in the image
+    int32_t	leaves;		// leaf count
+    node	*tree;		// nodes, index 0 unused
+} mtr [NTU58];
+
+
+
+//
+// file offset of a node
+//
+static inline off_t nodeoffset (int32_t n)
+{
+    return sizeof(merkle_header) + (off_t)(n-1)*HASHSIZE;
+}
+
+
+
+//
+// smallest power of two leaf count covering nblocks
+//
+static int32_t leafcount (int32_t nblocks)
+{
+    int32_t leaves = 1;
+
+    while (leaves < nblocks) leaves <<= 1;
+
+    return leaves;
+}
+
+
+
+//
+// hash a pair of child nodes into their parent
+//
+static void nodehash (node *tree,
+		      int32_t n)
+{
+    sha256(tree[2*n], 2*HASHSIZE, tree[n]);
+    return;
+}
+
+
+
+//
+// read a whole tree file into memory, return the leaf count
+//
+static int32_t treeload (int32_t fd,
+			 int32_t nblocks,
+			 node **tree)
+{
+    merkle_header hdr;
+    int32_t size;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	|| memcmp(hdr.magic, MERKLE_MAGIC, sizeof(hdr.magic))
+	|| (nblocks >= 0 && hdr.nblocks != nblocks)
+	|| hdr.leaves != leafcount(hdr.nblocks))
+	return -1;
+
+    size = (2*hdr.leaves-1)*HASHSIZE;
+    if ((*tree = malloc(size+HASHSIZE)) == NULL) return -2;
+
+    if (pread(fd, (*tree)[1], size, nodeoffset(1)) != size) {
+	free(*tree);
+	return -3;
+    }
+
+    return hdr.leaves;
+}
+
+
+
+//
+// init tree state for all units
+//
+void merkleinit (void)
+{
+    int32_t unit;
+
+    for (unit = 0; unit < NTU58; unit++) {
+	mtr[unit].fd = -1;
+	mtr[unit].tree = NULL;
+    }
+    return;
+}
+
+
+
+//
+// release tree state for a unit
+//
+void merkleclose (int32_t unit)
+{
+    if (mtr[unit].fd != -1) close(mtr[unit].fd);
+    if (mtr[unit].tree) free(mtr[unit].tree);
+    mtr[unit].fd = -1;
+    mtr[unit].tree = NULL;
+    return;
+}
+
+
+
+//
+// open the tree file of a unit
+//
+// mode 0 opens an existing tree, mode 1 also creates a missing one and
+// mode 2 always starts over; returns -1 if there is no usable tree, and
+// if one was created leaves it empty to be filled in by merkleleaf() and
+// merklesave()
+//
+int32_t merkleopen (int32_t unit,
+		    char *name,
+		    int32_t nblocks,
+		    int32_t mode)
+{
+    int32_t leaves;
+    int32_t fd;
+
+    merkleclose(unit);
+
+    if ((fd = open(name, O_BINARY|O_RDWR)) >= 0 && mode < 2
+	&& (leaves = treeload(fd, nblocks, &mtr[unit].tree)) > 0) {
+	mtr[unit].fd = fd;
+	mtr[unit].nblocks = nblocks;
+	mtr[unit].leaves = leaves;
+	return 0;
+    }
+
+    if (!mode) {
+	if (fd >= 0) close(fd);
+	return -1;
+    }
+
+    // a missing or stale tree is started over
+    if (fd < 0 && (fd = open(name, O_BINARY|O_RDWR|O_CREAT, 0666)) < 0) return -2;
+
+    leaves = leafcount(nblocks);
+    if ((mtr[unit].tree = calloc(2*leaves, HASHSIZE)) == NULL) { close(fd); return -3; }
+
+    mtr[unit].fd = fd;
+    mtr[unit].nblocks = nblocks;
+    mtr[unit].leaves = leaves;
+    return -1;
+}
+
+
+
+//
+// set the leaf for a block while building a tree
+//
+void merkleleaf (int32_t unit,
+		 int32_t block,
+		 uint8_t *buffer)
+{
+    if (mtr[unit].tree && block < mtr[unit].nblocks)
+	sha256(buffer, BLOCKSIZE, mtr[unit].tree[mtr[unit].leaves+block]);
+    return;
+}
+
+
+
+//
+// compute all inner nodes from the leaves and write the whole tree
+//
+int32_t merklesave (int32_t unit)
+{
+    merkle_header hdr;
+    int32_t size;
+    int32_t n;
+
+    if (!mtr[unit].tree) return -1;
+
+    for (n = mtr[unit].leaves-1; n >= 1; n--) nodehash(mtr[unit].tree, n);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MERKLE_MAGIC, sizeof(hdr.magic));
+    hdr.nblocks = mtr[unit].nblocks;
+    hdr.leaves = mtr[unit].leaves;
+
+    size = (2*mtr[unit].leaves-1)*HASHSIZE;
+    if (ftruncate(mtr[unit].fd, 0)
+	|| pwrite(mtr[unit].fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	|| pwrite(mtr[unit].fd, mtr[unit].tree[1], size, nodeoffset(1)) != size)
+	return -2;
+
+    return 0;
+}
+
+
+
+//
+// update the tree for a block just written
+//
+// only the leaf and its ancestors change, so that is all that is rewritten
+//
+int32_t merkleupdate (int32_t unit,
+		      int32_t block,
+		      uint8_t *buffer)
+{
+    node leaf;
+    int32_t n;
+
+    if (!mtr[unit].tree || block >= mtr[unit].nblocks) return 0;
+
+    n = mtr[unit].leaves + block;
+    sha256(buffer, BLOCKSIZE, leaf);
+    if (!memcmp(leaf, mtr[unit].tree[n], HASHSIZE)) return 0;
+    memcpy(mtr[unit].tree[n], leaf, HASHSIZE);
+
+    for (; n >= 1; n /= 2) {
+	if (n < mtr[unit].leaves) nodehash(mtr[unit].tree, n);
+	if (pwrite(mtr[unit].fd, mtr[unit].tree[n], HASHSIZE, nodeoffset(n)) != HASHSIZE) return -1;
+    }
+
+    return 0;
+}
+
+
+
+//
+// mark in map the blocks where a unit differs from the tree in a file
+//
+// returns the number of blocks that differ
+//
+int32_t merklediff (int32_t unit,
+		    char *name,
+		    uint8_t *map)
+{
+    node *other;
+    int32_t stack[64];
+    int32_t sp = 0;
+    int32_t count = 0;
+    int32_t leaves;
+    int32_t block;
+    int32_t fd;
+    int32_t n;
+
+    if (!mtr[unit].tree) return -1;
+
+    if ((fd = open(name, O_BINARY|O_RDONLY)) < 0) {
+	error("merklediff cannot open tree '%s'", name);
+	return -2;
+    }
+    leaves = treeload(fd, mtr[unit].nblocks, &other);
+    close(fd);
+    if (leaves <= 0) {
+	error("merklediff '%s' is not a tree for a %d block image", name, mtr[unit].nblocks);
+	return -3;
+    }
+
+    // walk down only where the subtrees differ
+    stack[sp++] = 1;
+    while (sp > 0) {
+	n = stack[--sp];
+	if (!memcmp(mtr[unit].tree[n], other[n], HASHSIZE)) continue;
+	if (n >= leaves) {
+	    block = n - leaves;
+	    if (block < mtr[unit].nblocks) { map[block/8] |= 1 << (block%8); count++; }
+	} else {
+	    stack[sp++] = 2*n+1;
+	    stack[sp++] = 2*n;
+	}
+    }
+
+    free(other);
+    return count;
+}
+
+
+
+// the end
@@ -0,0 +1,329 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 MRSP host simulator
+//
+// mrsphost checks the emulator's MRSP output against a strict host. It
+// runs tu58em on a pseudo terminal with a scratch image, syncs with
+// <INIT><INIT>, and reads the image back with MRSP set in the commands,
+// answering each byte with a CONT after a delay. It fails if a byte
+// arrives while the window given to the emulator is already unanswered,
+// if the data or end packets are wrong, or if the emulator goes quiet.
+// One CONT is held back well past the emulator's stall report, so a
+// window that is given up on instead of waited for shows up too.
+//
+
+
+
+#define _GNU_SOURCE // for posix_openpt, ptsname, cfmakeraw
+
+#include "common.h"
+#include "tu58.h"
+#include <getopt.h>
+#include <termios.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+
+#define HOSTBLOCKS	8	// blocks in the scratch image, all read back
+#define HOSTSTALL	300	// ms one CONT is held back
+#define HOSTQUIET	2000	// ms of silence from the emulator that fail the test
+#define HOSTRESYNC	100	// ms between tries at <INIT><INIT>
+#define HOSTMAX		2048	// most bytes answered at a time
+
+static char *prog = "./tu58em"; // emulator to test
+static int32_t window = 1; // MRSP window to give it
+static int32_t turnms = 1; // ms the host takes to answer each byte
+static int32_t master = -1; // pseudo terminal, host side
+static pid_t child = -1; // emulator process
+
+
+
+//
+// print an error and give up
+//
+static void fail (char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    fprintf(stderr, "FAIL: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+
+    if (child > 0) kill(child, SIGTERM);
+    exit(EXIT_FAILURE);
+}
+
+
+
+//
+// milliseconds on a monotonic clock
+//
+static int64_t now (void)
+{
+    timespec_t t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec*1000 + t.tv_nsec/1000000;
+}
+
+
+
+//
+// checksum of a packet, flag byte onwards, as the drive computes it
+//
+static uint16_t checksum (uint8_t *pkt,
+			  int32_t count)
+{
+    uint32_t sum = 0;
+    int32_t i;
+
+    for (i = 0; i < count; i++) {
+	sum += (i & 1) ? pkt[i] << 8 : pkt[i];
+	sum = (sum + (sum >> 16)) & 0xFFFF;
+    }
+
+    return sum;
+}
+
+
+
+//
+// start the emulator on a new pseudo terminal
+//
+static void start (char *image)
+{
+    struct termios t;
+    char arg[16];
+    char *slave;
+    int fd;
+
+    if ((master = posix_openpt(O_RDWR|O_NOCTTY)) < 0 || grantpt(master) || unlockpt(master)
+	|| (slave = ptsname(master)) == NULL)
+	fail("cannot open a pseudo terminal");
+
+    // the host side passes bytes through untouched
+    tcgetattr(master, &t);
+    cfmakeraw(&t);
+    tcsetattr(master, TCSANOW, &t);
+
+    snprintf(arg, sizeof(arg), "%d", window);
+
+    if ((child = fork()) < 0) fail("cannot fork");
+    if (child == 0) {
+	if ((fd = open("/dev/null", O_RDWR)) >= 0) dup2(fd, 0);
+	execl(prog, prog, "-b", "-m", "--window", arg, "-p", slave, "-r", image, (char *)NULL);
+	fprintf(stderr, "cannot run '%s'\n", prog);
+	_exit(EXIT_FAILURE);
+    }
+
+    return;
+}
+
+
+
+//
+// sync with the emulator, as a host does at startup
+//
+// the first <INIT><INIT> can be flushed as the emulator sets up its line,
+// so it is sent again until the CONT comes back
+//
+static void hostsync (void)
+{
+    uint8_t init[2] = { TUF_INIT, TUF_INIT };
+    struct pollfd fds = { .fd = master, .events = POLLIN };
+    int64_t start = now();
+    int64_t sent = 0;
+    uint8_t c = 0;
+
+    while (c != TUF_CONT) {
+	if (now() - start >= HOSTQUIET) fail("no CONT for <INIT><INIT> in %dms", HOSTQUIET);
+	if (now() - sent >= HOSTRESYNC) {
+	    if (write(master, init, sizeof(init)) != sizeof(init)) fail("cannot write");
+	    sent = now();
+	}
+	if (poll(&fds, 1, HOSTRESYNC) > 0 && read(master, &c, 1) != 1) fail("cannot read");
+    }
+
+    // let its INITs still on the way go by
+    usleep(100*1000);
+    tcflush(master, TCIFLUSH);
+
+    return;
+}
+
+
+
+//
+// read count bytes from block with MRSP, answering every byte strictly;
+// returns the ms it took
+//
+static int64_t readmrsp (uint8_t *data,
+			 int32_t block,
+			 int32_t count,
+			 int32_t stall)
+{
+    uint8_t cmd[TU_CTRL_LEN+4] = { TUF_CTRL, TU_CTRL_LEN, TUO_READ, 0, 0, TUS_MRSP, 0, 0,
+				   count & 0xFF, count >> 8, block & 0xFF, block >> 8 };
+    static uint8_t pkt[HOSTMAX];
+    static int64_t due[HOSTMAX];
+    uint8_t cont = TUF_CONT;
+    struct pollfd fds = { .fd = master, .events = POLLIN };
+    int64_t start = now();
+    int64_t quiet = start;
+    int32_t got = 0;	// bytes received
+    int32_t answered = 0; // bytes answered
+    int32_t need = -1;	// bytes of the whole reply, once known
+    int32_t pos;
+    int32_t len;
+    int32_t ms;
+    uint16_t sum;
+
+    sum = checksum(cmd, TU_CTRL_LEN+2);
+    cmd[TU_CTRL_LEN+2] = sum & 0xFF;
+    cmd[TU_CTRL_LEN+3] = sum >> 8;
+    if (write(master, cmd, sizeof(cmd)) != sizeof(cmd)) fail("cannot write");
+
+    for (;;) {
+
+	// answer what is due, up to the last byte of the reply
+	while (answered < got && due[answered] <= now()) {
+	    if (write(master, &cont, 1) != 1) fail("cannot write");
+	    answered++;
+	}
+	if (answered == need) break;
+
+	// wait for a byte or the next answer
+	ms = answered < got ? due[answered] - now() : HOSTQUIET;
+	if (ms < 0) ms = 0;
+	if (poll(&fds, 1, ms) <= 0) {
+	    if (answered == got && now() - quiet >= HOSTQUIET) fail("emulator quiet for %dms", HOSTQUIET);
+	    continue;
+	}
+
+	// a byte the emulator should still be holding back
+	if (got - answered >= window)
+	    fail("byte %d arrived with %d unanswered, window %d", got, got-answered, window);
+	if (got >= HOSTMAX) fail("reply too long");
+	if (read(master, &pkt[got], 1) != 1) fail("cannot read");
+	due[got] = now() + (got == stall ? HOSTSTALL : turnms);
+	quiet = now();
+	got++;
+
+	// the length of the reply is known once the end packet starts
+	if (need < 0) {
+	    for (pos = 0; pos+1 < got && pkt[pos] == TUF_DATA; pos += pkt[pos+1]+4);
+	    if (pos < got && pkt[pos] == TUF_CTRL) need = pos + TU_CTRL_LEN+4;
+	}
+    }
+
+    // check the data packets and the end packet
+    for (pos = len = 0; pkt[pos] == TUF_DATA; pos += pkt[pos+1]+4) {
+	sum = checksum(&pkt[pos], pkt[pos+1]+2);
+	if ((sum & 0xFF) != pkt[pos+pkt[pos+1]+2] || (sum >> 8) != pkt[pos+pkt[pos+1]+3])
+	    fail("data packet checksum at byte %d", pos);
+	memcpy(data+len, &pkt[pos+2], pkt[pos+1]);
+	len += pkt[pos+1];
+    }
+    if (pkt[pos+2] != TUO_END || pkt[pos+3] != TUE_SUCC) fail("end packet opcode %d code %d", pkt[pos+2], (int8_t)pkt[pos+3]);
+    if (len != count) fail("read %d bytes of %d", len, count);
+
+    return now() - start;
+}
+
+
+
+//
+// main program
+//
+int main (int argc,
+	  char *argv[])
+{
+    static uint8_t image[HOSTBLOCKS*BLOCKSIZE];
+    static uint8_t data[HOSTBLOCKS*BLOCKSIZE];
+    char name[] = "/tmp/mrsphostXXXXXX";
+    int64_t ms;
+    int32_t block;
+    int32_t i;
+    int fd;
+
+    while ((i = getopt(argc, argv, "w:d:p:")) != -1) {
+	switch (i) {
+	case 'w':  window = atoi(optarg);  break;
+	case 'd':  turnms = atoi(optarg);  break;
+	case 'p':  prog = optarg;  break;
+	default:
+	    fprintf(stderr, "Usage: %s [-w WINDOW] [-d TURNMS] [-p TU58EM]\n", argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+    if (window < 1 || window > 255 || turnms < 0) fail("bad window or turnaround");
+
+    // a scratch image no two blocks of which are alike
+    for (i = 0; i < sizeof(image); i++) image[i] = i*7 + i/BLOCKSIZE;
+    if ((fd = mkstemp(name)) < 0 || write(fd, image, sizeof(image)) != sizeof(image)) fail("cannot make image");
+    close(fd);
+
+    start(name);
+    hostsync();
+
+    // a stalled CONT in the first read, then the rest a block at a time
+    ms = readmrsp(data, 0, 2*BLOCKSIZE, 10);
+    for (block = 2; block < HOSTBLOCKS; block++) ms += readmrsp(data+block*BLOCKSIZE, block, BLOCKSIZE, -1);
+
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    unlink(name);
+
+    if (memcmp(data, image, sizeof(image))) fail("data read back differs from the image");
+
+    printf("PASS: window %d, %d bytes in %lldms with a %dms stall\n",
+	   window, (int)sizeof(image), (long long)ms, HOSTSTALL);
+    return EXIT_SUCCESS;
+}
+
+
+
+// the end
@@ -0,0 +1,634 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Network block devices
+//
+// A unit named nbd://HOST[:PORT][/EXPORT] or nbd+unix:///EXPORT?socket=PATH
+// is an image served by an NBD server. The client does the fixed newstyle
+// handshake, asking for the export by name, then sends READ, WRITE and
+// FLUSH requests with simple replies. Requests are pipelined: a read miss
+// also asks for the blocks after it, and writes are sent without waiting
+// for their replies, which a reader thread collects and matches by handle.
+// Every block read or written is kept in a local cache, so each block
+// crosses the network at most once for reading.
+//
+
+
+
+#include "common.h"
+
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+
+// protocol constants
+
+#define NBD_PORT		"10809"			// default TCP port
+#define NBD_MAGIC		0x4e42444d41474943ULL	// "NBDMAGIC"
+#define NBD_OPTMAGIC		0x49484156454F5054ULL	// "IHAVEOPT"
+#define NBD_REQMAGIC		0x25609513		// request
+#define NBD_REPMAGIC		0x67446698		// simple reply
+
+#define NBD_FLAG_FIXED		0x0001	// handshake: fixed newstyle
+#define NBD_FLAG_NOZEROES	0x0002	// handshake: no padding after export info
+#define NBD_FLAG_READONLY	0x0002	// transmission: export is read only
+#define NBD_FLAG_FLUSH		0x0004	// transmission: server takes FLUSH
+
+#define NBD_OPT_EXPORTNAME	1	// select export, ends the handshake
+
+#define NBD_CMD_READ		0
+#define NBD_CMD_WRITE		1
+#define NBD_CMD_DISC		2
+#define NBD_CMD_FLUSH		3
+
+// an outstanding request
+
+typedef struct {
+    uint8_t	busy;		// slot in use
+    uint8_t	waiter;		// someone waits for the reply
+    uint8_t	ready;		// reply arrived
+    uint16_t	type;		// NBD_CMD_xxx
+    int32_t	block;		// block asked for
+    int32_t	error;		// reply error, nonzero if failed
+} nbd_slot;
+
+// per unit connection state
+
+static struct {
+    int32_t	fd;		// socket, -1 if none
+    int32_t	nblocks;	// blocks in the export
+    uint16_t	flags;		// transmission flags
+    uint8_t	**cache;	// cached blocks, per block
+    uint8_t	dead;		// set when the connection is lost
+    int32_t	error;		// a pipelined write failed
+    int32_t	inflight;	// outstanding requests
+    nbd_slot	slot[NBDSLOTS];	// outstanding requests, by handle
+    pthread_t	reader;		// reply reader thread
+    pthread_mutex_t lock;	// guards all of the above
+    pthread_mutex_t send;	// serializes requests on the socket
+    pthread_cond_t reply;	// signals a reply or a free slot
+} nbd [NTU58];
+
+
+
+//
+// 64 bit big endian conversion
+//
+static uint64_t be64 (uint64_t x)
+{
+    uint32_t one = 1;
+
+    if (*(uint8_t *)&one == 0) return x;
+    return ((uint64_t)htonl(x & 0xFFFFFFFF) << 32) | htonl(x >> 32);
+}
+
+
+
+//
+// read exactly count bytes from a socket
+//
+static int32_t readall (int32_t fd,
+			void *buffer,
+			int32_t count)
+{
+    int32_t done = 0;
+    int32_t n;
+
+    while (done < count) {
+	if ((n = read(fd, (uint8_t *)buffer+done, count-done)) <= 0) return -1;
+	done += n;
+    }
+    return 0;
+}
+
+
+
+//
+// write exactly count bytes to a socket
+//
+static int32_t writeall (int32_t fd,
+			 void *buffer,
+			 int32_t count)
+{
+    int32_t done = 0;
+    int32_t n;
+
+    while (done < count) {
+	if ((n = write(fd, (uint8_t *)buffer+done, count-done)) <= 0) return -1;
+	done += n;
+    }
+    return 0;
+}
+
+
+
+//
+// init connection state for all units
+//
+void nbdinit (void)
+{
+    int32_t unit;
+
+    for (unit = 0; unit < NTU58; unit++) {
+	nbd[unit].fd = -1;
+	nbd[unit].cache = NULL;
+	pthread_mutex_init(&nbd[unit].lock, NULL);
+	pthread_mutex_init(&nbd[unit].send, NULL);
+	pthread_cond_init(&nbd[unit].reply, NULL);
+    }
+    return;
+}
+
+
+
+//
+// check for an NBD unit name
+//
+int32_t nbdname (char *name)
+{
+    return !strncmp(name, "nbd://", 6) || !strncmp(name, "nbd+unix://", 11);
+}
+
+
+
+//
+// connect to the server of an NBD name, returns the socket
+//
+static int32_t nbdconnect (char *name,
+			   char *export)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    struct sockaddr_un sun;
+    char host[CTLLINE];
+    char *port = NBD_PORT;
+    char *path;
+    char *p;
+    int32_t fd = -1;
+    int32_t on = 1;
+
+    if (!strncmp(name, "nbd+unix://", 11)) {
+	// nbd+unix:///EXPORT?socket=PATH
+	if ((path = strstr(name, "?socket=")) == NULL) return -1;
+	p = strchr(name+11, '/');
+	snprintf(export, CTLLINE, "%.*s", p && p < path ? (int)(path-p-1) : 0, p ? p+1 : "");
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path+8) >= sizeof(sun.sun_path)) return -1;
+	strcpy(sun.sun_path, path+8);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun))) { close(fd); return -1; }
+	return fd;
+    }
+
+    // nbd://HOST[:PORT][/EXPORT]
+    snprintf(host, sizeof(host), "%s", name+6);
+    snprintf(export, CTLLINE, "%s", (p = strchr(host, '/')) ? p+1 : "");
+    if (p) *p = '\0';
+    if ((p = strrchr(host, ':')) != NULL) { *p = '\0'; port = p+1; }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res)) return -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) continue;
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(res);
+
+    // requests are small and latency matters more than packing
+    if (fd >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+
+
+//
+// fixed newstyle handshake, returns the export size in bytes
+//
+static int64_t nbdhandshake (int32_t fd,
+			     char *export,
+			     uint16_t *flags)
+{
+    uint8_t zeroes[124];
+    uint64_t magic;
+    uint64_t size;
+    uint32_t cflags;
+    uint32_t opt[2];
+    uint16_t hflags;
+
+    if (readall(fd, &magic, 8) || be64(magic) != NBD_MAGIC
+	|| readall(fd, &magic, 8) || be64(magic) != NBD_OPTMAGIC
+	|| readall(fd, &hflags, 2) || !(ntohs(hflags) & NBD_FLAG_FIXED)) return -1;
+
+    cflags = htonl(NBD_FLAG_FIXED | (ntohs(hflags) & NBD_FLAG_NOZEROES));
+    magic = be64(NBD_OPTMAGIC);
+    opt[0] = htonl(NBD_OPT_EXPORTNAME);
+    opt[1] = htonl(strlen(export));
+    if (writeall(fd, &cflags, 4) || writeall(fd, &magic, 8) || writeall(fd, opt, 8)
+	|| writeall(fd, export, strlen(export))) return -1;
+
+    // a server without the export just hangs up
+    if (readall(fd, &size, 8) || readall(fd, flags, 2)) return -1;
+    if (!(ntohs(hflags) & NBD_FLAG_NOZEROES) && readall(fd, zeroes, sizeof(zeroes))) return -1;
+
+    *flags = ntohs(*flags);
+    return be64(size);
+}
+
+
+
+//
+// send a request on a slot, the caller holds the unit lock
+//
+static int32_t nbdsend (int32_t unit,
+			int32_t s,
+			uint16_t type,
+			int32_t block,
+			uint8_t *data)
+{
+    struct {
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;
+	uint64_t offset;
+	uint32_t length;
+    } __attribute__((packed)) req;
+    int32_t status;
+
+    nbd[unit].slot[s].busy = 1;
+    nbd[unit].slot[s].waiter = 0;
+    nbd[unit].slot[s].ready = 0;
+    nbd[unit].slot[s].type = type;
+    nbd[unit].slot[s].block = block;
+    nbd[unit].slot[s].error = 0;
+    nbd[unit].inflight++;
+
+    req.magic = htonl(NBD_REQMAGIC);
+    req.flags = 0;
+    req.type = htons(type);
+    req.handle = s;
+    req.offset = be64((uint64_t)(block < 0 ? 0 : block)*BLOCKSIZE);
+    req.length = htonl(type == NBD_CMD_READ || type == NBD_CMD_WRITE ? BLOCKSIZE : 0);
+
+    pthread_mutex_lock(&nbd[unit].send);
+    status = writeall(nbd[unit].fd, &req, sizeof(req));
+    if (!status && type == NBD_CMD_WRITE) status = writeall(nbd[unit].fd, data, BLOCKSIZE);
+    pthread_mutex_unlock(&nbd[unit].send);
+
+    if (status) nbd[unit].dead = 1;
+    return status;
+}
+
+
+
+//
+// get a free slot, waiting for one if wait is set; the caller holds the lock
+//
+static int32_t nbdslot (int32_t unit,
+			int32_t wait)
+{
+    int32_t s;
+
+    for (;;) {
+	if (nbd[unit].dead) return -1;
+	for (s = 0; s < NBDSLOTS; s++) if (!nbd[unit].slot[s].busy) return s;
+	if (!wait) return -1;
+	pthread_cond_wait(&nbd[unit].reply, &nbd[unit].lock);
+    }
+}
+
+
+
+//
+// collect replies, filling the cache with read data
+//
+static void *nbdreader (void *arg)
+{
+    int32_t unit = (intptr_t)arg;
+    uint8_t buffer[BLOCKSIZE];
+    struct {
+	uint32_t magic;
+	uint32_t error;
+	uint64_t handle;
+    } __attribute__((packed)) rep;
+    nbd_slot *slot;
+    int32_t s;
+
+    rthelper();
+
+    for (;;) {
+	if (readall(nbd[unit].fd, &rep, sizeof(rep)) || ntohl(rep.magic) != NBD_REPMAGIC
+	    || rep.handle >= NBDSLOTS || !nbd[unit].slot[rep.handle].busy) break;
+	slot = &nbd[unit].slot[rep.handle];
+
+	// read data follows a reply without error
+	if (slot->type == NBD_CMD_READ && !rep.error && readall(nbd[unit].fd, buffer, BLOCKSIZE)) break;
+
+	pthread_mutex_lock(&nbd[unit].lock);
+	slot->error = ntohl(rep.error);
+	if (slot->type == NBD_CMD_READ && !slot->error && !nbd[unit].cache[slot->block]
+	    && (nbd[unit].cache[slot->block] = malloc(BLOCKSIZE)) != NULL)
+	    memcpy(nbd[unit].cache[slot->block], buffer, BLOCKSIZE);
+	if (slot->type == NBD_CMD_WRITE && slot->error) {
+	    error("nbd unit %d write error %d block %d", unit, slot->error, slot->block);
+	    nbd[unit].error = -1;
+	}
+	// a waiter frees its own slot, else it is free now
+	slot->ready = 1;
+	if (!slot->waiter) { slot->busy = 0; nbd[unit].inflight--; }
+	pthread_cond_broadcast(&nbd[unit].reply);
+	pthread_mutex_unlock(&nbd[unit].lock);
+    }
+
+    // the connection is gone, fail everything outstanding
+    pthread_mutex_lock(&nbd[unit].lock);
+    nbd[unit].dead = 1;
+    for (s = 0; s < NBDSLOTS; s++) {
+	if (!nbd[unit].slot[s].busy || nbd[unit].slot[s].ready) continue;
+	nbd[unit].slot[s].error = -1;
+	nbd[unit].slot[s].ready = 1;
+	if (!nbd[unit].slot[s].waiter) { nbd[unit].slot[s].busy = 0; nbd[unit].inflight--; }
+    }
+    pthread_cond_broadcast(&nbd[unit].reply);
+    pthread_mutex_unlock(&nbd[unit].lock);
+
+    return NULL;
+}
+
+
+
+//
+// wait for the reply on a slot and free it, the caller holds the lock
+//
+static int32_t nbdwait (int32_t unit,
+			int32_t s)
+{
+    int32_t status;
+
+    nbd[unit].slot[s].waiter = 1;
+    while (!nbd[unit].slot[s].ready) pthread_cond_wait(&nbd[unit].reply, &nbd[unit].lock);
+
+    status = nbd[unit].slot[s].error ? -1 : 0;
+    nbd[unit].slot[s].busy = 0;
+    nbd[unit].inflight--;
+    pthread_cond_broadcast(&nbd[unit].reply);
+
+    return status;
+}
+
+
+
+//
+// connect a unit to the export of an NBD name
+//
+// returns the socket, which nbdclose() closes, and the export size in blocks
+//
+int32_t nbdopen (int32_t unit,
+		 char *name,
+		 int32_t *nblocks)
+{
+    char export[CTLLINE];
+    int64_t size;
+    int32_t fd;
+
+    nbdclose(unit);
+
+    if ((fd = nbdconnect(name, export)) < 0) {
+	error("nbd cannot connect to '%s'", name);
+	return -1;
+    }
+    if ((size = nbdhandshake(fd, export, &nbd[unit].flags)) < 0) {
+	error("nbd server of '%s' refused export '%s'", name, export);
+	close(fd);
+	return -1;
+    }
+    if (size % BLOCKSIZE || size/BLOCKSIZE > TAPEMAX || size == 0) {
+	error("nbd export '%s' is %lld bytes, not a tape image", export, (long long)size);
+	close(fd);
+	return -1;
+    }
+
+    nbd[unit].fd = fd;
+    nbd[unit].nblocks = size/BLOCKSIZE;
+    nbd[unit].dead = 0;
+    nbd[unit].error = 0;
+    nbd[unit].inflight = 0;
+    memset(nbd[unit].slot, 0, sizeof(nbd[unit].slot));
+    if ((nbd[unit].cache = calloc(nbd[unit].nblocks, sizeof(uint8_t *))) == NULL
+	|| pthread_create(&nbd[unit].reader, NULL, nbdreader, (void *)(intptr_t)unit)) {
+	if (nbd[unit].cache) free(nbd[unit].cache);
+	nbd[unit].cache = NULL;
+	nbd[unit].fd = -1;
+	close(fd);
+	return -1;
+    }
+
+    *nblocks = nbd[unit].nblocks;
+    return fd;
+}
+
+
+
+//
+// check if the server of a unit takes writes
+//
+int32_t nbdreadonly (int32_t unit)
+{
+    return (nbd[unit].flags & NBD_FLAG_READONLY) ? 1 : 0;
+}
+
+
+
+//
+// read a block, from the cache or the server
+//
+// a miss also asks for the uncached blocks after it, all in flight at once
+//
+int32_t nbdread (int32_t unit,
+		 int32_t block,
+		 uint8_t *buffer)
+{
+    int32_t status = 0;
+    int32_t sent = 0;
+    int32_t b;
+    int32_t s;
+    int32_t t;
+
+    if (block < 0 || block >= nbd[unit].nblocks) return -1;
+
+    pthread_mutex_lock(&nbd[unit].lock);
+
+    for (;;) {
+	if (nbd[unit].cache[block]) {
+	    memcpy(buffer, nbd[unit].cache[block], BLOCKSIZE);
+	    break;
+	}
+
+	// already asked for, by read-ahead or another thread
+	for (s = 0; s < NBDSLOTS; s++)
+	    if (nbd[unit].slot[s].busy && !nbd[unit].slot[s].ready && !nbd[unit].slot[s].waiter
+		&& nbd[unit].slot[s].type == NBD_CMD_READ && nbd[unit].slot[s].block == block) break;
+
+	if (s == NBDSLOTS) {
+	    // answered but not cached, the cache is out of memory
+	    if (sent++ || (s = nbdslot(unit, 1)) < 0 || nbdsend(unit, s, NBD_CMD_READ, block, NULL)) {
+		status = -1;
+		break;
+	    }
+	    // the blocks after it while the wait is on anyway
+	    for (b = block+1; b < block+NBDAHEAD && b < nbd[unit].nblocks; b++) {
+		if (nbd[unit].cache[b]) continue;
+		if ((t = nbdslot(unit, 0)) < 0 || nbdsend(unit, t, NBD_CMD_READ, b, NULL)) break;
+	    }
+	}
+
+	if (nbdwait(unit, s)) {
+	    status = -1;
+	    break;
+	}
+    }
+
+    pthread_mutex_unlock(&nbd[unit].lock);
+    return status;
+}
+
+
+
+//
+// write a block through the cache to the server, not waiting for the reply
+//
+int32_t nbdwrite (int32_t unit,
+		  int32_t block,
+		  uint8_t *buffer)
+{
+    int32_t status = 0;
+    int32_t s;
+
+    if (block < 0 || block >= nbd[unit].nblocks) return -1;
+
+    pthread_mutex_lock(&nbd[unit].lock);
+
+    if (!nbd[unit].cache[block]) nbd[unit].cache[block] = malloc(BLOCKSIZE);
+    if (nbd[unit].cache[block]) memcpy(nbd[unit].cache[block], buffer, BLOCKSIZE);
+
+    if (nbd[unit].error || (s = nbdslot(unit, 1)) < 0 || nbdsend(unit, s, NBD_CMD_WRITE, block, buffer))
+	status = -1;
+
+    pthread_mutex_unlock(&nbd[unit].lock);
+    return status;
+}
+
+
+
+//
+// wait for all writes to be answered, then have the server make them stable
+//
+int32_t nbdflush (int32_t unit)
+{
+    int32_t status = 0;
+    int32_t s;
+
+    if (nbd[unit].fd < 0) return 0;
+
+    pthread_mutex_lock(&nbd[unit].lock);
+
+    while (nbd[unit].inflight > 0 && !nbd[unit].dead) pthread_cond_wait(&nbd[unit].reply, &nbd[unit].lock);
+
+    if (nbd[unit].error || nbd[unit].dead) {
+	status = -1;
+    } else if (nbd[unit].flags & NBD_FLAG_FLUSH) {
+	if ((s = nbdslot(unit, 1)) < 0 || nbdsend(unit, s, NBD_CMD_FLUSH, -1, NULL) || nbdwait(unit, s))
+	    status = -1;
+    }
+
+    // a failed write is reported once
+    nbd[unit].error = 0;
+
+    pthread_mutex_unlock(&nbd[unit].lock);
+    return status;
+}
+
+
+
+//
+// disconnect a unit
+//
+void nbdclose (int32_t unit)
+{
+    int32_t s;
+    int32_t b;
+
+    if (nbd[unit].fd < 0) return;
+
+    nbdflush(unit);
+
+    pthread_mutex_lock(&nbd[unit].lock);
+    if (!nbd[unit].dead && (s = nbdslot(unit, 0)) >= 0) nbdsend(unit, s, NBD_CMD_DISC, -1, NULL);
+    pthread_mutex_unlock(&nbd[unit].lock);
+
+    // the reader stops when the socket does
+    shutdown(nbd[unit].fd, SHUT_RDWR);
+    pthread_join(nbd[unit].reader, NULL);
+    close(nbd[unit].fd);
+    nbd[unit].fd = -1;
+
+    for (b = 0; b < nbd[unit].nblocks; b++) if (nbd[unit].cache[b]) free(nbd[unit].cache[b]);
+    free(nbd[unit].cache);
+    nbd[unit].cache = NULL;
+    return;
+}
+
+
+
+// the end
@@ -0,0 +1,249 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Real-time scheduling
+//
+// Hosts such as the VAX-730 console time out if the emulator is slow to
+// answer. With --rt the thread playing the drive runs under SCHED_FIFO and
+// the process is locked in memory, so neither the scheduler nor a page
+// fault can hold up an answer; --cpu pins that thread to a cpu of its own
+// and every other thread to another. The time from receiving a command
+// to starting the answer is measured for each command, so the worst case
+// can be checked against the host's timeout.
+//
+
+
+
+#define _GNU_SOURCE // for CPU_SET, pthread_setaffinity_np
+
+#include "common.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+
+
+// response times
+
+static timespec_t received;	// when the command being answered arrived
+static uint8_t waiting = 0;	// set while a command has had no answer
+static rt_metric responses;	// us taken to answer the commands
+
+
+
+//
+// pin the calling thread to a cpu, if one was given
+//
+static void rtpin (int32_t cpu)
+{
+#ifdef LINUX
+    cpu_set_t set;
+
+    if (cpu < 0) return;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+	error("cannot pin thread to cpu %d", cpu);
+#endif // LINUX
+
+    return;
+}
+
+
+
+//
+// lock the process in memory and put the calling thread on the helper cpu
+//
+// called before any threads are made, so they all start on the helper cpu
+//
+void rtinit (void)
+{
+    int32_t ncpu = sysconf(_SC_NPROCESSORS_CONF);
+
+    if (rtprio && mlockall(MCL_CURRENT|MCL_FUTURE))
+	error("cannot lock emulator in memory");
+
+    // say once if a cpu does not exist
+    if (runcpu >= ncpu) { error("no cpu %d to run the drive on", runcpu); runcpu = -1; }
+    if (helpcpu >= ncpu) { error("no cpu %d to run other threads on", helpcpu); helpcpu = -1; }
+
+    rtpin(helpcpu);
+
+    return;
+}
+
+
+
+//
+// make the calling thread the real-time drive thread
+//
+void rtrun (void)
+{
+    struct sched_param param;
+
+    if (rtprio) {
+	param.sched_priority = rtprio;
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+	    error("cannot run with SCHED_FIFO priority %d", rtprio);
+	else
+	    info("running with SCHED_FIFO priority %d", rtprio);
+    }
+
+    rtpin(runcpu);
+
+    return;
+}
+
+
+
+//
+// keep a helper thread off the drive thread's cpu and out of its priority
+//
+// helpers made by the drive thread would otherwise inherit both
+//
+void rthelper (void)
+{
+    struct sched_param param;
+
+    if (rtprio) {
+	param.sched_priority = 0;
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    }
+
+    rtpin(helpcpu);
+
+    return;
+}
+
+
+
+//
+// note a command has arrived
+//
+void rtcommand (void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &received);
+    waiting = 1;
+
+    return;
+}
+
+
+
+//
+// note the answer to a command is starting, and how long it took
+//
+void rtanswer (void)
+{
+    uint32_t worst = responses.worst;
+    uint32_t us;
+
+    if (!waiting) return;
+    waiting = 0;
+
+    us = rtmetricadd(&responses, &received);
+    if (us > worst && verbose) info("worst response now %uus", us);
+
+    return;
+}
+
+
+
+//
+// report the commands answered, and the mean and worst times in us
+//
+void rtstats (uint32_t *n,
+	      uint32_t *mean,
+	      uint32_t *max)
+{
+    uint32_t last;
+
+    rtmetricget(&responses, n, mean, max, &last);
+    return;
+}
+
+
+
+//
+// add the time since from to a metric, returns it in us
+//
+uint32_t rtmetricadd (rt_metric *m,
+		      timespec_t *from)
+{
+    timespec_t now;
+    uint32_t us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - from->tv_sec)*1000000L + (now.tv_nsec - from->tv_nsec)/1000L;
+
+    m->n++;
+    m->total += us;
+    m->last = us;
+    if (us > m->worst) m->worst = us;
+
+    return us;
+}
+
+
+
+//
+// report the count of a metric, and its mean, worst and last time in us
+//
+void rtmetricget (rt_metric *m,
+		  uint32_t *n,
+		  uint32_t *mean,
+		  uint32_t *worst,
+		  uint32_t *last)
+{
+    *n = m->n;
+    *mean = m->n ? m->total / m->n : 0;
+    *worst = m->worst;
+    *last = m->last;
+
+    return;
+}
+
+
+
+// the end
@@ -0,0 +1,489 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 RT-11 volumes
+//
+// An RT-11 volume starts with a boot block, a home block, and a directory
+// of 1 to 31 two block segments from block 6. Each segment has a five word
+// header (segments, next segment, highest segment in use, extra bytes per
+// entry, first data block of the segment) and then entries of seven words
+// (status, name and extension in RAD50, length, job, date), ending with an
+// end of segment status. Files are contiguous, in directory order, with
+// empty areas between them.
+//
+
+
+
+#include "common.h"
+
+
+
+// directory entry status words
+
+#define E_TENT		0000400	// tentative file
+#define E_MPTY		0001000	// empty area
+#define E_PERM		0002000	// permanent file
+#define E_EOS		0004000	// end of segment
+
+#define RT11DIR		6	// first block of the directory
+#define RT11HEAD	5	// words in a segment header
+#define RT11ENTRY	7	// words in an entry without extra bytes
+#define RT11SEGMAX	31	// most directory segments
+#define RT11FILES	64	// most entries put in a segment of a new volume
+
+static char rad50set[] = " ABCDEFGHIJKLMNOPQRSTUVWXYZ$.%0123456789";
+
+
+
+//
+// number of RT-11 directory segments for a tape size
+//
+int32_t rt11_segments (int32_t nblocks)
+{
+    if (nblocks <= 2048) return 1;
+    if (nblocks <= 8192) return 4;
+    if (nblocks <= 32768) return 16;
+    return RT11SEGMAX;
+}
+
+
+
+//
+// number of blocks before the data of a volume, boot through directory
+//
+int32_t rt11_sysblocks (int32_t segments)
+{
+    return RT11DIR + 2*segments;
+}
+
+
+
+//
+// most files a volume with a directory of so many segments can list
+//
+// a segment is filled only so far, leaving RT-11 room to split entries
+//
+int32_t rt11_capacity (int32_t segments)
+{
+    return segments*RT11FILES - 1;
+}
+
+
+
+//
+// encode three characters as a RAD50 word
+//
+static uint16_t rad50 (char *s)
+{
+    uint16_t word = 0;
+    char *p;
+    int32_t i;
+
+    for (i = 0; i < 3; i++, s++) {
+	p = *s ? strchr(rad50set, toupper(*s)) : NULL;
+	word = word*050 + (p ? p-rad50set : 0);
+    }
+
+    return word;
+}
+
+
+
+//
+// decode a RAD50 word as three characters, spaces dropped
+//
+static char *unrad50 (uint16_t word,
+		      char *s)
+{
+    char c[3];
+    int32_t i;
+
+    for (i = 2; i >= 0; i--) {
+	c[i] = rad50set[word % 050];
+	word /= 050;
+    }
+    for (i = 0; i < 3; i++) if (c[i] != ' ') *s++ = c[i];
+
+    return s;
+}
+
+
+
+//
+// encode a NAME.EXT as the three RAD50 words of a directory entry
+//
+void rad50name (char *name,
+		uint16_t *words)
+{
+    char *dot = strchr(name, '.');
+    char pad[9];
+
+    // name and extension are space filled to 6 and 3 characters
+    memset(pad, ' ', sizeof(pad));
+    memcpy(pad, name, dot ? dot-name : strlen(name));
+    if (dot) memcpy(pad+6, dot+1, strlen(dot+1));
+
+    words[0] = rad50(pad);
+    words[1] = rad50(pad+3);
+    words[2] = rad50(pad+6);
+    return;
+}
+
+
+
+//
+// decode the three RAD50 words of a directory entry as NAME.EXT
+//
+void unrad50name (uint16_t *words,
+		  char *name)
+{
+    char *p;
+
+    p = unrad50(words[0], name);
+    p = unrad50(words[1], p);
+    *p++ = '.';
+    *unrad50(words[2], p) = '\0';
+    return;
+}
+
+
+
+//
+// make an RT-11 NAME.EXT from a host file name, -1 if there is none
+//
+int32_t rt11name (char *host,
+		  char *name)
+{
+    char *dot = strrchr(host, '.');
+    int32_t len = dot ? dot-host : strlen(host);
+    int32_t ext = dot ? strlen(dot+1) : 0;
+    int32_t i;
+
+    if (len < 1 || len > 6 || ext > 3) return -1;
+
+    for (i = 0; host[i]; i++)
+	if (host+i != dot && (!isalnum(host[i]) && host[i] != '$')) return -1;
+
+    for (i = 0; i < len; i++) name[i] = toupper(host[i]);
+    name[len] = '.';
+    for (i = 0; i < ext; i++) name[len+1+i] = toupper(dot[1+i]);
+    name[len+1+ext] = '\0';
+
+    return 0;
+}
+
+
+
+//
+// make a host file name from a NAME.EXT, lower case with no empty extension
+//
+void rt11host (char *name,
+	       char *host)
+{
+    int32_t i;
+
+    for (i = 0; name[i]; i++) host[i] = tolower(name[i]);
+    host[i] = '\0';
+    if (i > 0 && host[i-1] == '.') host[i-1] = '\0';
+    return;
+}
+
+
+
+//
+// RT-11 date word for a host time, 0 (no date) outside 1972..2099
+//
+uint16_t rt11date (time_t t)
+{
+    struct tm *tm = localtime(&t);
+    int32_t year;
+
+    if (tm == NULL) return 0;
+    year = tm->tm_year + 1900 - 1972;
+    if (year < 0 || year > 127) return 0;
+
+    return ((year/32) << 14) | ((tm->tm_mon+1) << 10) | (tm->tm_mday << 5) | (year%32);
+}
+
+
+
+//
+// build the boot block, home block and directory of a volume in buffer
+//
+// buffer holds rt11_sysblocks(segments) zeroed blocks; the files are laid
+// out one after another from the first data block, their start blocks are
+// filled in, and the rest of the volume is one empty area
+//
+int32_t rt11format (uint8_t *buffer,
+		    int32_t nblocks,
+		    int32_t segments,
+		    vol_file *files,
+		    int32_t nfiles)
+{
+    uint16_t *seg = NULL;
+    int32_t start = rt11_sysblocks(segments);
+    int32_t number = 0;
+    int32_t n = 0;
+    int32_t used;
+    int32_t w = 0;
+    int32_t i;
+
+    static int16_t boot[] = { // offset 0000000
+ 	0000240, 0000005, 0000404, 0000000, 0000000, 0041420, 0116020, 0000400,
+	0004067, 0000044, 0000015, 0000000, 0005000, 0041077, 0047517, 0026524,
+	0026525, 0067516, 0061040, 0067557, 0020164, 0067157, 0073040, 0066157,
+	0066565, 0006545, 0005012, 0000200, 0105737, 0177564, 0100375, 0112037,
+	0177566, 0100372, 0000777
+    };
+
+    static int16_t bitmap[] = { // offset 0001000
+	0000000, 0170000, 0007777
+    };
+
+    static int16_t home[] = { // offset 0001700
+	0177777, 0000000, 0000000, 0000000, 0000000, 0000000, 0000000, 0000000,
+	0000000, 0000001, 0000006, 0107123, 0052122, 0030461, 0020101, 0020040,
+	0020040, 0020040, 0020040, 0020040, 0020040, 0020040, 0020040, 0020040,
+	0042504, 0051103, 0030524, 0040461, 0020040, 0020040
+    };
+
+    // the empty area entry INIT makes, " EMPTY.FIL"
+    static int16_t empty[] = {
+	E_MPTY, 0000325, 0063471, 0023364, 0000000, 0000000, 0002264
+    };
+
+    if (segments < 1 || segments > RT11SEGMAX || nfiles > rt11_capacity(segments)) return -1;
+    for (i = used = 0; i < nfiles; i++) used += files[i].length;
+    if (start + used > nblocks || nblocks > RT11MAX) return -2;
+
+    memcpy(buffer+00000, boot, sizeof(boot));
+    memcpy(buffer+01000, bitmap, sizeof(bitmap));
+    memcpy(buffer+01700, home, sizeof(home));
+
+    // fill each segment in turn, then the empty area and the end marker
+    for (i = 0; i <= nfiles; i++) {
+	if (seg == NULL || n == RT11FILES) {
+	    number++;
+	    if (seg) { seg[w] = E_EOS; seg[1] = number; }
+	    seg = (uint16_t *)(buffer + rt11_sysblocks(number-1)*BLOCKSIZE);
+	    seg[0] = segments;
+	    seg[4] = start;
+	    // the first segment knows the highest one in use
+	    ((uint16_t *)(buffer + RT11DIR*BLOCKSIZE))[2] = number;
+	    w = RT11HEAD;
+	    n = 0;
+	}
+	if (i < nfiles) {
+	    files[i].start = start;
+	    seg[w+0] = E_PERM;
+	    rad50name(files[i].name, seg+w+1);
+	    seg[w+4] = files[i].length;
+	    seg[w+5] = 0;
+	    seg[w+6] = files[i].date;
+	    start += files[i].length;
+	} else {
+	    memcpy(seg+w, empty, sizeof(empty));
+	    seg[w+4] = nblocks - start;
+	}
+	w += RT11ENTRY;
+	n++;
+    }
+    seg[w] = E_EOS;
+
+    return 0;
+}
+
+
+
+//
+// list the permanent files of a volume, reading its blocks with get()
+//
+// returns the number of files, or -1 if the directory is not sensible
+//
+int32_t rt11dir (int32_t (*get)(void *, int32_t, uint8_t *),
+		 void *ctx,
+		 vol_file *files,
+		 int32_t max)
+{
+    uint16_t seg[BLOCKSIZE];
+    int32_t nfiles = 0;
+    int32_t count = 0;
+    int32_t number = 1;
+    int32_t start;
+    int32_t size;
+    int32_t w;
+
+    while (number) {
+	if (number > RT11SEGMAX || ++count > RT11SEGMAX) return -1;
+	if (get(ctx, RT11DIR + 2*(number-1), (uint8_t *)seg)
+	    || get(ctx, RT11DIR + 2*(number-1) + 1, (uint8_t *)seg + BLOCKSIZE)) return -1;
+	if (seg[0] < 1 || seg[0] > RT11SEGMAX || seg[3] & 1) return -1;
+
+	size = RT11ENTRY + seg[3]/2;
+	start = seg[4];
+	for (w = RT11HEAD; w + size < BLOCKSIZE && !(seg[w] & E_EOS); w += size) {
+	    if ((seg[w] & E_PERM) && nfiles < max) {
+		unrad50name(seg+w+1, files[nfiles].name);
+		files[nfiles].start = start;
+		files[nfiles].length = seg[w+4];
+		files[nfiles].date = seg[w+6];
+		nfiles++;
+	    }
+	    start += seg[w+4];
+	}
+
+	number = seg[1];
+    }
+
+    return nfiles;
+}
+
+
+
+// a volume in memory, as read by rt11dir()
+
+typedef struct {
+    uint8_t	*image;		// the whole volume
+    int32_t	nblocks;	// blocks in it
+} mem_volume;
+
+
+
+//
+// read a block of a volume in memory for rt11dir()
+//
+static int32_t memblock (void *ctx,
+			 int32_t block,
+			 uint8_t *buffer)
+{
+    mem_volume *vol = ctx;
+
+    if (block >= vol->nblocks) return -1;
+
+    memcpy(buffer, vol->image + block*BLOCKSIZE, BLOCKSIZE);
+    return 0;
+}
+
+
+
+//
+// list the permanent files of a volume in memory
+//
+int32_t rt11list (uint8_t *image,
+		  int32_t nblocks,
+		  vol_file *files,
+		  int32_t max)
+{
+    mem_volume vol;
+
+    vol.image = image;
+    vol.nblocks = nblocks;
+
+    return rt11dir(memblock, &vol, files, max);
+}
+
+
+
+//
+// add a file to a volume in memory, replacing any of the same name
+//
+// the file goes in the first empty area big enough, which is split in
+// two; returns -1 if the directory is not sensible, -2 if no empty area
+// is big enough and -3 if the segment holding it has no room for an entry
+//
+int32_t rt11add (uint8_t *image,
+		 int32_t nblocks,
+		 char *name,
+		 uint8_t *data,
+		 int32_t size,
+		 uint16_t date)
+{
+    uint16_t words[3];
+    uint16_t *seg;
+    int32_t length = (size+BLOCKSIZE-1)/BLOCKSIZE;
+    int32_t number;
+    int32_t start;
+    int32_t entry;
+    int32_t end;
+    int32_t w;
+
+    if (rt11list(image, nblocks, NULL, 0) < 0) return -1;
+    rad50name(name, words);
+
+    // an old copy becomes an empty area
+    for (number = 1; number; number = seg[1]) {
+	seg = (uint16_t *)(image + rt11_sysblocks(number-1)*BLOCKSIZE);
+	entry = RT11ENTRY + seg[3]/2;
+	for (w = RT11HEAD; w + entry < BLOCKSIZE && !(seg[w] & E_EOS); w += entry)
+	    if ((seg[w] & E_PERM) && !memcmp(seg+w+1, words, sizeof(words))) seg[w] = E_MPTY;
+    }
+
+    // first empty area that fits, in a segment with room for one more entry
+    for (number = 1; number; number = seg[1]) {
+	seg = (uint16_t *)(image + rt11_sysblocks(number-1)*BLOCKSIZE);
+	entry = RT11ENTRY + seg[3]/2;
+	for (end = RT11HEAD; end + entry < BLOCKSIZE && !(seg[end] & E_EOS); end += entry);
+	start = seg[4];
+	for (w = RT11HEAD; w < end; start += seg[w+4], w += entry) {
+	    if (!(seg[w] & E_MPTY) || seg[w+4] < length) continue;
+	    if (end + entry >= BLOCKSIZE) return -3;
+	    if (start + length > nblocks) return -2;
+	    // the new entry goes in front of what is left of the empty area
+	    memmove(seg+w+entry, seg+w, (end+1-w)*2);
+	    memset(seg+w, 0, entry*2);
+	    seg[w+0] = E_PERM;
+	    memcpy(seg+w+1, words, sizeof(words));
+	    seg[w+4] = length;
+	    seg[w+6] = date;
+	    seg[w+entry+4] -= length;
+	    memcpy(image + start*BLOCKSIZE, data, size);
+	    memset(image + start*BLOCKSIZE + size, 0, length*BLOCKSIZE - size);
+	    return 0;
+	}
+    }
+
+    return -2;
+}
+
+
+
+// the end
@@ -45,6 +45,8 @@
 
 
 
+#define _GNU_SOURCE // for ppoll
+
 #include "common.h"
 
 #ifdef WINCOMM
@@ -59,8 +61,26 @@
 #endif // MACOSX
 
 #include <termios.h>
+#include <errno.h>
+#include <poll.h>
+
+#ifndef WINCOMM
+#include <sys/ioctl.h>
+#endif // !WINCOMM
+#include <signal.h>
+#ifdef LINUX
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <pthread.h>
+#endif // LINUX
+
+#ifdef LINUX
+#include <linux/serial.h>
+#include <limits.h>
+#endif // LINUX
 
 #define	BUFSIZE	256	// size of serial line buffers (bytes, each way)
+#define PACECHUNK 16	// most bytes handed to the driver at once when pacing
 
 // serial output buffer
 static uint8_t  wbuf[BUFSIZE];
@@ -72,6 +92,10 @@ static uint8_t  rbuf[BUFSIZE];
 static uint8_t *rptr;
 static int32_t  rcnt;
 
+// a BREAK seen in the input while sending
+static uint8_t rxbreak = 0;	// set nonzero until devrxget() gets to it
+static timespec_t rxbreakat;	// when it was seen
+
 #ifdef WINCOMM
 // serial device descriptor, default to nada
 static HANDLE hDevice = INVALID_HANDLE_VALUE;
@@ -79,9 +103,13 @@ static HANDLE hDevice = INVALID_HANDLE_VALUE;
 static DCB dcbSave;
 static COMMTIMEOUTS ctoSave;
 static uint8_t rxBreakSeen;
+// set to wake a thread waiting for input
+static volatile uint8_t rxWake;
 #else // !WINCOMM
 // serial device descriptor, default to nada
 static int32_t device = -1;
+// wakes a thread waiting for input, read end and write end
+static int32_t wakefd[2] = { -1, -1 };
 // async line parameters
 static struct termios lineSave;
 #endif // !WINCOMM
@@ -89,6 +117,23 @@ static struct termios lineSave;
 // console parameters
 static struct termios consSave;
 
+// quit signals, read end and write end (the same signalfd on linux)
+static int32_t sigfd[2] = { -1, -1 };
+
+// transmit pacing
+static uint32_t pacens = 0;	// ns per byte at the paced rate, 0 if not pacing
+static timespec_t pacenext;	// when the line may take the next byte
+static uint64_t pacebytes = 0;	// bytes sent paced
+static uint64_t pacetime = 0;	// ns it took to send them
+static uint32_t charns = 0;	// ns per byte at the line rate, 0 if not known
+
+#ifdef LINUX
+// low latency tuning, restored at exit
+static int32_t serflags = -1;	// serial driver flags before, -1 if untouched
+static char latpath[PATH_MAX];	// sysfs latency timer of a USB adapter
+static int32_t latsave = -1;	// its value before, -1 if untouched
+#endif // LINUX
+
 
 
 #ifdef WINCOMM
@@ -206,6 +251,7 @@ void devrxinit (void)
     // reset receive buffer
     rcnt = 0;
     rptr = rbuf;
+    rxbreak = 0;
 
     return;
 }
@@ -248,12 +294,268 @@ int32_t devrxavail (void)
 
 
 
+//
+// look for a BREAK among the characters not yet taken, reading any that arrived
+//
+// a BREAK found drops all output, queued or in the driver, since the host
+// has given up on it; devtxflush() then sends nothing until devrxget()
+// gets as far as the BREAK. Only detected with PARMRK or under windows.
+//
+static int32_t devrxlook (void)
+{
+    int32_t n;
+
+    if (rxbreak) return 1;
+
+    // move what is still to be taken to the front, add what has arrived
+    if (rcnt < 0) rcnt = 0;
+    if (rptr != rbuf) memmove(rbuf, rptr, rcnt);
+    rptr = rbuf;
+#ifdef WINCOMM
+    if (rcnt == 0) devrxavail();
+#else // !WINCOMM
+    if (rcnt < sizeof(rbuf) && (n = read(device, rbuf+rcnt, sizeof(rbuf)-rcnt)) > 0) rcnt += n;
+#endif // !WINCOMM
+
+#ifdef USE_PARMRK
+    // 377,000,000 is a BREAK, 377,377 a 377 byte, 377,000,NNN a bad byte
+    for (n = 0; n < rcnt; n++) {
+	if (rbuf[n] != 0377) continue;
+	if (n+1 < rcnt && rbuf[n+1] == 0377) { n++; continue; }
+	if (n+2 >= rcnt) break;
+	if (rbuf[n+1] == 0000 && rbuf[n+2] == 0000) { rxbreak = 1; break; }
+	n += 2;
+    }
+#else // !USE_PARMRK
+#ifdef WINCOMM
+    rxbreak = rxBreakSeen;
+#endif // WINCOMM
+#endif // !USE_PARMRK
+
+    if (rxbreak) {
+	clock_gettime(CLOCK_MONOTONIC, &rxbreakat);
+	devtxinit();
+    }
+
+    return rxbreak;
+}
+
+
+
+//
+// report a BREAK seen while sending and not yet taken, and when it came
+//
+int32_t devrxbreak (timespec_t *when)
+{
+    if (rxbreak && when) *when = rxbreakat;
+    return rxbreak;
+}
+
+
+
+//
+// wait up to ms (forever if negative) for input to arrive
+//
+// returns 1 if there is input, 0 on timeout, -1 if woken by devwake()
+//
+int32_t devrxwait (int32_t ms)
+{
+#ifdef WINCOMM
+    // no waiting on a handle and a wakeup together, check every ms
+    for (;;) {
+	if (rxWake) { rxWake = 0; return -1; }
+	if (devrxavail()) return 1;
+	if (ms == 0) return 0;
+	delay_ms(1);
+	if (ms > 0) ms--;
+    }
+#else // !WINCOMM
+    struct pollfd fds[2];
+    uint64_t n;
+
+    if (rcnt > 0) return 1;
+
+    fds[0].fd = device;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakefd[0];
+    fds[1].events = POLLIN;
+
+    for (;;) {
+	fds[0].revents = fds[1].revents = 0;
+	if (poll(fds, 2, ms) >= 0) break;
+	if (errno != EINTR) return 0;
+    }
+
+    if (fds[1].revents & POLLIN) {
+	// take the wakeup, one is as good as many
+	while (read(wakefd[0], &n, sizeof(n)) > 0);
+	return -1;
+    }
+    return fds[0].revents ? 1 : 0;
+#endif // !WINCOMM
+}
+
+
+
+//
+// wake a thread waiting in devrxwait(), or make its next wait return at once
+//
+void devwake (void)
+{
+#ifdef WINCOMM
+    rxWake = 1;
+#else // !WINCOMM
+    uint64_t n = 1;
+    if (write(wakefd[1], &n, sizeof(n)) < 0) error("devwake(): write failed");
+#endif // !WINCOMM
+    return;
+}
+
+
+
+//
+// get more characters into the receive buffer, waiting as long as it takes
+//
+// returns -1 if woken by devwake() instead
+//
+static int32_t devrxfill (void)
+{
+    while (rcnt <= 0) {
+	if (devrxavail()) break;
+	if (devrxwait(-1) < 0) return -1;
+    }
+    return 0;
+}
+
+
+
+//
+// nanoseconds from a to b
+//
+static int64_t nsdiff (timespec_t *a,
+		       timespec_t *b)
+{
+    return (int64_t)(b->tv_sec - a->tv_sec)*1000000000L + (b->tv_nsec - a->tv_nsec);
+}
+
+
+
+//
+// move a pacing deadline on by ns nanoseconds
+//
+static void nsadd (timespec_t *t,
+		   int64_t ns)
+{
+    ns += t->tv_nsec;
+    t->tv_sec += ns / 1000000000L;
+    t->tv_nsec = ns % 1000000000L;
+    return;
+}
+
+
+
+//
+// write characters no faster than the paced rate
+//
+// the buffer goes to the driver in small pieces, each one sent when the
+// line would have finished the one before at the paced rate, so the
+// adapter never holds more than a piece ahead of the far end
+//
+static int32_t devtxpaced (uint8_t *buf,
+			   int32_t cnt)
+{
+    timespec_t first;
+    timespec_t now;
+    int64_t ns;
+    int32_t done = 0;
+    int32_t n = 0;
+
+    // an idle line starts now, it does not catch up
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (nsdiff(&pacenext, &now) > 0) pacenext = now;
+
+    while (done < cnt) {
+	// wait for the line to be ready for the next piece, unless the
+	// host gives up on the rest meanwhile
+	for (;;) {
+	    if (devrxlook()) break;
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    if ((ns = nsdiff(&now, &pacenext)) <= 0) break;
+	    now.tv_sec = ns / 1000000000L;
+	    now.tv_nsec = ns % 1000000000L;
+#ifdef LINUX
+	    if (rcnt < sizeof(rbuf)) {
+		struct pollfd fds = { .fd = device, .events = POLLIN };
+		ppoll(&fds, 1, &now, NULL);
+		continue;
+	    }
+#endif // LINUX
+	    nanosleep(&now, NULL);
+	}
+	if (rxbreak) break;
+	if (done == 0) clock_gettime(CLOCK_MONOTONIC, &first);
+#ifdef WINCOMM
+	{
+	    DWORD acnt = 0;
+	    if (!WriteFile(hDevice, buf+done, cnt-done < PACECHUNK ? cnt-done : PACECHUNK, &acnt, NULL))
+		error("devtxwrite(): error=%d", GetLastError());
+	    n = acnt;
+	}
+#else // !WINCOMM
+	n = write(device, buf+done, cnt-done < PACECHUNK ? cnt-done : PACECHUNK);
+#endif // !WINCOMM
+	if (n <= 0) break;
+	done += n;
+	nsadd(&pacenext, (int64_t)n*pacens);
+    }
+
+    // the time taken includes the line time of the last piece
+    if (done > 0) {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pacebytes += done;
+	pacetime += nsdiff(&first, &now) + (int64_t)n*pacens;
+    }
+
+    return done > 0 ? done : n;
+}
+
+
+
+//
+// report the rate the pacer aims for and the one it achieved, in bytes/s
+//
+int32_t devtxpace (uint32_t *target,
+		   uint32_t *achieved)
+{
+    if (!pacens) return -1;
+
+    *target = 1000000000L / pacens;
+    *achieved = pacetime ? pacebytes*1000000000L / pacetime : 0;
+
+    return 0;
+}
+
+
+
+//
+// the time one byte takes on the line, in ns, 0 if not known
+//
+uint32_t devcharns (void)
+{
+    return charns;
+}
+
+
+
 //
 // write characters direct to device from transmit buffer
 //
 int32_t devtxwrite (uint8_t *buf,
 		    int32_t cnt)
 {
+    // metered writes if asked
+    if (pacens && cnt > 0) return devtxpaced(buf, cnt);
+
     // write characters if asked, return number written
     if (cnt > 0) {
 #ifdef WINCOMM
@@ -278,6 +580,41 @@ int32_t devtxwrite (uint8_t *buf,
 
 
 
+#ifndef WINCOMM
+//
+// wait until the output has gone, or the host sends a BREAK
+//
+// the input is watched while the driver empties its queue, so a BREAK cuts
+// the wait (and the output) short rather than being found once it is over
+//
+static void devtxdrain (void)
+{
+    struct pollfd fds;
+    int queued;
+    int32_t ms;
+
+    for (;;) {
+	if (devrxlook()) return;
+	// a full receive buffer can not be looked through further
+	if (rcnt >= sizeof(rbuf)) break;
+	if (ioctl(device, TIOCOUTQ, &queued) || queued <= 0) break;
+	// about the time the queue takes to go, woken early by input
+	ms = (int64_t)queued * charns / 1000000 + 1;
+	fds.fd = device;
+	fds.events = POLLIN;
+	fds.revents = 0;
+	poll(&fds, 1, ms);
+    }
+
+    // what the adapter still holds
+    tcdrain(device);
+
+    return;
+}
+#endif // !WINCOMM
+
+
+
 //
 // send any outgoing characters in buffer
 //
@@ -285,9 +622,9 @@ void devtxflush (void)
 {
     int32_t acnt;
     
-    // write any characters we have
-    if (wcnt > 0) {
-	if ((acnt = devtxwrite(wbuf, wcnt)) != wcnt)
+    // write any characters we have, unless the host sent a BREAK
+    if (wcnt > 0 && !rxbreak) {
+	if ((acnt = devtxwrite(wbuf, wcnt)) != wcnt && !rxbreak)
 	    error("devtxflush(): write error, expected=%d, actual=%d", wcnt, acnt);
     }
 
@@ -295,12 +632,15 @@ void devtxflush (void)
     wcnt = 0;
     wptr = wbuf;
 
+    // keep packets apart on the line
+    if (pacens && txgap) nsadd(&pacenext, (int64_t)txgap*1000L);
+
     // wait until all characters are transmitted
 #ifdef WINCOMM
-    if (!FlushFileBuffers(hDevice))
+    if (!rxbreak && !FlushFileBuffers(hDevice))
 	error("devtxflush(): FlushFileBuffers() failed, error=%d", GetLastError());
 #else // !WINCOMM
-    tcdrain(device);
+    devtxdrain();
 #endif // !WINCOMM
 
     return;
@@ -317,13 +657,13 @@ uint8_t devrxget (uint8_t *flg)
 
 #ifdef USE_PARMRK
     // get more bytes if none available
-    while (rcnt <= 0) { (void)devrxavail(); }
+    if (devrxfill()) { *flg = DEV_STOP; return 0; }
     // at least one available
     rcnt--;
     // check if escaped or normal
     if ((c = *rptr++) == 0377) {
         // escape byte seen
-        while (rcnt <= 0) { (void)devrxavail(); }
+        if (devrxfill()) { *flg = DEV_STOP; return 0; }
         // at least one available
         rcnt--;
         // check if escape or not
@@ -333,13 +673,14 @@ uint8_t devrxget (uint8_t *flg)
             return c;
         } else {
             // non-escape byte seen, so get one more byte
-            while (rcnt <= 0) { (void)devrxavail(); }
+            if (devrxfill()) { *flg = DEV_STOP; return 0; }
             // at least one available
             rcnt--;
             // check if NULL
             if ((c = *rptr++) == 0000) {
                 // 377,000,000 seen; signals a BREAK, return 000 byte
                 *flg = DEV_BREAK;
+                rxbreak = 0;
                 return c;
             } else {
                 // 377,000,NNN seen; signals byte NNN parity/framing error
@@ -354,7 +695,7 @@ uint8_t devrxget (uint8_t *flg)
     }
 #else // !USE_PARMRK
     // get more characters if none available
-    while (rcnt <= 0) { (void)devrxavail(); }
+    if (devrxfill()) { *flg = DEV_STOP; return 0; }
     // at least one available
     rcnt--;
     // get data byte
@@ -366,6 +707,7 @@ uint8_t devrxget (uint8_t *flg)
     if (c == 000 && rxBreakSeen) {
 	*flg = DEV_BREAK;
 	rxBreakSeen = 0;
+	rxbreak = 0;
     } else {
 	*flg = DEV_NORMAL;
     }
@@ -499,6 +841,75 @@ static int32_t devbaud (int32_t rate)
 
 
 
+#ifdef LINUX
+//
+// read or write the latency timer of a USB adapter, returns ms or -1
+//
+static int32_t devlatency (int32_t ms)
+{
+    FILE *fp;
+    int32_t value = -1;
+
+    if ((fp = fopen(latpath, ms < 0 ? "r" : "w")) == NULL) return -1;
+    if (ms < 0)
+	value = fscanf(fp, "%d", &value) == 1 ? value : -1;
+    else
+	value = fprintf(fp, "%d\n", ms) > 0 ? ms : -1;
+    if (fclose(fp)) value = -1;
+
+    return value;
+}
+
+
+
+//
+// cut the time received characters wait in the driver and the adapter
+//
+// the serial driver is asked not to hold characters back, and an FTDI style
+// USB adapter has its latency timer (16ms by default) set to ms
+//
+static void devlowlatency (char *name,
+			   int32_t ms)
+{
+    struct serial_struct ss;
+    char path[PATH_MAX];
+    char *base;
+    int32_t now;
+
+    if (ioctl(device, TIOCGSERIAL, &ss)) {
+	info("serial line %s has no low latency mode", name);
+    } else {
+	serflags = ss.flags;
+	ss.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(device, TIOCSSERIAL, &ss) || ioctl(device, TIOCGSERIAL, &ss)) {
+	    error("cannot set low latency mode on %s", name);
+	    serflags = -1;
+	} else {
+	    info("serial line %s low latency was %s, now %s", name,
+		 serflags & ASYNC_LOW_LATENCY ? "on" : "off", ss.flags & ASYNC_LOW_LATENCY ? "on" : "off");
+	}
+    }
+
+    // the timer lives in sysfs under the tty name the port really has
+    if (realpath(name, path) == NULL) return;
+    base = (base = strrchr(path, '/')) ? base+1 : path;
+    snprintf(latpath, sizeof(latpath), "/sys/bus/usb-serial/devices/%.64s/latency_timer", base);
+    if ((latsave = devlatency(-1)) < 0) return;
+
+    if (devlatency(ms) < 0) {
+	error("cannot set latency timer of %s, was %dms", name, latsave);
+	latsave = -1;
+	return;
+    }
+    now = devlatency(-1);
+    info("serial line %s latency timer was %dms, now %dms", name, latsave, now);
+
+    return;
+}
+#endif // LINUX
+
+
+
 //
 // open/initialize serial port
 //
@@ -582,6 +993,7 @@ void devinit (char *port,
     struct termios line;
     char name[64];
     unsigned int n;
+    int32_t actual;
 
     // open serial port
     int32_t euid = geteuid();
@@ -634,10 +1046,8 @@ void devinit (char *port,
     // flush all existing input data
     tcflush(device, TCIFLUSH);
 
-    // set baud rate, if it is legal
-    if (devbaud(speed) == -1) {
-	error("illegal serial speed %d., ignoring", speed);
-    } else {
+    // set baud rate, if it is in the table
+    if (devbaud(speed) != -1) {
 	cfsetispeed(&line, devbaud(speed));
 	cfsetospeed(&line, devbaud(speed));
     }
@@ -645,12 +1055,46 @@ void devinit (char *port,
     // set new device parameters
     tcsetattr(device, TCSANOW, &line);
 
+    // any other rate as near as the driver can get it
+    if (devbaud(speed) == -1) {
+	if ((actual = baudany(device, speed)) <= 0) {
+	    error("illegal serial speed %d., ignoring", speed);
+	} else {
+	    info("serial speed %d. set as %d., error %.2f%%", speed, actual, 100.0*(actual-speed)/speed);
+	    speed = actual;
+	}
+    }
+
     // and non-blocking also
     if (fcntl(device, F_SETFL, FNDELAY) == -1)
 	error("failed to set non-blocking read");
 
+    // a way to wake the thread waiting on the line
+#ifdef LINUX
+    if ((wakefd[0] = wakefd[1] = eventfd(0, EFD_NONBLOCK)) < 0) fatal("unable to create wakeup event");
+#else // !LINUX
+    if (pipe(wakefd)) fatal("unable to create wakeup pipe");
+    fcntl(wakefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakefd[1], F_SETFL, O_NONBLOCK);
+#endif // !LINUX
+
+#ifdef LINUX
+    // have characters passed on as soon as they arrive
+    if (latency) devlowlatency(name, latency);
+#endif // LINUX
+
 #endif // !WINCOMM
 
+    // a start bit, 8 data bits and the stop bits per byte
+    if (speed > 0) charns = 1000000000LL * (1+8+stop) / speed;
+
+    // meter output at a share of the line rate
+    if (pace && speed > 0) {
+	pacens = 1000000000LL * (1+8+stop) * 100 / ((int64_t)speed * pace);
+	clock_gettime(CLOCK_MONOTONIC, &pacenext);
+	info("pacing output at %d%% of line rate, %u bytes/s, gap %dus", pace, 1000000000U/pacens, txgap);
+    }
+
     // zap current data, if any
     devtxinit();
     devrxinit();
@@ -665,14 +1109,37 @@ void devinit (char *port,
 //
 void devrestore (void)
 {
+    uint32_t target;
+    uint32_t achieved;
+
+    if (verbose && devtxpace(&target, &achieved) == 0)
+	info("paced output achieved %u bytes/s of %u", achieved, target);
+
 #ifdef WINCOMM
     if (!CloseHandle(hDevice))
 	error("devrestore(): error=%d", GetLastError());
     hDevice = INVALID_HANDLE_VALUE;
 #else // !WINCOMM
+#ifdef LINUX
+    // put back the latency settings found
+    struct serial_struct ss;
+    if (serflags != -1 && ioctl(device, TIOCGSERIAL, &ss) == 0) {
+	ss.flags = (ss.flags & ~ASYNC_LOW_LATENCY) | (serflags & ASYNC_LOW_LATENCY);
+	if (ioctl(device, TIOCSSERIAL, &ss)) error("devrestore(): cannot restore low latency mode");
+	else info("serial line low latency restored to %s", serflags & ASYNC_LOW_LATENCY ? "on" : "off");
+    }
+    if (latsave != -1) {
+	if (devlatency(latsave) < 0) error("devrestore(): cannot restore latency timer");
+	else info("serial line latency timer restored to %dms", latsave);
+    }
+    serflags = latsave = -1;
+#endif // LINUX
     tcsetattr(device, TCSANOW, &lineSave);
     close(device);
     device = -1;
+    if (wakefd[1] != wakefd[0]) close(wakefd[1]);
+    close(wakefd[0]);
+    wakefd[0] = wakefd[1] = -1;
 #endif // !WINCOMM
     return;
 }
@@ -741,8 +1208,107 @@ int32_t conget (void)
     // try to read at most one char (may be none)
     s = read(fileno(stdin), buf, sizeof(buf));
 
-    // if got a char return it, else return -1
-    return s == 1 ? *buf : -1;
+    // if got a char return it, -2 if the console is gone, else -1
+    if (s == 1) return (uint8_t)*buf;
+    if (s == 0 || (s < 0 && errno != EAGAIN && errno != EINTR)) return -2;
+    return -1;
+}
+
+
+
+#ifndef LINUX
+//
+// pass a quit signal on to whoever waits on the signal descriptor
+//
+static void consigpost (int sig)
+{
+    uint8_t c = sig;
+    int32_t e = errno;
+
+    if (write(sigfd[1], &c, 1)) {}
+    errno = e;
+    return;
+}
+#endif // !LINUX
+
+
+
+//
+// take over the quit signals, to be waited on through consigfd()
+//
+// done before any thread is created, so that on linux every thread
+// inherits the blocked mask and the signals only arrive at the signalfd
+//
+void consignals (void)
+{
+    static const int sigs[] = { SIGINT, SIGTERM, SIGHUP };
+    int32_t i;
+
+    // a control client going away must not end the emulator
+    signal(SIGPIPE, SIG_IGN);
+
+#ifdef LINUX
+    sigset_t set;
+
+    sigemptyset(&set);
+    for (i = 0; i < sizeof(sigs)/sizeof(*sigs); i++) sigaddset(&set, sigs[i]);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if ((sigfd[0] = signalfd(-1, &set, SFD_NONBLOCK|SFD_CLOEXEC)) < 0) {
+	error("consignals(): cannot create signalfd");
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+	return;
+    }
+    sigfd[1] = sigfd[0];
+#else // !LINUX
+    struct sigaction sa;
+    int fds[2];
+
+    if (pipe(fds)) {
+	error("consignals(): cannot create signal pipe");
+	return;
+    }
+    sigfd[0] = fds[0];
+    sigfd[1] = fds[1];
+    fcntl(sigfd[0], F_SETFL, O_NONBLOCK);
+    fcntl(sigfd[1], F_SETFL, O_NONBLOCK);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = consigpost;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    for (i = 0; i < sizeof(sigs)/sizeof(*sigs); i++) sigaction(sigs[i], &sa, NULL);
+#endif // !LINUX
+
+    return;
+}
+
+
+
+//
+// the descriptor that becomes readable on a quit signal, -1 if none
+//
+int32_t consigfd (void)
+{
+    return sigfd[0];
+}
+
+
+
+//
+// get a pending quit signal number, -1 if none
+//
+int32_t consigget (void)
+{
+#ifdef LINUX
+    struct signalfd_siginfo si;
+
+    if (read(sigfd[0], &si, sizeof(si)) != sizeof(si)) return -1;
+    return si.ssi_signo;
+#else // !LINUX
+    uint8_t c;
+
+    if (read(sigfd[0], &c, 1) != 1) return -1;
+    return c;
+#endif // !LINUX
 }
 
 
@@ -0,0 +1,352 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Shared block cache
+//
+// Emulators on one host serving the same image can share one resident
+// copy of its blocks. The cache for an image is a POSIX shared memory
+// object named by the device and inode of the image file, so every
+// emulator serving the file, before or after any writes, uses the same
+// one. It holds a header with a process shared lock, a generation count,
+// the modification time of the image as last seen through the cache, a
+// bitmap of the blocks present and the block data. Blocks are added by
+// whichever emulator reads them first; a write updates the cached copy,
+// records the new modification time and bumps the generation, and a
+// block read from the image is only added if the generation is still
+// the one seen before reading, so a slow reader cannot put back stale
+// data. An emulator attaching to a cache whose recorded time no longer
+// matches the image (changed by something else meanwhile) empties it and
+// bumps the generation. The last emulator to close the cache removes it.
+//
+
+
+
+#include "common.h"
+
+#include <pthread.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+
+// shared object header, followed by the bitmap and the block data
+
+#define SHM_MAGIC	"TU58SHM2"
+
+typedef struct {
+    char	magic[8];	// SHM_MAGIC, set once the rest is ready
+    int32_t	nblocks;	// blocks in the image
+    int32_t	users;		// emulators with the cache open
+    uint32_t	generation;	// bumped by every write and invalidation
+    uint32_t	spare;		// unused
+    uint64_t	stamp;		// image modification time as last seen through the cache
+    pthread_mutex_t lock;	// guards all of the object
+} shm_header;
+
+// per unit cache state
+
+static struct {
+    char	name[64];	// shared object name
+    shm_header	*hdr;		// mapped object, NULL if none
+    int32_t	fd;		// image file, for its modification time
+    size_t	size;		// bytes mapped
+    uint8_t	*map;		// bitmap of blocks present
+    uint8_t	*data;		// block data
+} shc [NTU58];
+
+
+
+//
+// offset of the block data in the object
+//
+static inline size_t dataoffset (int32_t nblocks)
+{
+    return (sizeof(shm_header) + (nblocks+7)/8 + BLOCKSIZE-1) / BLOCKSIZE * BLOCKSIZE;
+}
+
+
+
+//
+// take the lock of an object, recovering it from an emulator that died holding it
+//
+static int32_t shmlock (shm_header *hdr)
+{
+    int status = pthread_mutex_lock(&hdr->lock);
+
+#ifdef PTHREAD_MUTEX_ROBUST
+    if (status == EOWNERDEAD) {
+	pthread_mutex_consistent(&hdr->lock);
+	status = 0;
+    }
+#endif // PTHREAD_MUTEX_ROBUST
+
+    return status ? -1 : 0;
+}
+
+
+
+//
+// the modification time of an image file, in ns where there is the resolution
+//
+static uint64_t shmstamp (int32_t fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st)) return 0;
+
+#ifdef LINUX
+    return (uint64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+#else // !LINUX
+    return (uint64_t)st.st_mtime*1000000000;
+#endif // !LINUX
+}
+
+
+
+//
+// init cache state for all units
+//
+void shminit (void)
+{
+    int32_t unit;
+
+    for (unit = 0; unit < NTU58; unit++) shc[unit].hdr = NULL;
+    return;
+}
+
+
+
+//
+// attach a unit to the shared cache of its image file
+//
+int32_t shmopen (int32_t unit,
+		 int32_t fd,
+		 int32_t nblocks)
+{
+    pthread_mutexattr_t attr;
+    struct stat st;
+    shm_header *hdr;
+    size_t size = dataoffset(nblocks) + (size_t)nblocks*BLOCKSIZE;
+    int32_t create = 0;
+    int32_t tries;
+    int32_t sfd = -1;
+
+    if (fstat(fd, &st)) return -1;
+
+    snprintf(shc[unit].name, sizeof(shc[unit].name), "/tu58em-%llx-%llx",
+	     (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+
+    // join the existing cache, else create it; the last user may be removing it meanwhile
+    for (tries = 0; sfd < 0 && tries < 10; tries++) {
+	if ((sfd = shm_open(shc[unit].name, O_RDWR|O_CREAT|O_EXCL, 0666)) >= 0) { create = 1; break; }
+	if (errno != EEXIST) return -2;
+	sfd = shm_open(shc[unit].name, O_RDWR, 0666);
+    }
+    if (sfd < 0) return -2;
+
+    if (create && ftruncate(sfd, size)) {
+	shm_unlink(shc[unit].name);
+	close(sfd);
+	return -3;
+    }
+
+    // one being created by another emulator may not be its full size yet
+    for (tries = 0; !create && tries < 100; tries++) {
+	if (fstat(sfd, &st) == 0 && st.st_size == size) break;
+	usleep(10*1000);
+    }
+    if (!create && tries == 100) { close(sfd); return -4; }
+
+    hdr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, sfd, 0);
+    close(sfd);
+    if (hdr == MAP_FAILED) {
+	if (create) shm_unlink(shc[unit].name);
+	return -5;
+    }
+
+    if (create) {
+	// a fresh object is all zero, so only the header needs setting up
+	hdr->nblocks = nblocks;
+	hdr->users = 0;
+	hdr->generation = 0;
+	hdr->stamp = shmstamp(fd);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef PTHREAD_MUTEX_ROBUST
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif // PTHREAD_MUTEX_ROBUST
+	pthread_mutex_init(&hdr->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	__sync_synchronize();
+	memcpy(hdr->magic, SHM_MAGIC, sizeof(hdr->magic));
+    } else {
+	for (tries = 0; tries < 100 && memcmp((void *)hdr->magic, SHM_MAGIC, sizeof(hdr->magic)); tries++)
+	    usleep(10*1000);
+	if (tries == 100 || hdr->nblocks != nblocks) { munmap(hdr, size); return -6; }
+    }
+
+    if (shmlock(hdr)) { munmap(hdr, size); return -7; }
+    hdr->users++;
+    // an image changed behind the cache's back makes all of it stale
+    if (hdr->stamp != shmstamp(fd)) {
+	memset((uint8_t *)(hdr+1), 0, (nblocks+7)/8);
+	hdr->generation++;
+	hdr->stamp = shmstamp(fd);
+    }
+    pthread_mutex_unlock(&hdr->lock);
+
+    shc[unit].hdr = hdr;
+    shc[unit].fd = fd;
+    shc[unit].size = size;
+    shc[unit].map = (uint8_t *)(hdr+1);
+    shc[unit].data = (uint8_t *)hdr + dataoffset(nblocks);
+    return 0;
+}
+
+
+
+//
+// detach a unit from its shared cache, the last user removes it
+//
+void shmclose (int32_t unit)
+{
+    shm_header *hdr = shc[unit].hdr;
+
+    if (!hdr) return;
+
+    if (shmlock(hdr) == 0) {
+	if (--hdr->users <= 0) shm_unlink(shc[unit].name);
+	pthread_mutex_unlock(&hdr->lock);
+    }
+
+    munmap(hdr, shc[unit].size);
+    shc[unit].hdr = NULL;
+    return;
+}
+
+
+
+//
+// tell whether a unit is attached to a shared cache
+//
+int32_t shmshared (int32_t unit)
+{
+    return shc[unit].hdr != NULL;
+}
+
+
+
+//
+// copy a block out of the cache
+//
+// returns 0 if it was there, else -1 and the generation to pass to
+// shmcacheput() once the block has been read from the image
+//
+int32_t shmcacheget (int32_t unit,
+		     int32_t block,
+		     uint8_t *buffer,
+		     uint32_t *generation)
+{
+    shm_header *hdr = shc[unit].hdr;
+    int32_t status = -1;
+
+    if (!hdr || block < 0 || block >= hdr->nblocks || shmlock(hdr)) return -1;
+
+    if (shc[unit].map[block/8] & (1 << (block%8))) {
+	memcpy(buffer, shc[unit].data+(size_t)block*BLOCKSIZE, BLOCKSIZE);
+	status = 0;
+    }
+    *generation = hdr->generation;
+
+    pthread_mutex_unlock(&hdr->lock);
+    return status;
+}
+
+
+
+//
+// add a block read from the image, unless it may have been written since
+//
+void shmcacheput (int32_t unit,
+		  int32_t block,
+		  uint8_t *buffer,
+		  uint32_t generation)
+{
+    shm_header *hdr = shc[unit].hdr;
+
+    if (!hdr || block < 0 || block >= hdr->nblocks || shmlock(hdr)) return;
+
+    if (hdr->generation == generation) {
+	memcpy(shc[unit].data+(size_t)block*BLOCKSIZE, buffer, BLOCKSIZE);
+	shc[unit].map[block/8] |= 1 << (block%8);
+    }
+
+    pthread_mutex_unlock(&hdr->lock);
+    return;
+}
+
+
+
+//
+// update the cache with a block just written to the image
+//
+void shmwrite (int32_t unit,
+	       int32_t block,
+	       uint8_t *buffer)
+{
+    shm_header *hdr = shc[unit].hdr;
+
+    if (!hdr || block < 0 || block >= hdr->nblocks || shmlock(hdr)) return;
+
+    memcpy(shc[unit].data+(size_t)block*BLOCKSIZE, buffer, BLOCKSIZE);
+    shc[unit].map[block/8] |= 1 << (block%8);
+    hdr->generation++;
+    hdr->stamp = shmstamp(shc[unit].fd);
+
+    pthread_mutex_unlock(&hdr->lock);
+    return;
+}
+
+
+
+// the end
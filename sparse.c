@@ -0,0 +1,403 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Sparse compressed image container
+//
+// A container holds a tape image as a header block, an index with one
+// entry per tape block, and a data area of stored blocks. All-zero blocks
+// are not stored at all, and other blocks are optionally compressed with
+// a small built-in LZ77 coder. Rewritten blocks reuse their slot if they
+// still fit, else they are appended; the orphaned space is not reclaimed.
+//
+
+
+
+#include "common.h"
+
+
+
+// container header, occupies the first block of the file
+
+#define SPARSE_MAGIC	"TU58SPI1"
+
+#define SPARSE_LZ	1	// compress blocks as they are written
+
+#define SLOTSIZE	64	// data area allocation granularity
+
+typedef struct {
+    char	magic[8];	// SPARSE_MAGIC
+    int32_t	blocksize;	// bytes per tape block
+    int32_t	nblocks;	// number of tape blocks
+    int32_t	flags;		// SPARSE_xxx options
+    int32_t	index;		// file offset of the block index
+    int32_t	data;		// file offset of the data area
+} sparse_header;
+
+// index entry per tape block
+
+#define KIND_ZERO	0	// block is all zero, not stored
+#define KIND_RAW	1	// block stored as is
+#define KIND_LZ		2	// block stored compressed
+
+typedef struct {
+    uint32_t	offset;		// file offset of stored data
+    uint16_t	length;		// stored length in bytes
+    uint8_t	kind;		// KIND_xxx
+    uint8_t	spare;		// reserved, zero
+} sparse_entry;
+
+// per unit container state
+
+static struct {
+    int32_t	fd;		// file descriptor, -1 if not a container
+    sparse_header hdr;		// copy of the header
+    sparse_entry *index;	// copy of the block index
+    uint32_t	end;		// file offset of end of data area
+} spi [NTU58];
+
+
+
+//
+// compress a block with a simple LZ77 coder
+//
+// output is groups of a flag byte followed by eight items, each item
+// either a literal byte (flag bit 0) or a two byte match (flag bit 1)
+// of 9 bits offset-1 and 7 bits length-3; returns the compressed length,
+// or -1 if the result would not fit in max bytes
+//
+static int32_t lzpack (uint8_t *in,
+		       int32_t count,
+		       uint8_t *out,
+		       int32_t max)
+{
+    int16_t hash[256];
+    int32_t ip = 0;
+    int32_t op = 0;
+    int32_t fp = 0;
+    int32_t item = 8;
+
+    memset(hash, 0xFF, sizeof(hash));
+
+    while (ip < count) {
+	int32_t len = 0;
+	int32_t cand = -1;
+
+	// start a new group of eight items
+	if (item == 8) {
+	    if (op >= max) return -1;
+	    fp = op++;
+	    out[fp] = 0;
+	    item = 0;
+	}
+
+	// look for a match at the last position with the same 3 byte hash
+	if (ip+3 <= count) {
+	    uint8_t h = (in[ip]*33 + in[ip+1]*7 + in[ip+2]) & 0xFF;
+	    cand = hash[h];
+	    hash[h] = ip;
+	    if (cand >= 0 && ip-cand <= 512)
+		while (ip+len < count && len < 130 && in[cand+len] == in[ip+len]) len++;
+	}
+
+	if (len >= 3) {
+	    int32_t dist = ip-cand-1;
+	    if (op+2 > max) return -1;
+	    out[fp] |= 1 << item;
+	    out[op++] = dist & 0xFF;
+	    out[op++] = ((dist >> 8) << 7) | (len-3);
+	    ip += len;
+	} else {
+	    if (op >= max) return -1;
+	    out[op++] = in[ip++];
+	}
+	item++;
+    }
+
+    return op;
+}
+
+
+
+//
+// expand a block compressed by lzpack(), returns the expanded length
+//
+static int32_t lzunpack (uint8_t *in,
+			 int32_t count,
+			 uint8_t *out,
+			 int32_t max)
+{
+    int32_t ip = 0;
+    int32_t op = 0;
+    int32_t item;
+    uint8_t flags;
+
+    while (ip < count) {
+	flags = in[ip++];
+	for (item = 0; item < 8 && ip < count; item++) {
+	    if (flags & (1 << item)) {
+		int32_t dist, len;
+		if (ip+2 > count) return -1;
+		dist = (in[ip] | ((in[ip+1] >> 7) << 8)) + 1;
+		len = (in[ip+1] & 0x7F) + 3;
+		ip += 2;
+		if (dist > op || op+len > max) return -1;
+		// byte at a time, matches may overlap their own output
+		while (--len >= 0) { out[op] = out[op-dist]; op++; }
+	    } else {
+		if (op >= max) return -1;
+		out[op++] = in[ip++];
+	    }
+	}
+    }
+
+    return op;
+}
+
+
+
+//
+// init container state for all units
+//
+void sparseinit (void)
+{
+    int32_t unit;
+
+    for (unit = 0; unit < NTU58; unit++) {
+	spi[unit].fd = -1;
+	spi[unit].index = NULL;
+	spi[unit].end = 0;
+    }
+    return;
+}
+
+
+
+//
+// release container state for a unit
+//
+void sparseclose (int32_t unit)
+{
+    if (spi[unit].index) free(spi[unit].index);
+    spi[unit].index = NULL;
+    spi[unit].fd = -1;
+    return;
+}
+
+
+
+//
+// attach a unit to an existing container, return number of blocks
+//
+// returns -1 if the file is not a container at all
+//
+int32_t sparseopen (int32_t unit,
+		    int32_t fd)
+{
+    sparse_header hdr;
+    int32_t size;
+    int32_t block;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	|| memcmp(hdr.magic, SPARSE_MAGIC, sizeof(hdr.magic)))
+	return -1;
+
+    if (hdr.blocksize != BLOCKSIZE || hdr.nblocks <= 0 || hdr.nblocks > 65536) {
+	error("sparseopen unit %d has a bad container header", unit);
+	return -2;
+    }
+
+    size = hdr.nblocks * sizeof(sparse_entry);
+    if ((spi[unit].index = malloc(size)) == NULL) return -3;
+
+    if (pread(fd, spi[unit].index, size, hdr.index) != size) {
+	error("sparseopen unit %d cannot read container index", unit);
+	sparseclose(unit);
+	return -4;
+    }
+
+    // new data goes after the last stored block
+    spi[unit].end = hdr.data;
+    for (block = 0; block < hdr.nblocks; block++) {
+	sparse_entry *e = &spi[unit].index[block];
+	uint32_t last = e->offset + (e->length+SLOTSIZE-1)/SLOTSIZE*SLOTSIZE;
+	if (e->kind != KIND_ZERO && last > spi[unit].end) spi[unit].end = last;
+    }
+
+    spi[unit].fd = fd;
+    spi[unit].hdr = hdr;
+    return hdr.nblocks;
+}
+
+
+
+//
+// (re)create an empty container of all zero blocks
+//
+int32_t sparsecreate (int32_t unit,
+		      int32_t fd,
+		      int32_t nblocks,
+		      int32_t compress)
+{
+    sparse_header hdr;
+    uint8_t buffer[BLOCKSIZE];
+    int32_t size = nblocks * sizeof(sparse_entry);
+
+    sparseclose(unit);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SPARSE_MAGIC, sizeof(hdr.magic));
+    hdr.blocksize = BLOCKSIZE;
+    hdr.nblocks = nblocks;
+    hdr.flags = compress ? SPARSE_LZ : 0;
+    hdr.index = BLOCKSIZE;
+    hdr.data = (hdr.index + size + BLOCKSIZE-1) / BLOCKSIZE * BLOCKSIZE;
+
+    if ((spi[unit].index = calloc(nblocks, sizeof(sparse_entry))) == NULL) return -1;
+
+    // header block, then an index of all zero entries
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, &hdr, sizeof(hdr));
+    if (ftruncate(fd, 0)
+	|| pwrite(fd, buffer, sizeof(buffer), 0) != sizeof(buffer)
+	|| pwrite(fd, spi[unit].index, size, hdr.index) != size
+	|| ftruncate(fd, hdr.data)) {
+	sparseclose(unit);
+	return -2;
+    }
+
+    spi[unit].fd = fd;
+    spi[unit].hdr = hdr;
+    spi[unit].end = hdr.data;
+    return 0;
+}
+
+
+
+//
+// read one block from a container
+//
+int32_t sparseread (int32_t unit,
+		    int32_t block,
+		    uint8_t *buffer)
+{
+    sparse_entry *e;
+    uint8_t data[BLOCKSIZE];
+
+    if (spi[unit].fd == -1 || block < 0 || block >= spi[unit].hdr.nblocks) return -1;
+
+    e = &spi[unit].index[block];
+
+    switch (e->kind) {
+    case KIND_ZERO:
+	memset(buffer, 0, BLOCKSIZE);
+	return 0;
+    case KIND_RAW:
+	if (pread(spi[unit].fd, buffer, BLOCKSIZE, e->offset) != BLOCKSIZE) return -2;
+	return 0;
+    case KIND_LZ:
+	if (e->length > sizeof(data)
+	    || pread(spi[unit].fd, data, e->length, e->offset) != e->length) return -2;
+	if (lzunpack(data, e->length, buffer, BLOCKSIZE) != BLOCKSIZE) {
+	    error("sparseread unit %d block 0x%04X is corrupt", unit, block);
+	    return -3;
+	}
+	return 0;
+    }
+
+    return -4;
+}
+
+
+
+//
+// write one block to a container
+//
+int32_t sparsewrite (int32_t unit,
+		     int32_t block,
+		     uint8_t *buffer)
+{
+    sparse_entry *e;
+    sparse_entry new;
+    uint8_t data[BLOCKSIZE];
+    uint8_t *ptr = buffer;
+    int32_t i;
+
+    if (spi[unit].fd == -1 || block < 0 || block >= spi[unit].hdr.nblocks) return -1;
+
+    e = &spi[unit].index[block];
+    memset(&new, 0, sizeof(new));
+
+    // all zero blocks take no space at all
+    for (i = 0; i < BLOCKSIZE && buffer[i] == 0; i++);
+    if (i == BLOCKSIZE) {
+	new.kind = KIND_ZERO;
+    } else {
+	new.kind = KIND_RAW;
+	new.length = BLOCKSIZE;
+	if (spi[unit].hdr.flags & SPARSE_LZ) {
+	    int32_t length = lzpack(buffer, BLOCKSIZE, data, BLOCKSIZE-1);
+	    if (length > 0) { new.kind = KIND_LZ; new.length = length; ptr = data; }
+	}
+	// reuse the old slot if it is big enough, else append
+	if (e->kind != KIND_ZERO
+	    && (new.length+SLOTSIZE-1)/SLOTSIZE <= (e->length+SLOTSIZE-1)/SLOTSIZE) {
+	    new.offset = e->offset;
+	} else {
+	    new.offset = spi[unit].end;
+	    spi[unit].end += (new.length+SLOTSIZE-1)/SLOTSIZE*SLOTSIZE;
+	}
+	if (pwrite(spi[unit].fd, ptr, new.length, new.offset) != new.length) return -2;
+    }
+
+    // data is in place, now point the index at it
+    if (memcmp(e, &new, sizeof(new))) {
+	if (pwrite(spi[unit].fd, &new, sizeof(new),
+		   spi[unit].hdr.index + block*sizeof(sparse_entry)) != sizeof(new)) return -3;
+	*e = new;
+    }
+
+    return 0;
+}
+
+
+
+// the end
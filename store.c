@@ -0,0 +1,454 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Content addressed deduplicating block store
+//
+// A store is a directory of block objects named by the SHA-256 hash of
+// their contents, in subdirectories by the first hash byte. An image in
+// a store is an index file: a header block naming the store, followed by
+// the hash of each tape block (all zero for an all zero block, which is
+// never stored). Each object begins with a count of the index entries
+// referencing it, updated under an flock(); objects whose count drops to
+// zero are left for storegc() to remove, so a concurrent writer can
+// still revive them.
+//
+
+
+
+#include "common.h"
+
+#include <pthread.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+
+
+// index file header, occupies the first block of the file
+
+#define STORE_MAGIC	"TU58STO1"
+
+#define HASHSIZE	32	// bytes per block hash
+
+typedef struct {
+    char	magic[8];	// STORE_MAGIC
+    int32_t	blocksize;	// bytes per tape block
+    int32_t	nblocks;	// number of tape blocks
+    char	store[BLOCKSIZE-16]; // absolute path of the store directory
+} store_header;
+
+// per unit index state
+
+static struct {
+    int32_t	fd;		// index file descriptor, -1 if not in a store
+    char	*dir;		// store directory
+    int32_t	nblocks;	// number of tape blocks
+    uint8_t	(*index)[HASHSIZE]; // copy of the block hashes
+} sto [NTU58];
+
+// process wide cache of blocks by hash, shared by all units
+
+#define CACHESIZE	1024	// blocks in cache, power of two
+
+static struct {
+    uint8_t	hash[HASHSIZE];	// hash of cached block
+    uint8_t	valid;		// entry holds a block
+    uint8_t	data[BLOCKSIZE]; // block contents
+} cache [CACHESIZE];
+
+static pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+
+static const uint8_t zerohash[HASHSIZE];
+
+
+
+//
+// cache slot for a hash
+//
+static inline int32_t cacheslot (const uint8_t *hash)
+{
+    return ((hash[0] << 8) | hash[1]) & (CACHESIZE-1);
+}
+
+
+
+//
+// build the path of an object from its hash
+//
+static void objpath (char *path,
+		     char *dir,
+		     const uint8_t *hash)
+{
+    int32_t i;
+
+    path += sprintf(path, "%s/%02x/", dir, hash[0]);
+    for (i = 1; i < HASHSIZE; i++) path += sprintf(path, "%02x", hash[i]);
+
+    return;
+}
+
+
+
+//
+// adjust the reference count of an object by delta
+//
+// a reference to a missing object creates it from data; returns the new count
+//
+static int32_t objref (char *dir,
+		       const uint8_t *hash,
+		       const uint8_t *data,
+		       int32_t delta)
+{
+    char path[PATH_MAX];
+    char temp[PATH_MAX+16];
+    struct stat st;
+    int32_t count;
+    int32_t fd;
+
+    objpath(path, dir, hash);
+
+    for (;;) {
+	if ((fd = open(path, O_BINARY|O_RDWR)) < 0) {
+	    if (delta <= 0 || !data) return -1;
+	    // new object: fill in a temp file, then link into place; the temp
+	    // name is unique to this call, as a name shared with another opener
+	    // thread could be truncated after it is linked to a live object
+	    snprintf(temp, sizeof(temp), "%s/%02x", dir, hash[0]);
+	    mkdir(temp, 0777);
+	    snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+	    if ((fd = mkstemp(temp)) < 0) return -2;
+	    fchmod(fd, 0644);
+	    count = 0;
+	    if (write(fd, &count, sizeof(count)) != sizeof(count)
+		|| write(fd, data, BLOCKSIZE) != BLOCKSIZE) {
+		close(fd); unlink(temp); return -3;
+	    }
+	    close(fd);
+	    if (link(temp, path) && errno != EEXIST) { unlink(temp); return -4; }
+	    unlink(temp);
+	    continue;
+	}
+	flock(fd, LOCK_EX);
+	// lost a race with storegc() removing it, try again
+	if (fstat(fd, &st) == 0 && st.st_nlink == 0) { close(fd); continue; }
+	break;
+    }
+
+    if (pread(fd, &count, sizeof(count), 0) != sizeof(count)) count = 0;
+    count += delta;
+    if (count < 0) count = 0;
+    if (pwrite(fd, &count, sizeof(count), 0) != sizeof(count)) count = -5;
+    close(fd); // also drops the lock
+
+    return count;
+}
+
+
+
+//
+// init store state for all units
+//
+void storeinit (void)
+{
+    int32_t unit;
+
+    for (unit = 0; unit < NTU58; unit++) {
+	sto[unit].fd = -1;
+	sto[unit].dir = NULL;
+	sto[unit].nblocks = 0;
+	sto[unit].index = NULL;
+    }
+    return;
+}
+
+
+
+//
+// release store state for a unit
+//
+void storeclose (int32_t unit)
+{
+    if (sto[unit].index) free(sto[unit].index);
+    if (sto[unit].dir) free(sto[unit].dir);
+    sto[unit].index = NULL;
+    sto[unit].dir = NULL;
+    sto[unit].fd = -1;
+    return;
+}
+
+
+
+//
+// attach a unit to an existing index file, return number of blocks
+//
+// returns -1 if the file is not an index at all
+//
+int32_t storeopen (int32_t unit,
+		   int32_t fd)
+{
+    store_header hdr;
+    int32_t size;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	|| memcmp(hdr.magic, STORE_MAGIC, sizeof(hdr.magic)))
+	return -1;
+
+    hdr.store[sizeof(hdr.store)-1] = '\0';
+    if (hdr.blocksize != BLOCKSIZE || hdr.nblocks <= 0 || hdr.nblocks > 65536) {
+	error("storeopen unit %d has a bad index header", unit);
+	return -2;
+    }
+
+    size = hdr.nblocks * HASHSIZE;
+    if ((sto[unit].index = malloc(size)) == NULL
+	|| (sto[unit].dir = strdup(hdr.store)) == NULL) {
+	storeclose(unit);
+	return -3;
+    }
+
+    if (pread(fd, sto[unit].index, size, sizeof(hdr)) != size) {
+	error("storeopen unit %d cannot read index", unit);
+	storeclose(unit);
+	return -4;
+    }
+
+    sto[unit].fd = fd;
+    sto[unit].nblocks = hdr.nblocks;
+    return hdr.nblocks;
+}
+
+
+
+//
+// (re)create an index of all zero blocks in store dir
+//
+int32_t storecreate (int32_t unit,
+		     int32_t fd,
+		     char *dir,
+		     int32_t nblocks)
+{
+    store_header hdr;
+    char prev[PATH_MAX];
+    char path[PATH_MAX];
+    int32_t block;
+
+    // re-init of an existing index drops its references first
+    if (sto[unit].fd != -1) {
+	for (block = 0; block < sto[unit].nblocks; block++)
+	    if (memcmp(sto[unit].index[block], zerohash, HASHSIZE))
+		objref(sto[unit].dir, sto[unit].index[block], NULL, -1);
+	// and stays in the same store unless told otherwise
+	if (!dir) dir = strcpy(prev, sto[unit].dir);
+	storeclose(unit);
+    }
+
+    if (!dir) return -1;
+    if (mkdir(dir, 0777) && errno != EEXIST) return -1;
+    if (!realpath(dir, path) || strlen(path) >= sizeof(hdr.store)) return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strcpy(hdr.store, path);
+    memcpy(hdr.magic, STORE_MAGIC, sizeof(hdr.magic));
+    hdr.blocksize = BLOCKSIZE;
+    hdr.nblocks = nblocks;
+
+    if ((sto[unit].index = calloc(nblocks, HASHSIZE)) == NULL
+	|| (sto[unit].dir = strdup(hdr.store)) == NULL) {
+	storeclose(unit);
+	return -2;
+    }
+
+    if (ftruncate(fd, 0)
+	|| pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	|| pwrite(fd, sto[unit].index, nblocks*HASHSIZE, sizeof(hdr)) != nblocks*HASHSIZE) {
+	storeclose(unit);
+	return -3;
+    }
+
+    sto[unit].fd = fd;
+    sto[unit].nblocks = nblocks;
+    return 0;
+}
+
+
+
+//
+// read one block thru the store
+//
+int32_t storeread (int32_t unit,
+		   int32_t block,
+		   uint8_t *buffer)
+{
+    char path[PATH_MAX];
+    uint8_t *hash;
+    int32_t slot;
+    int32_t fd;
+    int32_t status;
+
+    if (sto[unit].fd == -1 || block < 0 || block >= sto[unit].nblocks) return -1;
+
+    hash = sto[unit].index[block];
+
+    if (!memcmp(hash, zerohash, HASHSIZE)) {
+	memset(buffer, 0, BLOCKSIZE);
+	return 0;
+    }
+
+    // a block shared by many units is read from disk only once
+    slot = cacheslot(hash);
+    pthread_mutex_lock(&cachelock);
+    if (cache[slot].valid && !memcmp(cache[slot].hash, hash, HASHSIZE)) {
+	memcpy(buffer, cache[slot].data, BLOCKSIZE);
+	pthread_mutex_unlock(&cachelock);
+	return 0;
+    }
+    pthread_mutex_unlock(&cachelock);
+
+    objpath(path, sto[unit].dir, hash);
+    if ((fd = open(path, O_BINARY|O_RDONLY)) < 0) {
+	error("storeread unit %d block 0x%04X object is missing", unit, block);
+	return -2;
+    }
+    status = pread(fd, buffer, BLOCKSIZE, sizeof(int32_t));
+    close(fd);
+    if (status != BLOCKSIZE) return -3;
+
+    pthread_mutex_lock(&cachelock);
+    memcpy(cache[slot].hash, hash, HASHSIZE);
+    memcpy(cache[slot].data, buffer, BLOCKSIZE);
+    cache[slot].valid = 1;
+    pthread_mutex_unlock(&cachelock);
+
+    return 0;
+}
+
+
+
+//
+// write one block thru the store
+//
+int32_t storewrite (int32_t unit,
+		    int32_t block,
+		    uint8_t *buffer)
+{
+    uint8_t hash[HASHSIZE];
+    uint8_t old[HASHSIZE];
+    int32_t i;
+
+    if (sto[unit].fd == -1 || block < 0 || block >= sto[unit].nblocks) return -1;
+
+    for (i = 0; i < BLOCKSIZE && buffer[i] == 0; i++);
+    if (i == BLOCKSIZE)
+	memset(hash, 0, HASHSIZE);
+    else
+	sha256(buffer, BLOCKSIZE, hash);
+
+    // rewriting the same data changes nothing
+    if (!memcmp(hash, sto[unit].index[block], HASHSIZE)) return 0;
+
+    // reference the new object before dropping the old one
+    if (i != BLOCKSIZE && objref(sto[unit].dir, hash, buffer, +1) < 0) {
+	error("storewrite unit %d cannot store block 0x%04X", unit, block);
+	return -2;
+    }
+
+    if (pwrite(sto[unit].fd, hash, HASHSIZE, sizeof(store_header) + block*HASHSIZE) != HASHSIZE) {
+	if (i != BLOCKSIZE) objref(sto[unit].dir, hash, NULL, -1);
+	return -3;
+    }
+
+    memcpy(old, sto[unit].index[block], HASHSIZE);
+    memcpy(sto[unit].index[block], hash, HASHSIZE);
+    if (memcmp(old, zerohash, HASHSIZE)) objref(sto[unit].dir, old, NULL, -1);
+
+    return 0;
+}
+
+
+
+//
+// remove unreferenced objects from a store
+//
+int32_t storegc (char *dir)
+{
+    char path[PATH_MAX];
+    struct dirent *sub;
+    struct dirent *obj;
+    DIR *dp;
+    DIR *sp;
+    int32_t count;
+    int32_t total = 0;
+    int32_t freed = 0;
+    int32_t fd;
+
+    if ((dp = opendir(dir)) == NULL) { error("storegc cannot open store '%s'", dir); return -1; }
+
+    while ((sub = readdir(dp)) != NULL) {
+	if (strlen(sub->d_name) != 2 || !isxdigit(sub->d_name[0])) continue;
+	snprintf(path, sizeof(path), "%s/%s", dir, sub->d_name);
+	if ((sp = opendir(path)) == NULL) continue;
+	while ((obj = readdir(sp)) != NULL) {
+	    if (strlen(obj->d_name) != 2*HASHSIZE-2) continue;
+	    snprintf(path, sizeof(path), "%s/%s/%s", dir, sub->d_name, obj->d_name);
+	    if ((fd = open(path, O_BINARY|O_RDONLY)) < 0) continue;
+	    total++;
+	    // only unlink while holding the lock objref() takes
+	    flock(fd, LOCK_EX);
+	    if (pread(fd, &count, sizeof(count), 0) == sizeof(count) && count == 0) {
+		unlink(path);
+		freed++;
+	    }
+	    close(fd);
+	}
+	closedir(sp);
+    }
+    closedir(dp);
+
+    info("store '%s' removed %d of %d objects", dir, freed, total);
+    return 0;
+}
+
+
+
+// the end
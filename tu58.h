@@ -99,6 +99,10 @@
 #define TU_CHAR_LEN	24	// size of getchar data packet
 #define TU_BOOT_LEN	512	// size of a boot block
 
+// tape geometry
+
+#define TU_TRACK_RECS	512	// 128 byte records per track
+
 
 
 // Packet format, cmd/end vs data
@@ -49,6 +49,8 @@
 
 #include <pthread.h>
 #include <setjmp.h>
+#include <poll.h>
+#include <errno.h>
 
 #include "tu58.h"
 
@@ -62,22 +64,43 @@ void clock_gettime (int dummy, struct timespec *t) {
     t->tv_sec  = mt / 1000000000;
     t->tv_nsec = mt % 1000000000;
 }
+// nor is clock_nanosleep(), sleep for what is left instead
+#define CLOCK_MONOTONIC CLOCK_REALTIME
+#define TIMER_ABSTIME 1
+int clock_nanosleep (int dummy, int flags, struct timespec *t, struct timespec *r) {
+    struct timespec now;
+    int64_t ns;
+    clock_gettime(CLOCK_REALTIME, &now);
+    ns = (int64_t)(t->tv_sec - now.tv_sec)*1000000000 + t->tv_nsec - now.tv_nsec;
+    if (ns <= 0) return 0;
+    now.tv_sec = ns / 1000000000;
+    now.tv_nsec = ns % 1000000000;
+    return nanosleep(&now, NULL) ? errno : 0;
+}
 #endif // MACOSX
 
 // delays for modeling device access
+//
+// a tape is tracks of TU_TRACK_RECS records of 128 bytes, a 512 byte block
+// being four records. Seeking costs a start plus every record passed at
+// search speed plus every track stepped; reading or writing costs every
+// record passed at streaming speed. Costs are scheduled against absolute
+// deadlines from the start of a command, so line time overlaps tape time
+// and sleeping late once is made up rather than carried into every packet.
 
 static struct {
     uint16_t	nop;	// ms per NOP, STATUS commands
     uint16_t	init;	// ms per INIT command
     uint16_t	test;	// ms per DIAGNOSE command
-    uint16_t	seek;	// ms per SEEK command (s.b. variable)
-    uint16_t	read;	// ms per READ 128B packet command
-    uint16_t	write;	// ms per WRITE 128B packet command
+    uint32_t	start;	// us to get the tape moving for a SEEK, READ, WRITE
+    uint32_t	search;	// us per record passed searching
+    uint32_t	track;	// us per track stepped
+    uint32_t	record;	// us per 128B record read or written
 } tudelay[] = {
-//    nop init test  seek read write
-    {  1,   1,   1,    0,   0,    0 }, // timing=0 infinitely fast...
-    {  1,   1,  25,   25,  25,   25 }, // timing=1 fast enough to fool diagnostic
-    {  1,   1,  25,  200, 100,  100 }, // timing=2 closer to real TU58 behavior
+//    nop init test   start search  track  record
+    {  1,   1,   1,       0,     0,     0,      0 }, // timing=0 infinitely fast...
+    {  1,   1,  25,   25000,     0,     0,  25000 }, // timing=1 fast enough to fool diagnostic
+    {  1,   1,  25,  100000, 55000, 10000, 100000 }, // timing=2 real TU58, 30ips read, 60ips search
 };
 
 // global state
@@ -90,6 +113,35 @@ static uint8_t doinit = 0;	// set nonzero to indicate should send INITs continuo
 static uint8_t runonce = 0;	// set nonzero to indicate emulator has been run
 static pthread_t th_run;	// emulator thread id
 static jmp_buf rx_break_env;    // longjmp state for when a BREAK is detected on rx
+static int32_t held = -1;	// unit held for the command in progress, -1 if none
+static volatile uint8_t key = 0; // console key requested by a control command
+static char conline[CTLLINE]; // console command line
+static int32_t conlen = -1;	// length of console command line, -1 if none started
+static volatile uint8_t request = 0; // 'R' or 'Q' asked of the emulator thread
+static int32_t head[NTU58];	// record under the head of each unit
+static timespec_t due;		// when the modeled drive is done with what it was given
+static int32_t initms = 100;	// ms between INITs sent while waiting for the host
+static int32_t unacked = 0;	// MRSP bytes sent that no CONT has answered yet
+
+#define MRSPWAIT 100		// ms of host silence before unanswered MRSP bytes are written off
+
+// resync timing, from losing the host to answering its <INIT><INIT>
+
+#define INITCHARS 32		// INITs go out this many character times apart
+#define INITMAX 100		// ... but no further apart than this many ms
+
+static uint8_t resyncing = 0;	// set nonzero while waiting for the host to resync
+static timespec_t lost;		// when the wait started
+
+// abort timing, from a BREAK arriving while sending to being idle again
+
+static uint8_t aborting = 0;	// set nonzero while a command is cut short by a BREAK
+static timespec_t broke;	// when the BREAK was seen
+
+// durations kept for the stats
+
+static rt_metric resyncs;	// host resyncs
+static rt_metric aborts;	// commands aborted by a BREAK
 
 
 
@@ -116,15 +168,159 @@ static void delay_ms (int32_t ms)
 
 
 
+//
+// start timing a command on the modeled drive
+//
+static void tapestart (void)
+{
+    // infinitely fast drives need no clock
+    if (!timing) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &due);
+
+    return;
+}
+
+
+
+//
+// wait until the modeled drive has spent us more microseconds on the command
+//
+static void tapewait (uint32_t us)
+{
+    if (!timing || !us) return;
+
+    due.tv_sec += us / 1000000L;
+    due.tv_nsec += (us % 1000000L) * 1000L;
+    if (due.tv_nsec >= 1000000000L) { due.tv_sec++; due.tv_nsec -= 1000000000L; }
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+
+    return;
+}
+
+
+
+//
+// move the head of a unit to a record, taking the modeled seek time
+//
+static void tapeseek (uint8_t unit,
+		      int32_t record)
+{
+    int32_t pass;
+    int32_t step;
+
+    if (timing) {
+	pass = abs(record % TU_TRACK_RECS - head[unit] % TU_TRACK_RECS);
+	step = abs(record / TU_TRACK_RECS - head[unit] / TU_TRACK_RECS);
+	tapewait(tudelay[timing].start + pass*tudelay[timing].search + step*tudelay[timing].track);
+    }
+
+    head[unit] = record;
+
+    return;
+}
+
+
+
+//
+// stream the head of a unit over the records of count bytes
+//
+static void tapemove (uint8_t unit,
+		      int32_t count)
+{
+    int32_t records = (count + TU_DATA_LEN-1) / TU_DATA_LEN;
+
+    head[unit] += records;
+    tapewait(records*tudelay[timing].record);
+
+    return;
+}
+
+
+
+//
+// the record a block of a command starts at
+//
+static inline int32_t taperecord (tu_cmdpkt *pk)
+{
+    return pk->block * ((pk->modifier & TUM_B128) ? 1 : BLOCKSIZE/TU_DATA_LEN);
+}
+
+
+
+//
+// note the host has to resync, unless already waiting for it
+//
+static void resyncstart (void)
+{
+    if (resyncing) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &lost);
+    resyncing = 1;
+
+    return;
+}
+
+
+
+//
+// note the host has resynced, and how long it took
+//
+static void resyncdone (void)
+{
+    uint32_t us;
+
+    if (!resyncing) return;
+    resyncing = 0;
+
+    us = rtmetricadd(&resyncs, &lost);
+    if (verbose) info("host resynced in %u.%03ums", us/1000, us%1000);
+
+    return;
+}
+
+
+
+//
+// report the resyncs completed, their mean, worst and last time in us
+//
+void tu58resync (uint32_t *n,
+		 uint32_t *mean,
+		 uint32_t *worst,
+		 uint32_t *last)
+{
+    rtmetricget(&resyncs, n, mean, worst, last);
+    return;
+}
+
+
+
+//
+// report the commands aborted by a BREAK, their mean, worst and last time
+// in us from the BREAK to being idle
+//
+void tu58abort (uint32_t *n,
+		uint32_t *mean,
+		uint32_t *worst,
+		uint32_t *last)
+{
+    rtmetricget(&aborts, n, mean, worst, last);
+    return;
+}
+
+
+
 //
 // reinitialize TU58 state
 //
 static void reinit (void)
 {
-    // clear all buffers, wait a bit
+    // clear all buffers; anything still arriving is dealt with as it comes
     devrxinit();
     devtxinit();
-    delay_ms(5);
+    resyncstart();
+    unacked = 0;
 
     // init sequence, send immediately
     devtxstart();
@@ -151,12 +347,55 @@ static uint8_t rxget (void)
     // seen a BREAK on the rx line, so abort this packet
     if (state == DEV_BREAK) longjmp(rx_break_env, c);
 
+    // asked to restart or quit, likewise
+    if (state == DEV_STOP) longjmp(rx_break_env, c);
+
     // return the byte
     return c;
 }
 
 
 
+//
+// give up on the command under way if the host sent a BREAK meanwhile
+//
+// the output is already dropped; the characters up to the BREAK are
+// taken and thrown away until rxget() comes to it
+//
+static void rxabort (void)
+{
+    if (!devrxbreak(&broke)) return;
+
+    aborting = 1;
+    if (debug) info("<BREAK> seen while sending, abort");
+    for (;;) rxget();
+}
+
+
+
+//
+// hold a unit so its image cannot be swapped during a command
+//
+static void hold (int32_t unit)
+{
+    if (filehold(unit) == 0) held = unit;
+    return;
+}
+
+
+
+//
+// release the unit held for a command, if any
+//
+static void release (void)
+{
+    if (held >= 0) filerelease(held);
+    held = -1;
+    return;
+}
+
+
+
 //
 // read of boot is not packetized, is just raw data
 //
@@ -168,8 +407,10 @@ static void bootio (void)
 
     // check unit number for validity
     unit = rxget();
+    hold(unit);
     if (fileunit(unit)) {
 	error("bootio bad unit %d", unit);
+	release();
 	return;
     }
 
@@ -178,11 +419,14 @@ static void bootio (void)
     // seek to block zero, should never be an error :-)
     if (fileseek(unit, 0, 0, 0)) {
 	error("boot seek error unit %d", unit);
+	release();
 	return;
     }
 
     // read one block of data
-    if ((count = fileread(unit, buffer, TU_BOOT_LEN)) != TU_BOOT_LEN) {
+    count = fileread(unit, buffer, TU_BOOT_LEN);
+    release();
+    if (count != TU_BOOT_LEN) {
 	error("boot file read error unit %d, expected %d, received %d", unit, TU_BOOT_LEN, count);
 	return;
     }
@@ -242,26 +486,67 @@ static uint16_t checksum (tu_packet *pkt)
 
 
 //
-// wait for a CONT to arrive
+// wait for CONTs until no more than max MRSP bytes are unanswered
+//
+// each CONT answers the oldest byte sent, and nothing more is sent until
+// it comes, however long the host takes. A host silent for MRSPWAIT ms,
+// plus the line time of its answers, is reported once as stalled. The
+// wait ends early only for a BREAK, for an INIT (the host resyncing, the
+// command is abandoned and the main loop takes the rest of <INIT><INIT>)
+// or for a restart or quit
 //
-static void wait4cont (uint8_t code)
+static void mrspwait (int32_t max)
 {
+    int32_t ms;
+    int32_t sts;
     uint8_t c;
-    int32_t maxchar = TU_CTRL_LEN+TU_DATA_LEN+8;
 
-    // send any existing data out ... makes USB serial emulation be real slow if enabled!
-    if (0) devtxflush();
+    if (unacked <= max) return;
 
-    // don't do any waiting if flag not set
-    if (!code) return;
+    // the host can only answer what it has been sent
+    devtxflush();
+    ms = MRSPWAIT + (int64_t)unacked * devcharns() / 1000000;
 
-    // wait for a CONT to arrive, but only so long
-    do {
-	c = rxget();
-	if (debug) info("wait4cont(): char=0x%02X", c);
-    } while (c != TUF_CONT && --maxchar >= 0);
+    while (unacked > max) {
+	if ((sts = devrxwait(ms)) == 0) {
+	    error("MRSP stall, %d bytes unanswered after %dms, still waiting", unacked, ms);
+	    ms = -1;
+	    continue;
+	}
+	// woken to restart or quit
+	if (sts < 0) {
+	    if (request) longjmp(rx_break_env, 0);
+	    continue;
+	}
+	if ((c = rxget()) == TUF_CONT) {
+	    unacked--;
+	} else if (c == TUF_INIT) {
+	    devtxinit();
+	    longjmp(rx_break_env, TUF_INIT);
+	} else if (debug) {
+	    info("mrspwait(): char=0x%02X", c);
+	}
+    }
+
+    return;
+}
+
+
+
+//
+// put a packet byte, under MRSP keeping no more than a window unanswered
+//
+// a full window waits for half of it to be answered, so the bytes go out
+// in bursts while the answers to the ones before are still coming in
+//
+static void txput (uint8_t c)
+{
+    devtxput(c);
+
+    if (!mrsp) return;
+
+    if (++unacked >= mrspwindow) mrspwait(mrspwindow/2);
 
-    // all done
     return;
 }
 
@@ -276,18 +561,16 @@ static void putpacket (tu_packet *pkt)
     uint8_t *ptr = (uint8_t *)pkt; // start at flag byte
     uint16_t chksum;
 
+    // the host has its answer
+    rtanswer();
+
     // send all packet bytes
-    while (--count >= 0) {
-	devtxput(*ptr++);
-	wait4cont(mrsp);
-    }
+    while (--count >= 0) txput(*ptr++);
 
     // compute/send checksum bytes, append to packet
     chksum = checksum(pkt);
-    devtxput(*ptr++ = chksum>>0);
-    wait4cont(mrsp);
-    devtxput(*ptr++ = chksum>>8);
-    wait4cont(mrsp);
+    txput(*ptr++ = chksum>>0);
+    txput(*ptr++ = chksum>>8);
     
     // for debug...
     if (debug) dumppacket(pkt, "putpacket");
@@ -295,6 +578,9 @@ static void putpacket (tu_packet *pkt)
     // now actually send the packet (or whatever is left to send)
     devtxflush();
 
+    // stop here if the host has given up on the command
+    rxabort();
+
     return;
 }
 
@@ -348,6 +634,7 @@ static void endpacket (uint8_t unit,
 
     putpacket((tu_packet *)&ek);
     devtxflush(); // finish packet transmit
+    mrspwait(0); // and have all of it answered under MRSP
 
     return;
 }
@@ -384,7 +671,7 @@ static void tuseek (tu_cmdpkt *pk)
     }
 
     // fake a seek time
-    delay_ms(tudelay[timing].seek);
+    tapeseek(pk->unit, taperecord(pk));
 
     // success if we get here
     endpacket(pk->unit, TUE_SUCC, 0, 0);
@@ -400,6 +687,7 @@ static void tuseek (tu_cmdpkt *pk)
 static void turead (tu_cmdpkt *pk)
 {
     int32_t count;
+    int32_t status;
     tu_datpkt dk;
 
     // check unit number for validity
@@ -423,21 +711,34 @@ static void turead (tu_cmdpkt *pk)
 	return;
     }
 
+    // stage what the host is likely to read next
+    fileahead(pk->unit, pk->count);
+
     // fake a seek time
-    delay_ms(tudelay[timing].seek);
+    tapeseek(pk->unit, taperecord(pk));
 
     // send data in packets until we run out
     for (count = pk->count; count > 0; count -= dk.length) {
 
+	// a restart or quit does not wait for the rest of a long read, nor does a BREAK
+	if (request) longjmp(rx_break_env, 0);
+	rxabort();
+
 	// max bytes to send at once is TU_DATA_LEN
 	dk.flag = TUF_DATA;
 	dk.length = count < TU_DATA_LEN ? count : TU_DATA_LEN;
 
-	if (fileread(pk->unit, dk.data, dk.length) == dk.length) {
+	if ((status = fileread(pk->unit, dk.data, dk.length)) == dk.length) {
 	    // successful file read, send packet
 	    putpacket((tu_packet *)&dk);
 	    // fake a read time
-	    delay_ms(tudelay[timing].read);
+	    tapemove(pk->unit, dk.length);
+	} else if (status == -4) {
+	    // data failed its CRC check, don't send it
+	    error("turead unit %d data check error block 0x%04X count 0x%04X",
+		  pk->unit, pk->block, pk->count);
+	    endpacket(pk->unit, TUE_DERR, pk->count-count, 0);
+	    return;
 	} else {
 	    // whoops, something bad happened
 	    error("turead unit %d data error block 0x%04X count 0x%04X",
@@ -486,12 +787,13 @@ static void tuwrite (tu_cmdpkt *pk)
     }
 
     // fake a seek time
-    delay_ms(tudelay[timing].seek);
+    tapeseek(pk->unit, taperecord(pk));
 
     // keep looping if more data is expected
     for (count = pk->count; count > 0; count -= dk.length) {
 
 	// send continue flag; we are ready for more data
+	rtanswer();
 	devtxput(TUF_CONT);
 	devtxflush();
 	if (debug) info("sending <CONT>");
@@ -551,7 +853,7 @@ static void tuwrite (tu_cmdpkt *pk)
 	}
 
 	// fake a write time
-	delay_ms(tudelay[timing].write);
+	tapemove(pk->unit, dk.length);
     }
 
     // must fill out last block with zeros
@@ -567,7 +869,15 @@ static void tuwrite (tu_cmdpkt *pk)
 	    return;
 	}
 	// fake a write time
-	delay_ms(tudelay[timing].write);
+	tapemove(pk->unit, count);
+    }
+
+    // data must be in the image before we report success
+    if (fileflush(pk->unit)) {
+	error("tuwrite unit %d data error block 0x%04X count 0x%04X",
+	      pk->unit, pk->block, pk->count);
+	endpacket(pk->unit, TUE_PARO, pk->count, 0);
+	return;
     }
 
     // success if we get here
@@ -605,6 +915,9 @@ static void command (int8_t flag)
 	return;
     }
 
+    // the host is waiting for an answer from here on
+    rtcommand();
+
     // check packet checksum ... if bad error it
     if (getpacket((tu_packet *)&pk)) {
 	error("cmd checksum error");
@@ -657,19 +970,28 @@ static void command (int8_t flag)
     // if we are MRSP capable, look at the switches
     if (mrspen) mrsp = (pk.switches & TUS_MRSP) ? 1 : 0;
 
+    // the modeled drive starts on the command as soon as it arrives
+    tapestart();
+
     // decode packet
     switch (pk.opcode) {
 
     case TUO_READ: // read data from tu58
+	hold(pk.unit);
 	turead(&pk);
+	release();
 	break;
 
     case TUO_WRITE: // write data to tu58
+	hold(pk.unit);
 	tuwrite(&pk);
+	release();
 	break;
 
     case TUO_SEEK: // reposition tu58
+	hold(pk.unit);
 	tuseek(&pk);
+	release();
 	break;
 
     case TUO_DIAGNOSE: // diagnose packet
@@ -740,8 +1062,19 @@ static void command (int8_t flag)
 //
 static void* run (void* none)
 {
-    uint8_t flag = TUF_NULL;
+    volatile uint8_t flag = TUF_NULL; // kept across a longjmp
     uint8_t last = TUF_NULL;
+    int32_t sts;
+
+    // real-time scheduling if asked
+    rtrun();
+
+    // INITs a few character times apart, so the host hears one soon after it starts listening
+    if (devcharns()) {
+	initms = (int64_t)devcharns() * INITCHARS / 1000000;
+	if (initms < 1) initms = 1;
+	if (initms > INITMAX) initms = INITMAX;
+    }
 
     // some init
     reinit(); // empty serial line buffers
@@ -754,26 +1087,53 @@ static void* run (void* none)
     for (;;) {
 
         // setup for when a BREAK is detected
-        if (setjmp(rx_break_env)) {
+        if ((sts = setjmp(rx_break_env))) {
             // return here when we get a BREAK on the rx input
-            if (debug) info("<BREAK> seen");
+            if (sts == TUF_INIT) {
+                // or an INIT while waiting for MRSP CONTs, the first of a pair
+                if (debug) info("<INIT> seen, abort");
+                flag = TUF_INIT;
+            } else if (debug && !request) {
+                info("<BREAK> seen");
+            }
+            // the host resyncs after a BREAK
+            if (!request) resyncstart();
+            // a command cut short keeps what it wrote, lets go of its unit
+            if (held >= 0) fileflush(held);
+            release();
+            unacked = 0;
+            // how long from the BREAK until ready for the host again
+            if (aborting) {
+                uint32_t us = rtmetricadd(&aborts, &broke);
+                aborting = 0;
+                if (verbose) info("command aborted by <BREAK> in %uus", us);
+            }
             // fall thru to main loop
         }
 
-	// loop while no characters are available
-	while (devrxavail() == 0) {
-	    // delays and printout only if not VAX
-	    if (!vax) {
-		// send INITs if still required
-		if (doinit) {
-		    if (debug) fprintf(stderr, ".");
-		    devtxput(TUF_INIT);
-		    devtxflush();
-		    delay_ms(75);
-		}
-		delay_ms(25);
+	// restart or quit asked for by the console
+	if (request == 'Q') break;
+	if (request == 'R') {
+	    request = 0;
+	    reinit();
+	    doinit = !nosync;
+	    info("TU58 emulator %sstarted", runonce++ ? "re" : "");
+	}
+
+	// wait while no characters are available, or until asked to stop;
+	// a character ends the wait the moment it arrives
+	while (devrxavail() == 0 && !request) {
+	    // send INITs if still required, not for VAX
+	    if (doinit && !vax) {
+		if (debug) fprintf(stderr, ".");
+		devtxput(TUF_INIT);
+		devtxflush();
+		devrxwait(initms);
+	    } else {
+		devrxwait(-1);
 	    }
 	}
+	if (request) continue;
 	doinit = 0; // quit sending init flags
 
 	// process received characters
@@ -796,6 +1156,7 @@ static void* run (void* none)
 		if (!vax) delay_ms(tudelay[timing].init); // no delay for VAX
 		devtxput(TUF_CONT); // send 'continue'
 		devtxflush(); // send immediate
+		resyncdone();
 		flag = -1; // undefined
 		if (debug) info("<INIT><INIT> seen, sending <CONT>");
 	    }
@@ -844,62 +1205,142 @@ static void* run (void* none)
 
 
 
+//
+// act on a console key, returns 1 once it is time to quit
+//
+static int32_t conkey (uint8_t c)
+{
+    if (c == ':') {
+	// start a control command line
+	fprintf(stderr, ":");
+	conlen = 0;
+    } else if (c == 'V') {
+	// toggle verbosity
+	verbose ^= 1;  debug = 0;
+	info("verbosity set to %s; debug %s",
+	     verbose ? "ON" : "OFF", debug ? "ON" : "OFF");
+    } else if (c == 'D') {
+	// toggle debug
+	verbose = 1;  debug ^= 1;
+	info("verbosity set to %s; debug %s",
+	     verbose ? "ON" : "OFF", debug ? "ON" : "OFF");
+    } else if (c == 'S') {
+	// toggle sending init string, the emulator looks again at once
+	doinit = (doinit+1)%2;
+	devwake();
+	if (debug) fprintf(stderr, "\n");
+	info("send of <INIT> %sabled", doinit ? "en" : "dis");
+    } else if (c == 'A') {
+	// show read-ahead counters
+	for (int32_t unit = 0; unit < NTU58; unit++) fileaheadstats(unit);
+    } else if (c == 'R' || c == 'Q') {
+	// have the emulator restart, or stop so we can exit, when it next
+	// waits for the line; any command under way is cut short there
+	request = c;
+	devwake();
+	if (c == 'Q') return 1;
+    }
+
+    return 0;
+}
+
+
+
+//
+// act on a character typed at the console, returns 1 once it is time to quit
+//
+static int32_t conchar (int32_t k)
+{
+    // a key, unless a command line was started by ':'
+    if (conlen < 0) return conkey(toupper(k));
+
+    // collect the command line
+    if (k == '\r' || k == '\n') {
+	fprintf(stderr, "\n");
+	conline[conlen] = '\0';
+	ctlexec(conline, fileno(stderr));
+	conlen = -1;
+    } else if ((k == '\b' || k == 0x7F) && conlen > 0) {
+	fprintf(stderr, "\b \b");
+	conlen--;
+    } else if (isprint(k) && conlen < sizeof(conline)-1) {
+	fprintf(stderr, "%c", k);
+	conline[conlen++] = k;
+    }
+
+    return 0;
+}
+
+
+
 //
 // start tu58 drive emulation
 //
+// the console loop sleeps in poll() until the console, the control
+// socket or a quit signal needs it; in background mode the console is
+// simply left out of the wait
+//
 void tu58drive (void)
 {
+    uint8_t console = !background; // console is read until it goes away
+
     // a sanity check for blocksize definition
     if (BLOCKSIZE % TU_DATA_LEN != 0)
 	fatal("illegal BLOCKSIZE (%d) / TU_DATA_LEN (%d) ratio", BLOCKSIZE, TU_DATA_LEN);
 
     // say hello
     info("TU58 start");
-    info("R restart, S toggle send init, V toggle verbose, D toggle debug, Q quit");
+    info("R restart, S toggle send init, V toggle verbose, D toggle debug, A read-ahead stats, : command, Q quit");
 
     // run the emulator
     if (pthread_create(&th_run, NULL, run, NULL))
 	error("unable to create emulation thread");
 
-    // loop on user input
+    // loop on console, control socket and signal events
     for (;;) {
-	uint8_t c;
-
-	// get char from stdin (if available)
-	if ((c = toupper(conget())) > 0) {
-	    if (c == 'V') {
-		// toggle verbosity
-		verbose ^= 1;  debug = 0;
-		info("verbosity set to %s; debug %s",
-		     verbose ? "ON" : "OFF", debug ? "ON" : "OFF");
-	    } else if (c == 'D') {
-		// toggle debug
-		verbose = 1;  debug ^= 1;
-		info("verbosity set to %s; debug %s",
-		     verbose ? "ON" : "OFF", debug ? "ON" : "OFF");
-	    } else if (c == 'S') {
-		// toggle sending init string
-		doinit = (doinit+1)%2;
-		if (debug) fprintf(stderr, "\n");
-		info("send of <INIT> %sabled", doinit ? "en" : "dis");
-	    } else if (c == 'R') {
-		// kill and restart the emulator
-		if (pthread_cancel(th_run))
-		    error("unable to cancel emulation thread");
-		if (pthread_join(th_run, NULL))
-		    error("unable to join on emulation thread");
-		if (pthread_create(&th_run, NULL, run, NULL))
-		    error("unable to restart emulation thread");
-	    } else if (c == 'Q') {
-		// kill the emulator and exit
-		if (pthread_cancel(th_run))
-		    error("unable to cancel emulation thread");
-		break;
-	    }
+	struct pollfd fds[CTLCLIENTS+3];
+	int32_t con = -1, ctl = -1, sig = -1;
+	int32_t nctl = 0;
+	int32_t n = 0;
+	int32_t k;
+
+	// a key requested by a control command acts as if typed
+	if (key) {
+	    k = key;
+	    key = 0;
+	    if (conkey(k)) break;
+	    continue;
 	}
 
-	// wait a bit
-	delay_ms(25);
+	// wait for any of them
+	if (console) {
+	    fds[con = n++] = (struct pollfd){ .fd = fileno(stdin), .events = POLLIN };
+	}
+	if ((nctl = ctlpoll(&fds[n])) > 0) {
+	    ctl = n;
+	    n += nctl;
+	}
+	if (consigfd() >= 0) {
+	    fds[sig = n++] = (struct pollfd){ .fd = consigfd(), .events = POLLIN };
+	}
+	if (poll(fds, n, -1) <= 0) continue;
+
+	// a quit signal quits as Q does
+	if (sig >= 0 && fds[sig].revents && (k = consigget()) > 0) {
+	    info("signal %d seen, quitting", k);
+	    conkey('Q');
+	    break;
+	}
+
+	// control socket clients and connections
+	if (ctl >= 0) ctlevent(&fds[ctl], nctl);
+
+	// everything typed so far
+	if (con >= 0 && fds[con].revents) {
+	    while ((k = conget()) >= 0 && !conchar(k));
+	    if (k >= 0) break;
+	    if (k == -2) console = 0;
+	}
 
     } // for (;;)
 
@@ -914,4 +1355,15 @@ void tu58drive (void)
 
 
 
+//
+// act on a console key from a control command, once the console loop is back
+//
+void tu58key (uint8_t c)
+{
+    key = c;
+    return;
+}
+
+
+
 // the end
@@ -0,0 +1,460 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Image toolkit
+//
+// tu58fs builds and takes apart RT-11 and XXDP tape images offline, so a
+// set of tapes can be staged in a moment instead of copied file by file
+// over the serial line with PIP. An image is mapped into memory and worked
+// on there; it is only ever a plain image file, not a sparse container or
+// a block store index.
+//
+
+
+
+#include "common.h"
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+static char version[] = "tu58 image toolkit v1.0";
+
+#define FS_RT11		1	// RT-11 volume
+#define FS_XXDP		2	// XXDP volume
+
+#define FSFILES		2048	// most files listed from a volume
+
+static char *outdir = "."; // directory extract writes to
+static int32_t fsblocks = TAPESIZE; // number of blocks in new images
+
+
+
+//
+// print an error message and return
+//
+void error (char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "ERROR: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    return;
+}
+
+
+
+//
+// print an error message and die
+//
+void fatal (char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "FATAL: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+
+
+//
+// map an image into memory, creating it if nblocks is nonzero
+//
+// an existing image is opened for writing only if write is nonzero, so
+// reading a read-only image works
+//
+static uint8_t *imgmap (char *name,
+			int32_t *nblocks,
+			int32_t write)
+{
+    struct stat st;
+    uint8_t *image;
+    int32_t fd;
+
+    if (*nblocks) {
+	if ((fd = open(name, O_BINARY|O_RDWR|O_CREAT|O_TRUNC, 0666)) < 0
+	    || ftruncate(fd, (off_t)*nblocks*BLOCKSIZE))
+	    fatal("cannot create image '%s'", name);
+    } else {
+	if ((fd = open(name, O_BINARY|(write ? O_RDWR : O_RDONLY))) < 0 || fstat(fd, &st))
+	    fatal("cannot open image '%s'", name);
+	*nblocks = st.st_size / BLOCKSIZE;
+	if (*nblocks == 0) fatal("image '%s' is empty", name);
+    }
+
+    image = mmap(NULL, (size_t)*nblocks*BLOCKSIZE, PROT_READ|(write ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) fatal("cannot map image '%s'", name);
+
+    return image;
+}
+
+
+
+//
+// read a whole host file into memory
+//
+static uint8_t *hostread (char *path,
+			  int32_t *size)
+{
+    struct stat st;
+    uint8_t *data;
+    int32_t fd;
+
+    if ((fd = open(path, O_BINARY|O_RDONLY)) < 0 || fstat(fd, &st)) {
+	error("cannot open '%s'", path);
+	return NULL;
+    }
+    if (st.st_size > (off_t)TAPEMAX*BLOCKSIZE || (data = malloc(st.st_size+1)) == NULL) {
+	error("'%s' is too big for a tape", path);
+	close(fd);
+	return NULL;
+    }
+    if (read(fd, data, st.st_size) != st.st_size) {
+	error("cannot read '%s'", path);
+	close(fd);
+	free(data);
+	return NULL;
+    }
+    close(fd);
+
+    *size = st.st_size;
+    return data;
+}
+
+
+
+//
+// volume name of a host file, from the last part of its path
+//
+static int32_t volname (char *path,
+			char *name)
+{
+    char *base = strrchr(path, '/');
+
+    if (rt11name(base ? base+1 : path, name)) {
+	error("'%s' has no NAME.EXT form", path);
+	return -1;
+    }
+    return 0;
+}
+
+
+
+//
+// which kind of volume an image holds
+//
+static int32_t fstype (uint8_t *image,
+		       int32_t nblocks)
+{
+    // the home block carries the RT-11 system id
+    if (nblocks > 6 && !memcmp(image + 01760, "DECRT11A", 8) && rt11list(image, nblocks, NULL, 0) >= 0)
+	return FS_RT11;
+    if (xxdpdir(image, nblocks, NULL, 0) >= 0)
+	return FS_XXDP;
+
+    return 0;
+}
+
+
+
+//
+// add host files to a volume
+//
+static int32_t fsinsert (uint8_t *image,
+			 int32_t nblocks,
+			 int32_t type,
+			 int32_t nfiles,
+			 char *paths[])
+{
+    struct stat st;
+    uint8_t *data;
+    char name[11];
+    int32_t errors = 0;
+    int32_t status;
+    int32_t size;
+    int32_t i;
+
+    for (i = 0; i < nfiles; i++) {
+	if (volname(paths[i], name) || (data = hostread(paths[i], &size)) == NULL) { errors++; continue; }
+	stat(paths[i], &st);
+	if (type == FS_RT11)
+	    status = rt11add(image, nblocks, name, data, size, rt11date(st.st_mtime));
+	else
+	    status = xxdpadd(image, nblocks, name, data, size, xxdpdate(st.st_mtime));
+	free(data);
+	if (status) {
+	    error("cannot add '%s': %s", paths[i],
+		  status == -2 ? "not enough room" : status == -3 ? "directory full" : "bad directory");
+	    errors++;
+	}
+    }
+
+    return errors;
+}
+
+
+
+//
+// create a volume, laying out any host files given one after another
+//
+static int32_t fscreate (char *kind,
+			 char *image_name,
+			 int32_t nfiles,
+			 char *paths[])
+{
+    struct stat st;
+    vol_file *list;
+    uint8_t *image;
+    uint8_t *data;
+    int32_t nblocks = fsblocks;
+    int32_t segments;
+    int32_t errors = 0;
+    int32_t size;
+    int32_t i;
+
+    if (!strcmp(kind, "xxdp")) {
+	image = imgmap(image_name, &nblocks, 1);
+	if (xxdpformat(image, nblocks)) fatal("cannot init XXDP volume '%s'", image_name);
+	errors = fsinsert(image, nblocks, FS_XXDP, nfiles, paths);
+	munmap(image, (size_t)nblocks*BLOCKSIZE);
+	return errors;
+    }
+
+    if (strcmp(kind, "rt11")) fatal("volume kind must be rt11 or xxdp, not '%s'", kind);
+
+    // the directory is laid out in one go, sized as INIT would size it
+    if ((list = calloc(nfiles+1, sizeof(vol_file))) == NULL) fatal("out of memory");
+    for (i = 0; i < nfiles; i++) {
+	if (volname(paths[i], list[i].name) || stat(paths[i], &st)) fatal("cannot add '%s'", paths[i]);
+	list[i].length = (st.st_size+BLOCKSIZE-1)/BLOCKSIZE;
+	list[i].date = rt11date(st.st_mtime);
+    }
+    segments = rt11_segments(nblocks);
+    if (nblocks > RT11MAX) fatal("an RT-11 volume has at most %d blocks", RT11MAX);
+    while (nfiles > rt11_capacity(segments) && segments < rt11_segments(RT11MAX)) segments++;
+
+    image = imgmap(image_name, &nblocks, 1);
+    if (rt11format(image, nblocks, segments, list, nfiles))
+	fatal("files do not fit a %d block RT-11 volume '%s'", nblocks, image_name);
+
+    for (i = 0; i < nfiles; i++) {
+	if ((data = hostread(paths[i], &size)) == NULL) { errors++; continue; }
+	if (size > list[i].length*BLOCKSIZE) size = list[i].length*BLOCKSIZE;
+	memcpy(image + list[i].start*BLOCKSIZE, data, size);
+	free(data);
+    }
+
+    free(list);
+    munmap(image, (size_t)nblocks*BLOCKSIZE);
+    return errors;
+}
+
+
+
+//
+// list the files of a volume
+//
+static void fslist (uint8_t *image,
+		    int32_t nblocks,
+		    int32_t type)
+{
+    vol_file list[FSFILES];
+    int32_t nfiles;
+    int32_t used = 0;
+    int32_t i;
+
+    if (type == FS_RT11)
+	nfiles = rt11list(image, nblocks, list, FSFILES);
+    else
+	nfiles = xxdpdir(image, nblocks, list, FSFILES);
+
+    for (i = 0; i < nfiles; i++) {
+	printf("%-10s %6d blocks at %6d\n", list[i].name, list[i].length, list[i].start);
+	used += list[i].length;
+    }
+    printf("%d files in %d blocks, %s volume of %d blocks\n",
+	   nfiles, used, type == FS_RT11 ? "RT-11" : "XXDP", nblocks);
+    return;
+}
+
+
+
+//
+// copy files out of a volume, all of them if no names are given
+//
+static int32_t fsextract (uint8_t *image,
+			  int32_t nblocks,
+			  int32_t type,
+			  int32_t nnames,
+			  char *names[])
+{
+    vol_file list[FSFILES];
+    char path[CTLLINE*2];
+    char host[11];
+    char name[11];
+    uint8_t *data;
+    int32_t errors = 0;
+    int32_t nfiles;
+    int32_t size;
+    int32_t fd;
+    int32_t i;
+    int32_t j;
+
+    if (type == FS_RT11)
+	nfiles = rt11list(image, nblocks, list, FSFILES);
+    else
+	nfiles = xxdpdir(image, nblocks, list, FSFILES);
+
+    for (i = 0; i < nfiles; i++) {
+
+	// only the files asked for
+	for (j = 0; j < nnames; j++)
+	    if (!rt11name(names[j], name) && !strcmp(name, list[i].name)) break;
+	if (nnames && j == nnames) continue;
+
+	if (type == FS_RT11) {
+	    if (list[i].start + list[i].length > nblocks) { error("'%s' runs off the volume", list[i].name); errors++; continue; }
+	    data = image + list[i].start*BLOCKSIZE;
+	    size = list[i].length*BLOCKSIZE;
+	} else {
+	    if ((data = malloc(list[i].length*BLOCKSIZE)) == NULL) fatal("out of memory");
+	    if ((size = xxdpread(image, nblocks, &list[i], data)) < 0) {
+		error("'%s' has a broken block chain", list[i].name);
+		free(data);
+		errors++;
+		continue;
+	    }
+	}
+
+	rt11host(list[i].name, host);
+	snprintf(path, sizeof(path), "%s/%s", outdir, host);
+	if ((fd = open(path, O_BINARY|O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0
+	    || write(fd, data, size) != size || close(fd)) {
+	    error("cannot write '%s'", path);
+	    errors++;
+	}
+
+	if (type == FS_XXDP) free(data);
+    }
+
+    return errors;
+}
+
+
+
+//
+// main program
+//
+int main (int argc,
+	  char *argv[])
+{
+    uint8_t *image;
+    int32_t nblocks = 0;
+    int32_t errors = 0;
+    int32_t type;
+    long i;
+
+    // switch options
+    int opt_index = 0;
+    char opt_short[] = "VC:";
+    static struct option opt_long[] = {
+	{ "version",	no_argument,       NULL, 'V' },
+	{ "blocks",	required_argument, NULL, -2  },
+	{ "dir",	required_argument, NULL, 'C' },
+	{ NULL,		no_argument,       NULL, 0   }
+    };
+
+    // process command line options
+    while ((i = getopt_long(argc, argv, opt_short, opt_long, &opt_index)) != -1) {
+	switch (i) {
+	case -2 :  fsblocks = atoi(optarg); if (fsblocks < TAPEMIN || fsblocks > TAPEMAX) errors++; break;
+	case 'C':  outdir = optarg;  break;
+	case 'V':  fprintf(stderr, "%s\n", version);  break;
+	default:   errors++; break;
+	}
+    }
+    argc -= optind;
+    argv += optind;
+
+    // any error seen, die and print out some help
+    if (errors || argc < 2
+	|| (!strcmp(argv[0], "create") && argc < 3)
+	|| (strcmp(argv[0], "create") && strcmp(argv[0], "list")
+	    && strcmp(argv[0], "extract") && strcmp(argv[0], "insert")))
+	fatal("illegal command line\n" \
+	      "  %s\n" \
+	      "  Usage: tu58fs [-options] create rt11|xxdp IMAGE [FILE ...]\n" \
+	      "         tu58fs [-options] list IMAGE\n" \
+	      "         tu58fs [-options] extract IMAGE [NAME ...]\n" \
+	      "         tu58fs [-options] insert IMAGE FILE ...\n" \
+	      "  Options: -V | --version            output version string\n" \
+	      "                --blocks N           make new images N blocks long (%d..%d, default %d)\n" \
+	      "           -C | --dir DIR            extract files into DIR; default .\n",
+	      version, TAPEMIN, TAPEMAX, TAPESIZE);
+
+    if (!strcmp(argv[0], "create"))
+	return fscreate(argv[1], argv[2], argc-3, argv+3) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    // only insert writes to the image
+    image = imgmap(argv[1], &nblocks, !strcmp(argv[0], "insert"));
+    if ((type = fstype(image, nblocks)) == 0) fatal("'%s' is not an RT-11 or XXDP volume", argv[1]);
+
+    if (!strcmp(argv[0], "list"))
+	fslist(image, nblocks, type);
+    else if (!strcmp(argv[0], "extract"))
+	errors = fsextract(image, nblocks, type, argc-2, argv+2);
+    else
+	errors = fsinsert(image, nblocks, type, argc-2, argv+2);
+
+    munmap(image, (size_t)nblocks*BLOCKSIZE);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+
+// the end
@@ -0,0 +1,497 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Block server
+//
+// tu58nbd serves tape images to NBD clients, so tu58em can take its tapes
+// from another machine. Each image is exported under its file name without
+// the directory; an empty export name picks the first image. It speaks
+// only the part of the protocol tu58em uses: the fixed newstyle handshake
+// ending with EXPORT_NAME, and READ, WRITE, FLUSH and DISC requests
+// answered with simple replies. Each client is served by its own thread.
+//
+
+
+
+#include "common.h"
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+static char version[] = "tu58 block server v1.0";
+
+#define NBD_MAGIC		0x4e42444d41474943ULL	// "NBDMAGIC"
+#define NBD_OPTMAGIC		0x49484156454F5054ULL	// "IHAVEOPT"
+#define NBD_REPOPT		0x3e889045565a9ULL	// option reply
+#define NBD_REQMAGIC		0x25609513		// request
+#define NBD_REPMAGIC		0x67446698		// simple reply
+
+#define NBD_FLAG_FIXED		0x0001	// handshake: fixed newstyle
+#define NBD_FLAG_NOZEROES	0x0002	// handshake: no padding after export info
+#define NBD_FLAG_HASFLAGS	0x0001	// transmission: flags are valid
+#define NBD_FLAG_READONLY	0x0002	// transmission: export is read only
+#define NBD_FLAG_FLUSH		0x0004	// transmission: FLUSH is taken
+
+#define NBD_OPT_EXPORTNAME	1	// select export, ends the handshake
+#define NBD_OPT_ABORT		2	// client gives up
+#define NBD_REP_ACK		1	// option done
+#define NBD_REP_ERR_UNSUP	0x80000001	// option not known
+
+#define NBD_CMD_READ		0
+#define NBD_CMD_WRITE		1
+#define NBD_CMD_DISC		2
+#define NBD_CMD_FLUSH		3
+
+#define NBD_EPERM		1
+#define NBD_EIO			5
+#define NBD_EINVAL		22
+
+#define NBDIMAGES		64	// most images served
+
+static struct {
+    char	*path;		// image file
+    char	*name;		// export name
+    int32_t	fd;		// open image
+    int64_t	size;		// bytes in the image
+} image [NBDIMAGES];
+
+static int32_t nimages = 0;	// images served
+static uint8_t readonly = 0;	// refuse writes
+static uint8_t logging = 0;	// log clients
+
+
+
+//
+// print an error message and return
+//
+void error (char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "ERROR: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    return;
+}
+
+
+
+//
+// print an error message and die
+//
+void fatal (char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "FATAL: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+
+
+//
+// 64 bit big endian conversion
+//
+static uint64_t be64 (uint64_t x)
+{
+    uint32_t one = 1;
+
+    if (*(uint8_t *)&one == 0) return x;
+    return ((uint64_t)htonl(x & 0xFFFFFFFF) << 32) | htonl(x >> 32);
+}
+
+
+
+//
+// read exactly count bytes from a socket
+//
+static int32_t readall (int32_t fd,
+			void *buffer,
+			int32_t count)
+{
+    int32_t done = 0;
+    int32_t n;
+
+    while (done < count) {
+	if ((n = read(fd, (uint8_t *)buffer+done, count-done)) <= 0) return -1;
+	done += n;
+    }
+    return 0;
+}
+
+
+
+//
+// write exactly count bytes to a socket
+//
+static int32_t writeall (int32_t fd,
+			 void *buffer,
+			 int32_t count)
+{
+    int32_t done = 0;
+    int32_t n;
+
+    while (done < count) {
+	if ((n = write(fd, (uint8_t *)buffer+done, count-done)) <= 0) return -1;
+	done += n;
+    }
+    return 0;
+}
+
+
+
+//
+// answer an option other than EXPORT_NAME
+//
+static int32_t optreply (int32_t fd,
+			 uint32_t opt,
+			 uint32_t type)
+{
+    struct {
+	uint64_t magic;
+	uint32_t opt;
+	uint32_t type;
+	uint32_t length;
+    } __attribute__((packed)) rep;
+
+    rep.magic = be64(NBD_REPOPT);
+    rep.opt = htonl(opt);
+    rep.type = htonl(type);
+    rep.length = 0;
+    return writeall(fd, &rep, sizeof(rep));
+}
+
+
+
+//
+// newstyle handshake, returns the image picked by the client or -1
+//
+static int32_t handshake (int32_t fd)
+{
+    uint8_t zeroes[124];
+    char name[CTLLINE];
+    uint64_t magic;
+    uint32_t cflags;
+    uint32_t opt[2];
+    uint16_t hflags;
+    uint16_t tflags;
+    uint64_t size;
+    int32_t i;
+
+    magic = be64(NBD_MAGIC);
+    if (writeall(fd, &magic, 8)) return -1;
+    magic = be64(NBD_OPTMAGIC);
+    hflags = htons(NBD_FLAG_FIXED | NBD_FLAG_NOZEROES);
+    if (writeall(fd, &magic, 8) || writeall(fd, &hflags, 2)) return -1;
+    if (readall(fd, &cflags, 4)) return -1;
+    cflags = ntohl(cflags);
+
+    for (;;) {
+	if (readall(fd, &magic, 8) || be64(magic) != NBD_OPTMAGIC || readall(fd, opt, 8)) return -1;
+	opt[0] = ntohl(opt[0]);
+	opt[1] = ntohl(opt[1]);
+
+	// option data we do not want is skipped
+	if (opt[0] != NBD_OPT_EXPORTNAME) {
+	    for (i = opt[1]; i > 0; i -= sizeof(zeroes))
+		if (readall(fd, zeroes, i < sizeof(zeroes) ? i : sizeof(zeroes))) return -1;
+	    if (opt[0] == NBD_OPT_ABORT) { optreply(fd, opt[0], NBD_REP_ACK); return -1; }
+	    if (optreply(fd, opt[0], NBD_REP_ERR_UNSUP)) return -1;
+	    continue;
+	}
+
+	if (opt[1] >= sizeof(name) || readall(fd, name, opt[1])) return -1;
+	name[opt[1]] = '\0';
+	break;
+    }
+
+    // an export we do not have ends the connection
+    for (i = 0; i < nimages; i++) if (!strcmp(name, image[i].name)) break;
+    if (name[0] == '\0') i = 0;
+    if (i == nimages) {
+	error("client asked for unknown export '%s'", name);
+	return -1;
+    }
+
+    size = be64(image[i].size);
+    tflags = htons(NBD_FLAG_HASFLAGS | NBD_FLAG_FLUSH | (readonly ? NBD_FLAG_READONLY : 0));
+    memset(zeroes, 0, sizeof(zeroes));
+    if (writeall(fd, &size, 8) || writeall(fd, &tflags, 2)) return -1;
+    if (!(cflags & NBD_FLAG_NOZEROES) && writeall(fd, zeroes, sizeof(zeroes))) return -1;
+
+    return i;
+}
+
+
+
+//
+// serve one client until it disconnects
+//
+static void *client (void *arg)
+{
+    int32_t fd = (intptr_t)arg;
+    struct {
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;
+	uint64_t offset;
+	uint32_t length;
+    } __attribute__((packed)) req;
+    struct {
+	uint32_t magic;
+	uint32_t error;
+	uint64_t handle;
+    } __attribute__((packed)) rep;
+    uint8_t *buffer = NULL;
+    uint32_t length;
+    uint64_t offset;
+    int32_t drop;
+    int32_t err;
+    int32_t i;
+
+    if ((i = handshake(fd)) < 0) { close(fd); return NULL; }
+    if (logging) fprintf(stderr, "client connected to '%s'\n", image[i].name);
+
+    while (readall(fd, &req, sizeof(req)) == 0 && ntohl(req.magic) == NBD_REQMAGIC) {
+	if (ntohs(req.type) == NBD_CMD_DISC) break;
+
+	offset = be64(req.offset);
+	length = ntohl(req.length);
+	err = 0;
+	drop = 0;
+
+	if ((ntohs(req.type) == NBD_CMD_READ || ntohs(req.type) == NBD_CMD_WRITE)
+	    && (length > TAPEMAX*BLOCKSIZE || offset+length > image[i].size)) {
+	    // a write with a bad range still sends its data, which is read and
+	    // thrown away; one too big to take is answered, then the client is
+	    // dropped, as its data would be taken for the next request
+	    err = NBD_EINVAL;
+	    if (ntohs(req.type) == NBD_CMD_WRITE && length > TAPEMAX*BLOCKSIZE) drop = 1;
+	    if (ntohs(req.type) == NBD_CMD_READ || drop) length = 0;
+	}
+	if (length && (buffer = realloc(buffer, length)) == NULL) break;
+
+	switch (ntohs(req.type)) {
+	case NBD_CMD_READ:
+	    if (!err && pread(image[i].fd, buffer, length, offset) != length) err = NBD_EIO;
+	    break;
+	case NBD_CMD_WRITE:
+	    if (readall(fd, buffer, length)) goto done;
+	    if (!err && readonly) err = NBD_EPERM;
+	    if (!err && pwrite(image[i].fd, buffer, length, offset) != length) err = NBD_EIO;
+	    break;
+	case NBD_CMD_FLUSH:
+	    if (fdatasync(image[i].fd)) err = NBD_EIO;
+	    break;
+	default:
+	    err = NBD_EINVAL;
+	    break;
+	}
+
+	rep.magic = htonl(NBD_REPMAGIC);
+	rep.error = htonl(err);
+	rep.handle = req.handle;
+	if (writeall(fd, &rep, sizeof(rep))) break;
+	if (ntohs(req.type) == NBD_CMD_READ && !err && writeall(fd, buffer, length)) break;
+	if (drop) {
+	    if (logging) fprintf(stderr, "oversized write from client of '%s'\n", image[i].name);
+	    break;
+	}
+    }
+
+ done:
+    if (logging) fprintf(stderr, "client left '%s'\n", image[i].name);
+    if (buffer) free(buffer);
+    close(fd);
+    return NULL;
+}
+
+
+
+//
+// open a listening socket on a TCP port or a Unix socket path
+//
+static int32_t listener (char *port,
+			 char *path)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct sockaddr_un sun;
+    struct stat st;
+    int32_t fd;
+    int32_t on = 1;
+
+    if (path) {
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) fatal("socket path '%s' too long", path);
+	strcpy(sun.sun_path, path);
+	// a socket left behind by an earlier run is replaced, nothing else is
+	if (lstat(path, &st) == 0) {
+	    if (!S_ISSOCK(st.st_mode)) fatal("'%s' exists and is not a socket", path);
+	    unlink(path);
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+	    || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(fd, 8))
+	    fatal("cannot listen on '%s'", path);
+	return fd;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET6;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &res)) {
+	hints.ai_family = AF_INET;
+	if (getaddrinfo(NULL, port, &hints, &res)) fatal("bad port '%s'", port);
+    }
+    if ((fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0)
+	fatal("cannot open a socket");
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, 8))
+	fatal("cannot listen on port %s", port);
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+
+
+//
+// main program
+//
+int main (int argc,
+	  char *argv[])
+{
+    struct stat st;
+    pthread_t thread;
+    char *port = "10809";
+    char *path = NULL;
+    char *p;
+    int32_t errors = 0;
+    int32_t lfd;
+    int32_t fd;
+    int32_t on = 1;
+    long i;
+
+    // switch options
+    int opt_index = 0;
+    char opt_short[] = "Vvrp:s:";
+    static struct option opt_long[] = {
+	{ "version",	no_argument,       NULL, 'V' },
+	{ "verbose",	no_argument,       NULL, 'v' },
+	{ "readonly",	no_argument,       NULL, 'r' },
+	{ "port",	required_argument, NULL, 'p' },
+	{ "socket",	required_argument, NULL, 's' },
+	{ NULL,		no_argument,       NULL, 0   }
+    };
+
+    // process command line options
+    while ((i = getopt_long(argc, argv, opt_short, opt_long, &opt_index)) != -1) {
+	switch (i) {
+	case 'V':  fprintf(stderr, "%s\n", version);  break;
+	case 'v':  logging = 1;  break;
+	case 'r':  readonly = 1;  break;
+	case 'p':  port = optarg;  break;
+	case 's':  path = optarg;  break;
+	default:   errors++; break;
+	}
+    }
+    argc -= optind;
+    argv += optind;
+
+    // any error seen, die and print out some help
+    if (errors || argc < 1 || argc > NBDIMAGES)
+	fatal("illegal command line\n" \
+	      "  %s\n" \
+	      "  Usage: tu58nbd [-options] IMAGE ...\n" \
+	      "  Options: -V | --version            output version string\n" \
+	      "           -v | --verbose            log clients as they come and go\n" \
+	      "           -r | --readonly           refuse writes\n" \
+	      "           -p | --port PORT          listen on TCP port PORT; default 10809\n" \
+	      "           -s | --socket PATH        listen on Unix socket PATH instead\n",
+	      version);
+
+    // each image is exported by its name without the directory
+    for (i = 0; i < argc; i++) {
+	image[i].path = argv[i];
+	image[i].name = (p = strrchr(argv[i], '/')) ? p+1 : argv[i];
+	if ((image[i].fd = open(argv[i], O_BINARY|(readonly ? O_RDONLY : O_RDWR))) < 0
+	    || fstat(image[i].fd, &st))
+	    fatal("cannot open image '%s'", argv[i]);
+	image[i].size = st.st_size;
+	if (image[i].size == 0 || image[i].size % BLOCKSIZE)
+	    fatal("image '%s' is not a whole number of blocks", argv[i]);
+	fprintf(stderr, "export '%s' %lld blocks\n", image[i].name, (long long)image[i].size/BLOCKSIZE);
+    }
+    nimages = argc;
+
+    // a client going away mid reply is not fatal
+    signal(SIGPIPE, SIG_IGN);
+
+    lfd = listener(port, path);
+    for (;;) {
+	if ((fd = accept(lfd, NULL, NULL)) < 0) continue;
+	if (!path) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (pthread_create(&thread, NULL, client, (void *)(intptr_t)fd)) { close(fd); continue; }
+	pthread_detach(thread);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+
+// the end
@@ -0,0 +1,452 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 Virtual RT-11 volumes
+//
+// A host directory can be put in a unit as an RT-11 volume. The boot
+// block, home block and directory are built in memory from a listing of
+// the directory when the unit is opened, with one RT-11 file for each host
+// file whose name fits NAME.EXT; file blocks are read from the host files
+// only when the host asks for them. Blocks the host writes are kept in an
+// overlay in memory, so the host files are never touched, unless write back
+// was asked for: then, when the unit is closed, each file of the final
+// RT-11 directory that was written is copied out to the host directory.
+//
+
+
+
+#include "common.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+
+
+// one host file of a volume
+
+typedef struct {
+    vol_file	rt;		// RT-11 name, place and date
+    char	*host;		// host file name
+    off_t	size;		// host file size in bytes
+} vdir_file;
+
+// per unit volume state
+
+static struct {
+    char	*dir;		// host directory, NULL if none
+    int32_t	nblocks;	// blocks in the volume
+    int32_t	sys;		// blocks of boot block, home block and directory
+    uint8_t	*meta;		// those blocks
+    vdir_file	*files;		// host files, in volume order
+    int32_t	nfiles;		// number of files
+    uint8_t	**over;		// overlay block written by the host, per block
+    int32_t	written;	// number of blocks in the overlay
+    uint8_t	writeback;	// copy written files back at close
+} vd [NTU58];
+
+
+
+//
+// init volume state for all units
+//
+void vdirinit (void)
+{
+    int32_t unit;
+
+    for (unit = 0; unit < NTU58; unit++) {
+	vd[unit].dir = NULL;
+	vd[unit].meta = NULL;
+	vd[unit].files = NULL;
+	vd[unit].over = NULL;
+    }
+    return;
+}
+
+
+
+//
+// compare volume files by RT-11 name, then host name
+//
+static int filecmp (const void *a,
+		    const void *b)
+{
+    int n = strcmp(((vdir_file *)a)->rt.name, ((vdir_file *)b)->rt.name);
+
+    return n ? n : strcmp(((vdir_file *)a)->host, ((vdir_file *)b)->host);
+}
+
+
+
+//
+// list the host files that can be RT-11 files, sorted by name
+//
+static int32_t vdirscan (int32_t unit)
+{
+    struct dirent *de;
+    struct stat st;
+    vdir_file *more;
+    char path[PATH_MAX];
+    char name[11];
+    DIR *dp;
+    int32_t i;
+
+    if ((dp = opendir(vd[unit].dir)) == NULL) return -1;
+
+    while ((de = readdir(dp)) != NULL) {
+	if (rt11name(de->d_name, name)) continue;
+	if (snprintf(path, sizeof(path), "%s/%s", vd[unit].dir, de->d_name) >= sizeof(path)) {
+	    info("vdir '%s' skips '%s', path too long", vd[unit].dir, de->d_name);
+	    continue;
+	}
+	if (stat(path, &st) || !S_ISREG(st.st_mode)) continue;
+	if ((more = realloc(vd[unit].files, (vd[unit].nfiles+1)*sizeof(vdir_file))) == NULL) break;
+	vd[unit].files = more;
+	strcpy(more[vd[unit].nfiles].rt.name, name);
+	more[vd[unit].nfiles].rt.length = (st.st_size+BLOCKSIZE-1)/BLOCKSIZE;
+	more[vd[unit].nfiles].rt.date = rt11date(st.st_mtime);
+	more[vd[unit].nfiles].host = strdup(de->d_name);
+	more[vd[unit].nfiles].size = st.st_size;
+	vd[unit].nfiles++;
+    }
+    closedir(dp);
+
+    qsort(vd[unit].files, vd[unit].nfiles, sizeof(vdir_file), filecmp);
+
+    // names differing only in case map to the same RT-11 name, keep the first
+    for (i = 1; i < vd[unit].nfiles; i++) {
+	if (strcmp(vd[unit].files[i].rt.name, vd[unit].files[i-1].rt.name)) continue;
+	info("vdir '%s' skips '%s', same RT-11 name as '%s'",
+	     vd[unit].dir, vd[unit].files[i].host, vd[unit].files[i-1].host);
+	free(vd[unit].files[i].host);
+	memmove(vd[unit].files+i, vd[unit].files+i+1, (vd[unit].nfiles-i-1)*sizeof(vdir_file));
+	vd[unit].nfiles--;
+	i--;
+    }
+
+    return 0;
+}
+
+
+
+//
+// release the volume state of a unit
+//
+static void vdirfree (int32_t unit)
+{
+    int32_t i;
+
+    if (vd[unit].over) {
+	for (i = 0; i < vd[unit].nblocks; i++) if (vd[unit].over[i]) free(vd[unit].over[i]);
+	free(vd[unit].over);
+    }
+    for (i = 0; i < vd[unit].nfiles; i++) free(vd[unit].files[i].host);
+    if (vd[unit].files) free(vd[unit].files);
+    if (vd[unit].meta) free(vd[unit].meta);
+    if (vd[unit].dir) free(vd[unit].dir);
+
+    vd[unit].dir = NULL;
+    vd[unit].meta = NULL;
+    vd[unit].files = NULL;
+    vd[unit].nfiles = 0;
+    vd[unit].over = NULL;
+    vd[unit].written = 0;
+    return;
+}
+
+
+
+//
+// present a host directory as a volume of at least nblocks
+//
+// the volume is made larger if the files need it; returns its size in
+// blocks, or -1 if the directory cannot be read
+//
+int32_t vdiropen (int32_t unit,
+		  char *dir,
+		  int32_t nblocks,
+		  int32_t writeback)
+{
+    vol_file *list;
+    int32_t segments;
+    int32_t status;
+    int32_t used;
+    int32_t i;
+
+    vdirfree(unit);
+
+    if ((vd[unit].dir = strdup(dir)) == NULL || vdirscan(unit)) {
+	vdirfree(unit);
+	return -1;
+    }
+
+    // as many files as fit in the largest directory and volume
+    segments = rt11_segments(RT11MAX);
+    for (i = used = 0; i < vd[unit].nfiles; i++) {
+	if (i >= rt11_capacity(segments) || rt11_sysblocks(segments)+used+vd[unit].files[i].rt.length > RT11MAX) {
+	    error("vdir '%s' is too big, only the first %d files are on the volume", dir, i);
+	    vd[unit].nfiles = i;
+	    break;
+	}
+	used += vd[unit].files[i].rt.length;
+    }
+
+    // the directory is the size INIT would give the volume, or enough for
+    // the files; a volume grown to hold them gets an eighth more free space
+    if (nblocks > RT11MAX) nblocks = RT11MAX;
+    used += used/8;
+    for (segments = rt11_segments(nblocks); segments < rt11_segments(RT11MAX); segments++)
+	if (vd[unit].nfiles <= rt11_capacity(segments)) break;
+    if (nblocks < rt11_sysblocks(segments)+used) nblocks = rt11_sysblocks(segments)+used;
+    if (segments < rt11_segments(nblocks)) segments = rt11_segments(nblocks);
+    if (nblocks < rt11_sysblocks(segments)+used) nblocks = rt11_sysblocks(segments)+used;
+    if (nblocks > RT11MAX) nblocks = RT11MAX;
+
+    vd[unit].nblocks = nblocks;
+    vd[unit].sys = rt11_sysblocks(segments);
+    vd[unit].writeback = writeback ? 1 : 0;
+
+    if ((vd[unit].meta = calloc(vd[unit].sys, BLOCKSIZE)) == NULL
+	|| (vd[unit].over = calloc(nblocks, sizeof(uint8_t *))) == NULL) {
+	vdirfree(unit);
+	return -1;
+    }
+
+    // lay out the files and build the directory
+    if ((list = malloc((vd[unit].nfiles+1)*sizeof(vol_file))) == NULL) {
+	vdirfree(unit);
+	return -1;
+    }
+    for (i = 0; i < vd[unit].nfiles; i++) list[i] = vd[unit].files[i].rt;
+    status = rt11format(vd[unit].meta, nblocks, segments, list, vd[unit].nfiles);
+    for (i = 0; i < vd[unit].nfiles; i++) vd[unit].files[i].rt.start = list[i].start;
+    free(list);
+    if (status) {
+	vdirfree(unit);
+	return -1;
+    }
+
+    info("vdir '%s' has %d files in %d blocks", dir, vd[unit].nfiles, nblocks);
+    return nblocks;
+}
+
+
+
+//
+// read a block of a volume
+//
+// written blocks come from the overlay, the boot block, home block and
+// directory from memory, file blocks from the host file, the rest is zero
+//
+int32_t vdirread (int32_t unit,
+		  int32_t block,
+		  uint8_t *buffer)
+{
+    vdir_file *f;
+    char path[PATH_MAX];
+    int32_t lo = 0;
+    int32_t hi;
+    int32_t mid;
+    int32_t count;
+    int32_t fd;
+
+    if (block < 0 || block >= vd[unit].nblocks) return -1;
+
+    if (vd[unit].over[block]) {
+	memcpy(buffer, vd[unit].over[block], BLOCKSIZE);
+	return 0;
+    }
+
+    if (block < vd[unit].sys) {
+	memcpy(buffer, vd[unit].meta + block*BLOCKSIZE, BLOCKSIZE);
+	return 0;
+    }
+
+    memset(buffer, 0, BLOCKSIZE);
+
+    // files are in block order, find the last one starting at or before block
+    for (hi = vd[unit].nfiles; lo < hi; ) {
+	mid = (lo+hi)/2;
+	if (vd[unit].files[mid].rt.start <= block) lo = mid+1; else hi = mid;
+    }
+    if (lo == 0) return 0;
+    f = &vd[unit].files[lo-1];
+    if (block >= f->rt.start + f->rt.length) return 0;
+
+    // a short last block reads as zero past the end of the host file
+    if (snprintf(path, sizeof(path), "%s/%s", vd[unit].dir, f->host) >= sizeof(path)) return -1;
+    if ((fd = open(path, O_BINARY|O_RDONLY)) < 0) return -1;
+    count = pread(fd, buffer, BLOCKSIZE, (off_t)(block - f->rt.start)*BLOCKSIZE);
+    close(fd);
+
+    return count < 0 ? -1 : 0;
+}
+
+
+
+//
+// write a block of a volume into the overlay
+//
+int32_t vdirwrite (int32_t unit,
+		   int32_t block,
+		   uint8_t *buffer)
+{
+    if (block < 0 || block >= vd[unit].nblocks) return -1;
+
+    if (!vd[unit].over[block]) {
+	if ((vd[unit].over[block] = malloc(BLOCKSIZE)) == NULL) return -1;
+	vd[unit].written++;
+    }
+    memcpy(vd[unit].over[block], buffer, BLOCKSIZE);
+
+    return 0;
+}
+
+
+
+//
+// read a block for rt11dir()
+//
+static int32_t getblock (void *ctx,
+			 int32_t block,
+			 uint8_t *buffer)
+{
+    return vdirread((intptr_t)ctx, block, buffer);
+}
+
+
+
+//
+// copy the files of the final directory that were written to the host
+//
+// a file is copied when it is new, has moved, or has any written block;
+// it replaces the host file of the same name by way of a temporary file.
+// A last block still holding the host file's own data is cut back to the
+// host file's size, so text files do not come back padded with nulls.
+// Files deleted on the volume are left alone on the host.
+//
+static int32_t vdirsync (int32_t unit)
+{
+    uint8_t buffer[BLOCKSIZE];
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+    vol_file *list;
+    vdir_file *f;
+    char host[11];
+    int32_t nfiles;
+    int32_t copied = 0;
+    int32_t block;
+    int32_t last;
+    int32_t fd;
+    int32_t i;
+    int32_t j;
+    off_t tail;
+
+    if ((list = malloc(rt11_capacity(rt11_segments(RT11MAX))*sizeof(vol_file))) == NULL) return -1;
+
+    if ((nfiles = rt11dir(getblock, (void *)(intptr_t)unit, list, rt11_capacity(rt11_segments(RT11MAX)))) < 0) {
+	error("vdir '%s' has no sensible directory to write back", vd[unit].dir);
+	free(list);
+	return -2;
+    }
+
+    for (i = 0; i < nfiles; i++) {
+
+	// the host file the volume started with, if any
+	for (f = NULL, j = 0; j < vd[unit].nfiles && !f; j++)
+	    if (!strcmp(vd[unit].files[j].rt.name, list[i].name)) f = &vd[unit].files[j];
+
+	block = list[i].start;
+	if (f && f->rt.start == block && f->rt.length == list[i].length)
+	    while (block < list[i].start + list[i].length && !vd[unit].over[block]) block++;
+	if (f && block == list[i].start + list[i].length) continue;
+
+	// a new file is named after its RT-11 name
+	rt11host(list[i].name, host);
+
+	if (snprintf(path, sizeof(path), "%s/%s", vd[unit].dir, f ? f->host : host) >= sizeof(path)
+	    || snprintf(temp, sizeof(temp), "%s/.%s.tu58", vd[unit].dir, f ? f->host : host) >= sizeof(temp)) {
+	    error("vdir cannot write '%s/%s', path too long", vd[unit].dir, f ? f->host : host);
+	    continue;
+	}
+	if ((fd = open(temp, O_BINARY|O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0) {
+	    error("vdir cannot write '%s'", temp);
+	    continue;
+	}
+	// the bytes of the host file left for an unwritten last block
+	last = list[i].start + list[i].length - 1;
+	tail = BLOCKSIZE;
+	if (f && f->rt.start == list[i].start && f->rt.length == list[i].length && !vd[unit].over[last]
+	    && f->size > (off_t)(list[i].length-1)*BLOCKSIZE && f->size < (off_t)list[i].length*BLOCKSIZE)
+	    tail = f->size - (off_t)(list[i].length-1)*BLOCKSIZE;
+
+	for (block = list[i].start; block <= last; block++)
+	    if (vdirread(unit, block, buffer)
+		|| write(fd, buffer, block < last ? BLOCKSIZE : tail) != (block < last ? BLOCKSIZE : tail)) break;
+	if (close(fd) || block <= last || rename(temp, path)) {
+	    error("vdir cannot write '%s'", path);
+	    unlink(temp);
+	    continue;
+	}
+	copied++;
+    }
+
+    free(list);
+    info("vdir '%s' wrote back %d files", vd[unit].dir, copied);
+    return 0;
+}
+
+
+
+//
+// close a volume, copying written files back to the host if asked
+//
+void vdirclose (int32_t unit)
+{
+    if (vd[unit].dir && vd[unit].writeback && vd[unit].written) vdirsync(unit);
+    vdirfree(unit);
+    return;
+}
+
+
+
+// the end
@@ -0,0 +1,370 @@
+//
+// tu58 - Emulate a TU58 over a serial line
+//
+// Original (C) 1984 Dan Ts'o <Rockefeller Univ. Dept. of Neurobiology>
+// Update   (C) 2005-2017 Donald N North <ak6dn_at_mindspring_dot_com>
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// o Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// 
+// o Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+// 
+// o Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// This is the TU58 emulation program written at Rockefeller Univ., Dept. of
+// Neurobiology. We copyright (C) it and permit its use provided it is not
+// sold to others. Originally written by Dan Ts'o circa 1984 or so.
+
+
+
+//
+// TU58 XXDP volumes
+//
+// An XXDP volume has a master file directory in blocks 1 (MFD1, which
+// also lists the BITMAP blocks) and 2 (MFD2, which points to the user file
+// directory), a chain of UFD blocks from block 3, BITMAP blocks from block
+// 7, then the monitor area. UFD blocks and files are chains of blocks, each
+// starting with a link to the next block (0 in the last), so a file block
+// holds 510 bytes of data. A UFD entry is nine words: name and extension
+// in RAD50, DOS-11 date, spare, first block, length, last block, spare.
+//
+
+
+
+#include "common.h"
+
+
+
+#define XXDP_MAPBLOCKS	960	// blocks covered by a BITMAP block, 60. words
+#define XXDP_MONITOR	32	// blocks reserved for the monitor
+#define XXDP_MAPSTART	7	// first BITMAP block
+#define XXDP_ENTRY	9	// words per UFD entry
+#define XXDP_DATA	(BLOCKSIZE-2) // data bytes in a file block
+
+
+
+//
+// number of BITMAP blocks for a volume size
+//
+static int32_t xxdp_maps (int32_t nblocks)
+{
+    return (nblocks + XXDP_MAPBLOCKS-1) / XXDP_MAPBLOCKS;
+}
+
+
+
+//
+// number of blocks before the monitor area, boot through BITMAP
+//
+int32_t xxdp_sysblocks (int32_t nblocks)
+{
+    return XXDP_MAPSTART + xxdp_maps(nblocks);
+}
+
+
+
+//
+// DOS-11 date word for a host time, 0 (no date) before 1970
+//
+uint16_t xxdpdate (time_t t)
+{
+    struct tm *tm = localtime(&t);
+
+    if (tm == NULL || tm->tm_year < 70 || tm->tm_year > 70+65) return 0;
+
+    return (tm->tm_year-70)*1000 + tm->tm_yday+1;
+}
+
+
+
+//
+// build the directory structures of an empty volume in buffer (based on XXDPv2.5)
+//
+// buffer holds xxdp_sysblocks(nblocks) zeroed blocks
+//
+int32_t xxdpformat (uint8_t *buffer,
+		    int32_t nblocks)
+{
+    uint16_t *buf;
+    int32_t nmaps;
+    int32_t used;
+    int32_t block;
+    int32_t i;
+
+    static int16_t mfd2[] = { // MFD2
+	0000000, // no more MFDs
+	0000401, // uic [1,1]
+	0000003, // ptr to 1st UFD block
+	0000011  // 9. words per UFD entry
+    };
+
+    static int16_t ufd1[] = { // UFD#1 (empty directory)
+	0000004  // ptr to UFD#2
+    };
+
+    static int16_t ufd2[] = { // UFD#2 (empty directory)
+	0000005  // ptr to UFD#3
+    };
+
+    static int16_t ufd3[] = { // UFD#3 (empty directory)
+	0000006  // ptr to UFD#4
+    };
+
+    static int16_t ufd4[] = { // UFD#4 (empty directory)
+	0000000  // no more UFDs
+    };
+
+    static struct {
+	int16_t *data;
+	int16_t length;
+	int32_t  offset;
+    } table[] = {
+	{ mfd2, sizeof(mfd2), 02000 },
+	{ ufd1, sizeof(ufd1), 03000 },
+	{ ufd2, sizeof(ufd2), 04000 },
+	{ ufd3, sizeof(ufd3), 05000 },
+	{ ufd4, sizeof(ufd4), 06000 },
+	{ NULL, 0, 0 }
+    };
+
+    if (nblocks > TAPEMAX) return -1;
+
+    // now copy data from the table
+    for (i = 0; table[i].length; i++)
+	memcpy(buffer + table[i].offset, table[i].data, table[i].length);
+
+    // enough BITMAP blocks to cover the tape, from block 7 on, then
+    // the monitor area; all of that and blocks 0..6 are allocated
+    nmaps = xxdp_maps(nblocks);
+    used = XXDP_MAPSTART + nmaps + XXDP_MONITOR;
+
+    // MFD1 points to MFD2 and lists the BITMAP blocks
+    buf = (uint16_t *)(buffer + 01000);
+    buf[0] = 0000002; // ptr to MFD2
+    buf[1] = 0000001; // interleave factor
+    buf[2] = XXDP_MAPSTART; // BITMAP start block number
+    for (i = 0; i < nmaps; i++) buf[3+i] = XXDP_MAPSTART+i; // ptr to each BITMAP block
+
+    for (i = 0; i < nmaps; i++) {
+	buf = (uint16_t *)(buffer + (XXDP_MAPSTART+i)*BLOCKSIZE);
+	buf[0] = i+1 < nmaps ? XXDP_MAPSTART+i+1 : 0; // ptr to next BITMAP, 0 if none
+	buf[1] = i+1; // map number
+	buf[2] = XXDP_MAPBLOCKS/16; // words per BITMAP
+	buf[3] = XXDP_MAPSTART; // ptr to BITMAP#1
+	for (block = i*XXDP_MAPBLOCKS; block < used && block < (i+1)*XXDP_MAPBLOCKS; block++)
+	    buf[4+(block-i*XXDP_MAPBLOCKS)/16] |= 1 << (block%16);
+    }
+
+    return 0;
+}
+
+
+
+//
+// word n of a block of a volume in memory
+//
+static inline uint16_t *word (uint8_t *image,
+			      int32_t block,
+			      int32_t n)
+{
+    return (uint16_t *)(image + block*BLOCKSIZE) + n;
+}
+
+
+
+//
+// check the MFD of a volume in memory, returns its first UFD block
+//
+static int32_t xxdpmfd (uint8_t *image,
+			int32_t nblocks)
+{
+    int32_t i;
+
+    if (nblocks <= XXDP_MAPSTART
+	|| *word(image, 1, 0) != 2
+	|| *word(image, 1, 2) != XXDP_MAPSTART
+	|| *word(image, 2, 3) != XXDP_ENTRY
+	|| *word(image, 2, 2) < 3 || *word(image, 2, 2) >= nblocks) return -1;
+
+    for (i = 0; i < xxdp_maps(nblocks); i++)
+	if (*word(image, 1, 3+i) < XXDP_MAPSTART || *word(image, 1, 3+i) >= nblocks) return -1;
+
+    return *word(image, 2, 2);
+}
+
+
+
+//
+// allocation bit of a block, in the BITMAP blocks MFD1 lists
+//
+static uint16_t *mapword (uint8_t *image,
+			  int32_t block,
+			  uint16_t *bit)
+{
+    *bit = 1 << (block%16);
+    return word(image, *word(image, 1, 3 + block/XXDP_MAPBLOCKS), 4 + (block%XXDP_MAPBLOCKS)/16);
+}
+
+
+
+//
+// list the files of a volume in memory
+//
+// returns the number of files, or -1 if the directory is not sensible
+//
+int32_t xxdpdir (uint8_t *image,
+		 int32_t nblocks,
+		 vol_file *files,
+		 int32_t max)
+{
+    uint16_t *e;
+    int32_t nfiles = 0;
+    int32_t count = 0;
+    int32_t block;
+    int32_t n;
+
+    if ((block = xxdpmfd(image, nblocks)) < 0) return -1;
+
+    for (; block; block = *word(image, block, 0)) {
+	if (block >= nblocks || ++count > nblocks) return -1;
+	for (n = 1; n + XXDP_ENTRY <= BLOCKSIZE/2; n += XXDP_ENTRY) {
+	    e = word(image, block, n);
+	    if (e[0] == 0 || nfiles >= max) continue;
+	    unrad50name(e, files[nfiles].name);
+	    files[nfiles].date = e[3];
+	    files[nfiles].start = e[5];
+	    files[nfiles].length = e[6];
+	    nfiles++;
+	}
+    }
+
+    return nfiles;
+}
+
+
+
+//
+// copy the data of a file out of a volume in memory
+//
+// buffer holds the file length times 510 bytes; returns the bytes copied,
+// or -1 if the chain of blocks is broken
+//
+int32_t xxdpread (uint8_t *image,
+		  int32_t nblocks,
+		  vol_file *f,
+		  uint8_t *buffer)
+{
+    int32_t block = f->start;
+    int32_t n;
+
+    for (n = 0; n < f->length; n++) {
+	if (block <= 0 || block >= nblocks) return -1;
+	memcpy(buffer + n*XXDP_DATA, image + block*BLOCKSIZE + 2, XXDP_DATA);
+	block = *word(image, block, 0);
+    }
+
+    return n*XXDP_DATA;
+}
+
+
+
+//
+// add a file to a volume in memory, replacing any of the same name
+//
+// returns -1 if the directory is not sensible, -2 if there are not enough
+// free blocks and -3 if the UFD is full
+//
+int32_t xxdpadd (uint8_t *image,
+		 int32_t nblocks,
+		 char *name,
+		 uint8_t *data,
+		 int32_t size,
+		 uint16_t date)
+{
+    uint16_t words[3];
+    uint16_t *slot = NULL;
+    uint16_t *map;
+    uint16_t *e;
+    uint16_t bit;
+    int32_t length = size > 0 ? (size+XXDP_DATA-1)/XXDP_DATA : 1;
+    int32_t first;
+    int32_t block;
+    int32_t last;
+    int32_t avail;
+    int32_t n;
+
+    if ((first = xxdpmfd(image, nblocks)) < 0 || xxdpdir(image, nblocks, NULL, 0) < 0) return -1;
+    rad50name(name, words);
+
+    // an old copy gives back its blocks and its entry
+    for (block = first; block; block = *word(image, block, 0)) {
+	for (n = 1; n + XXDP_ENTRY <= BLOCKSIZE/2; n += XXDP_ENTRY) {
+	    e = word(image, block, n);
+	    if (e[0] == 0 && !slot) slot = e;
+	    if (e[0] == 0 || memcmp(e, words, sizeof(words))) continue;
+	    for (last = e[5]; last > 0 && last < nblocks; last = *word(image, last, 0)) {
+		map = mapword(image, last, &bit);
+		*map &= ~bit;
+	    }
+	    memset(e, 0, XXDP_ENTRY*2);
+	    if (!slot) slot = e;
+	}
+    }
+    if (!slot) return -3;
+
+    // enough free blocks, taken in order so a file on an empty volume is contiguous
+    for (avail = 0, block = xxdp_sysblocks(nblocks); block < nblocks && avail < length; block++)
+	if (!(*mapword(image, block, &bit) & bit)) avail++;
+    if (avail < length) return -2;
+
+    first = last = 0;
+    for (n = 0, block = xxdp_sysblocks(nblocks); n < length; block++) {
+	map = mapword(image, block, &bit);
+	if (*map & bit) continue;
+	*map |= bit;
+	if (last) *word(image, last, 0) = block; else first = block;
+	*word(image, block, 0) = 0;
+	memset(image + block*BLOCKSIZE + 2, 0, XXDP_DATA);
+	if (n*XXDP_DATA < size)
+	    memcpy(image + block*BLOCKSIZE + 2, data + n*XXDP_DATA,
+		   size - n*XXDP_DATA < XXDP_DATA ? size - n*XXDP_DATA : XXDP_DATA);
+	last = block;
+	n++;
+    }
+
+    memcpy(slot, words, sizeof(words));
+    slot[3] = date;
+    slot[4] = 0;
+    slot[5] = first;
+    slot[6] = length;
+    slot[7] = last;
+    slot[8] = 0;
+
+    return 0;
+}
+
+
+
+// the end